@@ -6,138 +6,536 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <signal.h>
 #include <unistd.h>
+#include <cstdarg>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
 #include <ctime>
 #include <cctype>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
+#include "merkle.h"
+#include "transport.h"
+#include "udptransfer.h"
+#include "workingdirectory.h"
 
-constexpr int maxn = 2048;
 
-class WorkingDirectory {
+enum ProgressMode {
+    progressText,   // status line redrawn in place, when stdout is a terminal
+    progressJson,   // one JSON object per line, for scripts
+    progressOff
+};
+
+struct ClientConfig {
+    std::string batchScript;    // "" = interactive, "-" = commands from stdin
+    int sessions;               // parallel sessions used by batch mode
+    int streamThreshold;        // MB from which transfers stream past the page cache, 0 = never
+    bool directIO;              // stream with O_DIRECT instead of fadvise
+    ProgressMode progress;      // transfer progress and summaries
+    int reconnect;              // seconds spent reconnecting after a dropped connection, 0 = exit instead
+    std::string command;        // run this one command instead of prompting, "" = interactive
+    std::string unixPath;       // the server's Unix socket, used instead of address and port when set
+    int prefetch;               // seconds a listing fetched along with cd is used for ls, 0 = no prefetch
+    ClientConfig() : batchScript(""), sessions(4), streamThreshold(64), directIO(false), progress(progressText),
+                     reconnect(60), command(""), unixPath(""), prefetch(0) {}
+};
+
+// Metadata of files already downloaded, kept in Download/.index so that a
+// repeated d of an unchanged file costs a single round trip.  One line per
+// file: name, remote size, remote mtime (ns), content hash (0 = unknown),
+// local size, local mtime and the remote path; the local pair detects edits
+// to the copy.  Files of the same name from different remote directories
+// share the local name, so an entry only counts for the path it came from.
+class DownloadIndex {
 public:
-    static bool isDirExist(const std::string& path) {
+    struct Entry {
+        unsigned long size;
+        unsigned long long mtime;
+        unsigned long long hash;
+        unsigned long localSize;
+        unsigned long long localMtime;
+        std::string remote;
+    };
+
+public:
+    // the entry for localPath, only when it was downloaded from remote and the
+    // local copy is untouched since it was recorded
+    static bool lookup(const std::string& localPath, const std::string& remote, Entry& entry) {
         struct stat st;
-        if (lstat(path.c_str(), &st) != 0) {
-            if (errno == ENOENT) {
-                return false;
-            }
-            else if (errno == EACCES) {
-                return false;
-            }
-            else {
-                return false;
-            }
+        if (stat(localPath.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+            return false;
         }
-        if (S_ISREG(st.st_mode)) {
+        std::lock_guard<std::mutex> guard(lock);
+        std::map<std::string, Entry> index = load(indexPath(localPath));
+        std::map<std::string, Entry>::const_iterator it = index.find(baseName(localPath));
+        if (it == index.end() || it->second.remote != remote ||
+            it->second.localSize != static_cast<unsigned long>(st.st_size) || it->second.localMtime != mtimeOf(st)) {
             return false;
         }
-        else if (S_ISDIR(st.st_mode)) {
-            return true;
+        entry = it->second;
+        return true;
+    }
+    // localSize and localMtime are taken from the file as it is now
+    static void record(const std::string& localPath, Entry entry) {
+        struct stat st;
+        if (stat(localPath.c_str(), &st) < 0) {
+            return;
         }
-        else {
-            return false;
+        entry.localSize = st.st_size;
+        entry.localMtime = mtimeOf(st);
+        std::lock_guard<std::mutex> guard(lock);
+        std::map<std::string, Entry> index = load(indexPath(localPath));
+        index[baseName(localPath)] = entry;
+        save(indexPath(localPath), index);
+    }
+    static void forget(const std::string& localPath) {
+        std::lock_guard<std::mutex> guard(lock);
+        std::map<std::string, Entry> index = load(indexPath(localPath));
+        if (index.erase(baseName(localPath))) {
+            save(indexPath(localPath), index);
         }
     }
+    static unsigned long long mtimeOf(const struct stat& st) {
+        return static_cast<unsigned long long>(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec;
+    }
 
-public:
-    WorkingDirectory() {
-        updatePath();
-        startupPath = path;
+private:
+    static std::mutex lock;
+
+private:
+    static std::string indexPath(const std::string& localPath) {
+        unsigned long pos = localPath.rfind("/");
+        return pos == std::string::npos ? ".index" : localPath.substr(0, pos + 1) + ".index";
+    }
+    static std::string baseName(const std::string& localPath) {
+        unsigned long pos = localPath.rfind("/");
+        return pos == std::string::npos ? localPath : localPath.substr(pos + 1);
+    }
+    static std::map<std::string, Entry> load(const std::string& path) {
+        std::map<std::string, Entry> index;
+        FILE* fp = fopen(path.c_str(), "r");
+        if (!fp) {
+            return index;
+        }
+        char line[maxn];
+        while (fgets(line, maxn, fp)) {
+            char* tab = strchr(line, '\t');
+            Entry entry;
+            int consumed = 0;
+            if (!tab || sscanf(tab + 1, "%lu%llu%llx%lu%llu%n", &entry.size, &entry.mtime, &entry.hash,
+                               &entry.localSize, &entry.localMtime, &consumed) != 5) {
+                continue;
+            }
+            // lines written before the remote path was kept have none and never match
+            const char* remote = tab + 1 + consumed;
+            if (*remote == '\t') {
+                entry.remote = std::string(remote + 1, strcspn(remote + 1, "\n"));
+            }
+            index[std::string(line, tab)] = entry;
+        }
+        fclose(fp);
+        return index;
+    }
+    static void save(const std::string& path, const std::map<std::string, Entry>& index) {
+        std::string tmpPath = path + ".tmp";
+        FILE* fp = fopen(tmpPath.c_str(), "w");
+        if (!fp) {
+            return;
+        }
+        for (const auto& i : index) {
+            fprintf(fp, "%s\t%lu %llu %016llx %lu %llu\t%s\n", i.first.c_str(), i.second.size, i.second.mtime,
+                    i.second.hash, i.second.localSize, i.second.localMtime, i.second.remote.c_str());
+        }
+        fclose(fp);
+        rename(tmpPath.c_str(), path.c_str());
     }
-    virtual ~WorkingDirectory() {
+};
+
+std::mutex DownloadIndex::lock;
+
+std::string jsonEscape(const std::string& src);
+
+// Live view of one u / d data transfer.  The transport reports bytes as they
+// move; a ticker thread samples the count, draws instantaneous and average
+// throughput with an ETA, and flags the transfer as stalled once nothing
+// moved for stallSeconds.  finish() prints the summary, with the time split
+// into setup (command round trip, opening files), data transfer and
+// completion (server commit on upload, closing the file on download).
+class TransferMonitor {
+public:
+    typedef std::chrono::steady_clock Clock;
 
+public:
+    TransferMonitor(const char* op, const std::string& name)
+        : op(op), name(name), total(0), created(Clock::now()), started(created), ended(created),
+          done(0), stalls(0), longestStall(0.0), stopping(false) {}
+    ~TransferMonitor() {
+        stopTicker();
     }
-    void init(const std::string& initPath) {
-        path = convertPath(initPath);
-        startupPath = convertPath(initPath);
+    static void setMode(const ProgressMode& value) {
+        mode = value;
     }
-    std::string getPath() const {
-        return path;
+    // the data starts to flow
+    void begin(const unsigned long& size) {
+        total = size;
+        started = Clock::now();
+        if (mode == progressJson || (mode == progressText && isatty(STDOUT_FILENO))) {
+            ticker = std::thread(&TransferMonitor::tick, this);
+        }
     }
-    std::string getStartupPath() const {
-        return startupPath;
+    void advance(const unsigned long& n) {
+        done.fetch_add(n, std::memory_order_relaxed);
     }
-    std::string changeDir(const std::string& newPath) {
-        if (chdir(newPath.c_str()) < 0) {
-            if (errno == ENOENT) {
-                return newPath + ": No such file or directory";
+    ProgressCallback callback() {
+        return [this](const unsigned long& n) { advance(n); };
+    }
+    // the peer confirmed all of it, including acknowledgements not seen yet
+    void complete() {
+        done.store(total, std::memory_order_relaxed);
+    }
+    // the data is through, completion starts
+    void end() {
+        ended = Clock::now();
+        stopTicker();
+    }
+    void finish(const bool& ok) {
+        if (mode == progressOff) {
+            return;
+        }
+        Clock::time_point now = Clock::now();
+        double setupMs = std::chrono::duration<double, std::milli>(started - created).count();
+        double transferMs = std::chrono::duration<double, std::milli>(ended - started).count();
+        double completeMs = std::chrono::duration<double, std::milli>(now - ended).count();
+        double totalMs = std::chrono::duration<double, std::milli>(now - created).count();
+        unsigned long bytes = done.load(std::memory_order_relaxed);
+        double rate = transferMs > 0 ? bytes / transferMs / 1e3 : 0.0;
+        double overall = totalMs > 0 ? bytes / totalMs / 1e3 : 0.0;
+        if (mode == progressJson) {
+            printf("{\"event\":\"summary\",\"op\":\"%s\",\"file\":\"%s\",\"ok\":%s,\"bytes\":%lu,\"size\":%lu,"
+                   "\"setup_ms\":%.3f,\"transfer_ms\":%.3f,\"complete_ms\":%.3f,\"total_ms\":%.3f,"
+                   "\"mbps\":%.3f,\"overall_mbps\":%.3f,\"stalls\":%d,\"longest_stall_s\":%.1f}\n",
+                   op, jsonEscape(name).c_str(), ok ? "true" : "false", bytes, total, setupMs, transferMs,
+                   completeMs, totalMs, rate, overall, stalls, longestStall);
+        }
+        else {
+            printf("%s in %.3f s: %.2f MB/s transfer, %.2f MB/s overall "
+                   "(setup %.1f ms, transfer %.1f ms, %s %.1f ms)",
+                   formatBytes(bytes).c_str(), totalMs / 1e3, rate, overall, setupMs, transferMs,
+                   strcmp(op, "u") ? "close" : "commit", completeMs);
+            if (stalls > 0) {
+                printf(", %d stall(s), longest %.1f s", stalls, longestStall);
+            }
+            printf("\n");
+        }
+        fflush(stdout);
+    }
+
+private:
+    static constexpr int tickMs = 250;
+    static constexpr int jsonEvery = 4;     // JSON progress once per second
+    static constexpr double stallSeconds = 2.0;
+    static ProgressMode mode;
+    const char* op;
+    std::string name;
+    unsigned long total;
+    Clock::time_point created;
+    Clock::time_point started;
+    Clock::time_point ended;
+    std::atomic<unsigned long> done;
+    int stalls;
+    double longestStall;
+    std::thread ticker;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping;
+
+private:
+    void stopTicker() {
+        if (!ticker.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        ticker.join();
+    }
+    void tick() {
+        Clock::time_point last = started, lastMove = started;
+        unsigned long lastBytes = 0;
+        bool stalled = false;
+        size_t width = 0;
+        std::unique_lock<std::mutex> guard(lock);
+        for (int ticks = 1; !wake.wait_for(guard, std::chrono::milliseconds(tickMs), [this] { return stopping; }); ++ticks) {
+            Clock::time_point now = Clock::now();
+            unsigned long bytes = done.load(std::memory_order_relaxed);
+            double dt = std::chrono::duration<double>(now - last).count();
+            double elapsed = std::chrono::duration<double>(now - started).count();
+            double rate = dt > 0 ? (bytes - lastBytes) / dt / 1e6 : 0.0;
+            double average = elapsed > 0 ? bytes / elapsed / 1e6 : 0.0;
+            double idle = std::chrono::duration<double>(now - lastMove).count();
+            if (bytes != lastBytes) {
+                lastMove = now;
+                stalled = false;
             }
-            else if (errno == ENOTDIR) {
-                return newPath + " is not a directory";
+            else if (idle >= stallSeconds) {
+                if (!stalled) {
+                    ++stalls;
+                    stalled = true;
+                }
+                longestStall = std::max(longestStall, idle);
             }
-            else if (errno == EACCES) {
-                return newPath + ": Permission denied";
+            double eta = average > 0 && total > bytes ? (total - bytes) / (average * 1e6) : -1.0;
+            if (mode == progressJson) {
+                if (ticks % jsonEvery == 0) {
+                    printf("{\"event\":\"progress\",\"op\":\"%s\",\"file\":\"%s\",\"bytes\":%lu,\"size\":%lu,"
+                           "\"mbps\":%.3f,\"avg_mbps\":%.3f,\"eta_s\":%.1f,\"stalled\":%s}\n",
+                           op, jsonEscape(name).c_str(), bytes, total, rate, average, eta,
+                           stalled ? "true" : "false");
+                    fflush(stdout);
+                }
             }
             else {
-                return newPath + ": Unexpected error";
+                char line[256];
+                int n = total || !bytes ?
+                        snprintf(line, sizeof(line), "%s / %s %3.0f%%  %8.2f MB/s  avg %8.2f MB/s  ETA %s",
+                                 formatBytes(bytes).c_str(), formatBytes(total).c_str(),
+                                 total ? 100.0 * bytes / total : 100.0, rate, average, formatSeconds(eta).c_str()) :
+                        // a stream of unknown length
+                        snprintf(line, sizeof(line), "%s  %8.2f MB/s  avg %8.2f MB/s",
+                                 formatBytes(bytes).c_str(), rate, average);
+                if (stalled) {
+                    snprintf(line + n, sizeof(line) - n, "  STALLED %.0f s", idle);
+                }
+                width = std::max(width, strlen(line));
+                printf("\r%-*s", static_cast<int>(width), line);
+                fflush(stdout);
             }
+            last = now;
+            lastBytes = bytes;
         }
-        updatePath();
-        return "";
+        if (width > 0) {
+            printf("\r%*s\r", static_cast<int>(width), "");
+            fflush(stdout);
+        }
+    }
+    static std::string formatBytes(const unsigned long& bytes) {
+        char buffer[32];
+        if (bytes >= 1000000000ul) {
+            snprintf(buffer, sizeof(buffer), "%.2f GB", bytes / 1e9);
+        }
+        else if (bytes >= 1000000ul) {
+            snprintf(buffer, sizeof(buffer), "%.1f MB", bytes / 1e6);
+        }
+        else if (bytes >= 1000ul) {
+            snprintf(buffer, sizeof(buffer), "%.1f kB", bytes / 1e3);
+        }
+        else {
+            snprintf(buffer, sizeof(buffer), "%lu B", bytes);
+        }
+        return buffer;
+    }
+    static std::string formatSeconds(const double& seconds) {
+        if (seconds < 0) {
+            return "--:--";
+        }
+        char buffer[32];
+        long s = static_cast<long>(seconds + 0.5);
+        snprintf(buffer, sizeof(buffer), "%ld:%02ld", s / 60, s % 60);
+        return buffer;
     }
+};
 
-private:
-    std::string path;
-    std::string startupPath;
+ProgressMode TransferMonitor::mode = progressText;
 
-private:
-    void updatePath() {
-        char buffer[maxn];
-        if (!getcwd(buffer, maxn)) {
-            fprintf(stderr, "getcwd Error\nProgram Terminated!\n");
-            exit(EXIT_FAILURE);
-        }
-        path = buffer;
+// -prefetch: the listing of the directory a cd went to, fetched in the same
+// round trip as the cd, so the ls that usually follows is answered locally.
+// It is used for at most maxAge seconds and dropped by any command that may
+// change the directory; changes made by other sessions meanwhile are missed
+// until then.
+class ListingCache {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+public:
+    explicit ListingCache(const int& maxAge) : maxAge(maxAge), valid(false) {}
+    bool enabled() const {
+        return maxAge > 0;
     }
-    std::string convertPath(const std::string& base) {
-        std::string ret = base;
-        if (ret != "/" && ret.back() == '/') {
-            ret.pop_back();
+    void store(const std::string& dir, const std::string& names) {
+        path = dir;
+        listing = names;
+        fetched = Clock::now();
+        valid = true;
+    }
+    bool lookup(const std::string& dir, std::string& names) const {
+        if (!valid || dir != path || Clock::now() - fetched > std::chrono::seconds(maxAge)) {
+            return false;
         }
-        return ret;
+        names = listing;
+        return true;
     }
+    void clear() {
+        valid = false;
+    }
+
+private:
+    int maxAge;
+    bool valid;
+    std::string path;
+    std::string listing;
+    Clock::time_point fetched;
 };
 
 class ClientFunc {
 public:
-    static void q(const int& fd) {
+    // silence progress chatter on stdout, used by batch mode
+    static void setQuiet(const bool& flag) {
+        quiet = flag;
+    }
+    // files of at least thresholdMB stream past the page cache, 0 = never
+    static void setStreaming(const int& thresholdMB, const bool& direct) {
+        streamThreshold = static_cast<unsigned long>(thresholdMB) << 20;
+        directIO = direct;
+    }
+    // name a u/d argument ends up with on the other side
+    static std::string targetName(const std::string& argu) {
+        return getFileName(processArgument(argu));
+    }
+    static std::string targetPath(const std::string& argu) {
+        return processArgument(argu);
+    }
+    // first message of every session, false when the server turned us away;
+    // keeps the session token the server may send along
+    static bool welcome(Transport& conn) {
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        birdRead(conn, buffer);
+        if (std::string(buffer) == "WELCOME" || std::string(buffer).find("WELCOME token = ") == 0) {
+            token = std::string(buffer) == "WELCOME" ? "" : buffer + strlen("WELCOME token = ");
+            return true;
+        }
+        if (std::string(buffer).find("SERVER_BUSY") == 0) {
+            fprintf(stderr, "Remote Server is busy: %s\n", buffer + strlen("SERVER_BUSY "));
+        }
+        else {
+            fprintf(stderr, "Unexpected greeting from Remote Server\n");
+        }
+        return false;
+    }
+    static std::string getToken() {
+        return token;
+    }
+    // Carry on after a reconnect, greeted already: take over the dropped
+    // session lostToken names, or failing that move the new session to
+    // serverPath; then finish the u / d the drop interrupted, from where it
+    // stopped when the other side kept the partial file.  serverPath ends up
+    // as the session's directory.
+    static void resume(Transport& conn, const std::string& lostToken, const WorkingDirectory& wd,
+                       std::string& serverPath) {
+        char buffer[maxn];
+        std::string reason = "no session token";
+        std::string uploadName = "";
+        unsigned long uploadReceived = 0, uploadSize = 0;
+        if (lostToken != "") {
+            cleanBuffer(buffer);
+            snprintf(buffer, maxn, "resume %s", lostToken.c_str());
+            birdWrite(conn, buffer);
+            cleanBuffer(buffer);
+            birdRead(conn, buffer);
+            reason = !strncmp(buffer, "RESUME_FAILED ", 14) ? buffer + 14 : buffer;
+        }
+        if (reason == "RESUMED") {
+            cleanBuffer(buffer);
+            birdRead(conn, buffer);
+            serverPath = buffer;
+            cleanBuffer(buffer);
+            birdRead(conn, buffer);
+            int consumed = 0;
+            if (sscanf(buffer, "UPLOAD %lu %lu %n", &uploadReceived, &uploadSize, &consumed) == 2) {
+                uploadName = buffer + consumed;
+            }
+            // the new connection's own token was dropped in favour of this one
+            token = lostToken;
+            info("Session resumed in %s\n", serverPath.c_str());
+        }
+        else {
+            info("Session not resumed (%s), continuing in a new one\n", reason.c_str());
+            std::string error = cd(conn, "\"" + serverPath + "\"");
+            if (error != "") {
+                fprintf(stderr, "%s\n", error.c_str());
+            }
+            serverPath = pwd(conn);
+        }
+        // interrupted stays set until the transfer is through, a drop on the way retries it
+        if (interrupted.op == "u") {
+            struct stat st;
+            std::string path = processArgument(interrupted.argu);
+            bool partial = uploadName == getFileName(path) && stat(path.c_str(), &st) == 0 &&
+                           static_cast<unsigned long>(st.st_size) == uploadSize;
+            info("Continuing upload of \"%s\" from byte %lu\n", getFileName(path).c_str(),
+                 partial ? uploadReceived : 0);
+            u(conn, interrupted.argu, nullptr, partial ? uploadReceived : 0);
+        }
+        else if (interrupted.op == "d") {
+            info("Continuing download of \"%s\"\n", getFileName(processArgument(interrupted.argu)).c_str());
+            d(conn, interrupted.argu, wd, serverPath, nullptr, true);
+        }
+        interrupted.op = "";
+    }
+    static void q(Transport& conn) {
         char buffer[maxn];
         cleanBuffer(buffer);
         sprintf(buffer, "q");
-        birdWrite(fd, buffer);
+        birdWrite(conn, buffer);
     }
-    static std::string pwd(const int& fd) {
+    static std::string pwd(Transport& conn) {
         char buffer[maxn];
         cleanBuffer(buffer);
         sprintf(buffer, "pwd");
-        birdWrite(fd, buffer);
+        birdWrite(conn, buffer);
         cleanBuffer(buffer);
-        birdRead(fd, buffer);
+        birdRead(conn, buffer);
         return std::string(buffer);
     }
-    static std::string ls(const int& fd) {
+    static std::string ls(Transport& conn) {
         char buffer[maxn];
         cleanBuffer(buffer);
         sprintf(buffer, "ls");
-        birdWrite(fd, buffer);
+        birdWrite(conn, buffer);
+        return readListing(conn);
+    }
+    // the reply to an ls, one name per line
+    static std::string readListing(Transport& conn) {
+        char buffer[maxn];
         cleanBuffer(buffer);
-        birdRead(fd, buffer);
+        birdRead(conn, buffer);
         std::string ret = "";
         int msgLen;
         sscanf(buffer, "%*s%*s%d", &msgLen); // format: length = %d
         for (int i = 0; i < msgLen; ++i) {
-            birdRead(fd, buffer);
+            birdRead(conn, buffer);
             ret += std::string(buffer) + "\n";
         }
         if (ret.back() == '\n') {
@@ -145,19 +543,198 @@ public:
         }
         return ret;
     }
-    static void cd(const int& fd, const std::string& argu) {
+    // Follow dir on the server: its listing, then a line per change as the
+    // server pushes them, until Enter when stdin is a terminal (otherwise
+    // until the connection ends).  After a skipped version or an overflow the
+    // listing is fetched again and the difference printed instead.
+    static bool watch(Transport& conn, const std::string& argu) {
+        std::set<std::string> names;
+        unsigned long long version;
+        if (!watchSnapshot(conn, argu, names, version, true)) {
+            return false;
+        }
+        bool interactive = isatty(STDIN_FILENO);
+        if (interactive) {
+            printf("(press Enter to stop watching)\n");
+        }
+        fflush(stdout);
+        char buffer[maxn];
+        bool gone = false;
+        while (!gone) {
+            if (conn.buffered() < static_cast<size_t>(maxn)) {
+                conn.flush();
+                pollfd pfds[2];
+                pfds[0].fd = conn.getFd();
+                pfds[0].events = POLLIN;
+                pfds[1].fd = interactive ? STDIN_FILENO : -1;
+                pfds[1].events = POLLIN;
+                if (poll(pfds, 2, -1) < 0) {
+                    continue;
+                }
+                if (pfds[1].revents) {
+                    // the line only ends the watch, Ctrl-D as well
+                    char line[maxn];
+                    if (!fgets(line, maxn, stdin)) {
+                        clearerr(stdin);
+                    }
+                    break;
+                }
+            }
+            cleanBuffer(buffer);
+            birdRead(conn, buffer);
+            unsigned long long next;
+            int consumed = 0;
+            if (sscanf(buffer, "EVENT %llu %n", &next, &consumed) != 1) {
+                continue;
+            }
+            if (!strcmp(buffer + consumed, "gone")) {
+                printf("%s is gone\n", processArgument(argu).c_str());
+                gone = true;
+            }
+            else if (next != version + 1 || !strcmp(buffer + consumed, "overflow")) {
+                printf("(missed changes, listing again)\n");
+                if (!watchSnapshot(conn, argu, names, version, false)) {
+                    return false;
+                }
+            }
+            else {
+                version = next;
+                printChange(buffer + consumed, names);
+            }
+            fflush(stdout);
+        }
+        cleanBuffer(buffer);
+        sprintf(buffer, "unwatch");
+        birdWrite(conn, buffer);
+        // whatever was pushed before the server saw unwatch is still shown
+        while (true) {
+            cleanBuffer(buffer);
+            birdRead(conn, buffer);
+            int consumed = 0;
+            if (!strcmp(buffer, "UNWATCHED")) {
+                break;
+            }
+            if (!gone && sscanf(buffer, "EVENT %*u %n", &consumed) == 0 && consumed > 0) {
+                printChange(buffer + consumed, names);
+            }
+        }
+        return true;
+    }
+    // matches are printed as they stream in, or appended to collect;
+    // returns the number of matches, -1 on error
+    static long find(Transport& conn, const std::string& path, const std::string& pattern, std::string* collect = nullptr) {
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        snprintf(buffer, maxn, "find %s %s", path.c_str(), pattern.c_str());
+        birdWrite(conn, buffer);
+        // paths come with newlines and backslashes escaped; collected lists
+        // keep them so, one match per line, the terminal gets the names as they are
+        auto show = [collect](const std::string& match) {
+            if (collect) {
+                collect->append(match);
+                collect->push_back('\n');
+                return;
+            }
+            std::string name;
+            for (size_t i = 0; i < match.length(); ++i) {
+                if (match[i] == '\\' && i + 1 < match.length()) {
+                    name += match[++i] == 'n' ? '\n' : match[i];
+                }
+                else {
+                    name += match[i];
+                }
+            }
+            printf("%s\n", name.c_str());
+        };
+        while (true) {
+            cleanBuffer(buffer);
+            birdRead(conn, buffer);
+            long count;
+            unsigned long length;
+            if (!strncmp(buffer, "MATCH\n", 6)) {
+                for (const char* line = buffer + 6; *line;) {
+                    size_t n = strcspn(line, "\n");
+                    show(std::string(line, n));
+                    line += line[n] ? n + 1 : n;
+                }
+                fflush(stdout);
+            }
+            else if (sscanf(buffer, "LONG %lu", &length) == 1) {
+                // a path longer than a message, in pieces of maxn - 1 bytes
+                std::string match;
+                while (match.length() < length) {
+                    cleanBuffer(buffer);
+                    birdRead(conn, buffer);
+                    match.append(buffer, std::min<unsigned long>(maxn - 1, length - match.length()));
+                }
+                show(match);
+                fflush(stdout);
+            }
+            else if (sscanf(buffer, "END %ld", &count) == 1) {
+                if (collect && !collect->empty()) {
+                    collect->pop_back();
+                }
+                return count;
+            }
+            else {
+                fprintf(stderr, "%s\n", !strncmp(buffer, "ERROR ", 6) ? buffer + 6 : buffer);
+                return -1;
+            }
+        }
+    }
+    // copy / move on the server side, the data never crosses the network;
+    // how, when given, receives the method the server used
+    static bool cp(Transport& conn, const std::string& source, const std::string& target, std::string* how = nullptr) {
+        return copyOrMove(conn, "cp", source, target, how);
+    }
+    static bool mv(Transport& conn, const std::string& source, const std::string& target, std::string* how = nullptr) {
+        return copyOrMove(conn, "mv", source, target, how);
+    }
+    // trace on|off|dump for this session on the server, returns the reply
+    static std::string trace(Transport& conn, const std::string& argu) {
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        snprintf(buffer, maxn, "trace %s", argu.c_str());
+        birdWrite(conn, buffer);
+        cleanBuffer(buffer);
+        birdRead(conn, buffer);
+        return std::string(buffer);
+    }
+    // returns the server's error message, empty on success.  cwd, when
+    // given, receives the new directory from the reply on success.  listing,
+    // when given, receives the listing of the directory the session is in
+    // afterwards: the ls goes out right behind the cd, so both cost one
+    // round trip.
+    static std::string cd(Transport& conn, const std::string& argu, std::string* cwd = nullptr,
+                          std::string* listing = nullptr) {
         const std::string nargu = argu;
         char buffer[maxn];
         cleanBuffer(buffer);
-        sprintf(buffer, "cd %s", nargu.c_str());
-        birdWrite(fd, buffer);
+        snprintf(buffer, maxn, "cd %s%s", cwd ? "-cwd " : "", nargu.c_str());
+        birdWrite(conn, buffer);
+        if (listing) {
+            cleanBuffer(buffer);
+            sprintf(buffer, "ls");
+            birdWrite(conn, buffer);
+        }
         cleanBuffer(buffer);
-        birdRead(fd, buffer);
-        if (std::string(buffer) != "") {
-            printf("%s\n", buffer);
+        birdRead(conn, buffer);
+        std::string ret = buffer;
+        if (listing) {
+            *listing = readListing(conn);
+        }
+        if (cwd && ret.compare(0, 4, "CWD ") == 0) {
+            *cwd = ret.substr(4);
+            ret = "";
+        }
+        else if (cwd && ret.compare(0, 6, "ERROR ") == 0) {
+            ret = ret.substr(6);
         }
+        return ret;
     }
-    static bool u(const int& fd, const std::string& argu) {
+    // offset > 0 continues a partial upload the server kept for this session
+    static bool u(Transport& conn, const std::string& argu, const UdpConfig* udp = nullptr,
+                  const unsigned long& offset = 0) {
         const std::string nargu = processArgument(argu);
         int chk = isExist(nargu);
         if (chk == -2) {
@@ -189,85 +766,771 @@ public:
         struct stat st;
         stat(nargu.c_str(), &st);
         fileSize = st.st_size;
+        TransferMonitor monitor("u", getFileName(nargu));
         char buffer[maxn];
         cleanBuffer(buffer);
-        sprintf(buffer, "u %s", argu.c_str());
-        birdWrite(fd, buffer);
+        if (udp) {
+            sprintf(buffer, "udpu %f %d %s", udp->lossRate, udp->delayMs, argu.c_str());
+        }
+        else if (offset > 0) {
+            sprintf(buffer, "u -resume %lu %lu %s", offset, fileSize, argu.c_str());
+        }
+        else {
+            sprintf(buffer, "u %s", argu.c_str());
+        }
+        birdWrite(conn, buffer);
         cleanBuffer(buffer);
-        birdRead(fd, buffer);
+        birdRead(conn, buffer);
         if (std::string(buffer) == "ERROR_OPEN_FILE") {
             fprintf(stderr, "Cannot open file \"%s\" on Remote Server\n", getFileName(argu.c_str()).c_str());
             fclose(fp);
             return false;
         }
-        printf("Upload File \"%s\"\n", getFileName(nargu).c_str());
+        int udpPort = 0;
+        if (udp && sscanf(buffer, "OK udpport = %d", &udpPort) != 1) {
+            fprintf(stderr, "Cannot set up UDP channel on Remote Server (%s)\n", buffer);
+            fclose(fp);
+            return false;
+        }
+        info("Upload File \"%s\"\n", getFileName(nargu).c_str());
+        // on the same host the server copies straight from our open file
+        bool local = !udp && offset == 0 && conn.isLocal();
+        bool sparse = !udp && offset == 0 && !local && Transport::isSparse(fileno(fp));
         cleanBuffer(buffer);
-        sprintf(buffer, "filesize = %lu", fileSize);
-        birdWrite(fd, buffer);
-        printf("File size: %lu bytes\n", fileSize);
-        birdWriteFile(fd, fp, fileSize);
-        printf("Upload File \"%s\" Completed\n", getFileName(nargu).c_str());
+        sprintf(buffer, "filesize = %lu%s", fileSize, local ? " local" : sparse ? " sparse" : "");
+        if (local) {
+            conn.writeMessage(buffer, fileno(fp));
+        }
+        else {
+            birdWrite(conn, buffer);
+        }
+        info("File size: %lu bytes\n", fileSize);
+        monitor.begin(fileSize - offset);
+        if (local) {
+            monitor.complete();
+        }
+        else if (!udp && !sparse && conn.isRecoverable()) {
+            interrupted.op = "u";
+            interrupted.argu = argu;
+        }
+        try {
+            if (local) {
+                // nothing to send, COMMITTED comes once the server has the copy
+            }
+            else if (udp) {
+                conn.flush();
+                UdpConfig channel = *udp;
+                channel.progress = monitor.callback();
+                UdpTransfer::sendFile(conn.getFd(), udpPort, fileno(fp), fileSize, channel);
+                // UDP_COMPLETE or UDP_FAILED, the commit status below tells the rest
+                cleanBuffer(buffer);
+                birdRead(conn, buffer);
+                if (!strcmp(buffer, "UDP_COMPLETE")) {
+                    monitor.complete();
+                }
+            }
+            else {
+                conn.setProgress(monitor.callback());
+                if (sparse) {
+                    conn.writeSparseFile(fp, fileSize);
+                }
+                else if (offset > 0) {
+                    fseek(fp, offset, SEEK_SET);
+                    conn.writeFile(fp, fileSize - offset);
+                }
+                else if (isStreaming(fileSize)) {
+                    conn.streamWriteFile(fp, fileSize, directIO);
+                }
+                else {
+                    conn.writeFile(fp, fileSize);
+                }
+                // a buffered tail only counts as sent once it left
+                conn.flush();
+                conn.setProgress(nullptr);
+            }
+        }
+        catch (const ConnectionLost&) {
+            fclose(fp);
+            throw;
+        }
+        monitor.end();
         fclose(fp);
+        cleanBuffer(buffer);
+        birdRead(conn, buffer);
+        interrupted.op = "";
+        if (std::string(buffer) != "COMMITTED") {
+            fprintf(stderr, "Upload File \"%s\" Failed: %s\n", getFileName(nargu).c_str(),
+                    !strncmp(buffer, "COMMIT_FAILED ", 14) ? buffer + 14 : buffer);
+            monitor.finish(false);
+            return false;
+        }
+        info("Upload File \"%s\" Completed\n", getFileName(nargu).c_str());
+        monitor.finish(true);
         return true;
     }
-    static bool d(const int& fd, const std::string& argu, const WorkingDirectory& wd) {
+    // resume continues from the end of the partial copy an interrupted d left;
+    // serverPath is the session's directory on the server
+    static bool d(Transport& conn, const std::string& argu, const WorkingDirectory& wd, const std::string& serverPath,
+                  const UdpConfig* udp = nullptr, const bool& resume = false) {
         const std::string nargu = processArgument(argu);
+        std::string filename = downloadPath(wd, nargu);
+        const std::string remote = remotePath(serverPath, nargu);
+        TransferMonitor monitor("d", getFileName(nargu));
+        // ask for the file only if it changed since the copy in Download/
+        DownloadIndex::Entry cached;
+        std::string condition = "";
+        struct stat partial;
+        bool continuing = resume && stat(filename.c_str(), &partial) == 0;
+        if (continuing) {
+            char range[maxn];
+            sprintf(range, "-from %lu %llu ", static_cast<unsigned long>(partial.st_size), interrupted.mtime);
+            condition = range;
+        }
+        else if (DownloadIndex::lookup(filename, remote, cached)) {
+            char validators[maxn];
+            sprintf(validators, "-if %lu %llu %llx ", cached.size, cached.mtime, cached.hash);
+            condition = validators;
+        }
         char buffer[maxn];
         cleanBuffer(buffer);
-        sprintf(buffer, "d %s", argu.c_str());
-        birdWrite(fd, buffer);
-        cleanBuffer(buffer);
-        birdRead(fd, buffer);
-        if (std::string(buffer) == "UNEXPECTED_ERROR") {
-            fprintf(stderr, "Unexpected Error\n");
-            return false;
+        if (udp) {
+            sprintf(buffer, "udpd %f %d %s%s", udp->lossRate, udp->delayMs, condition.c_str(), argu.c_str());
         }
-        else if (std::string(buffer) == "PERMISSION_DENIED") {
-            fprintf(stderr, "%s: Permission denied\n", nargu.c_str());
-            return false;
+        else {
+            sprintf(buffer, "d %s%s", condition.c_str(), argu.c_str());
         }
-        else if (std::string(buffer) == "FILE_NOT_EXIST") {
-            fprintf(stderr, "%s: No such file or directory\n", nargu.c_str());
-            return false;
+        birdWrite(conn, buffer);
+        cleanBuffer(buffer);
+        birdRead(conn, buffer);
+        unsigned long long mtime = 0;
+        if (sscanf(buffer, "NOT_MODIFIED mtime = %llu", &mtime) == 1) {
+            if (mtime != cached.mtime) {
+                cached.mtime = mtime;
+                DownloadIndex::record(filename, cached);
+            }
+            info("File \"%s\" not modified, local copy is up to date\n", getFileName(nargu).c_str());
+            return true;
         }
-        else if (std::string(buffer) == "IS_DIR") {
-            fprintf(stderr, "%s is a directory\n", nargu.c_str());
+        if (refused(buffer, nargu)) {
             return false;
         }
-        else if (std::string(buffer) == "NOT_REGULAR_FILE") {
-            fprintf(stderr, "%s is not a regular file\n", nargu.c_str());
+        DownloadIndex::forget(filename);
+        FILE* fp = fopen(filename.c_str(), continuing ? "r+b" : "wb");
+        if (!fp) {
+            fprintf(stderr, "%s: File Open Error\n", filename.c_str());
+            cleanBuffer(buffer);
+            sprintf(buffer, "ERROR_OPEN_FILE");
+            birdWrite(conn, buffer);
             return false;
         }
-        std::string filename = getFileName(nargu);
-        if (wd.getStartupPath().back() == '/') {
-            filename = wd.getStartupPath() + "Download/" + filename;
+        int udpFd = -1;
+        if (udp) {
+            int udpPort;
+            udpFd = UdpTransfer::openReceiver(conn.getFd(), udpPort);
+            if (udpFd < 0) {
+                fprintf(stderr, "Cannot set up UDP channel\n");
+                cleanBuffer(buffer);
+                sprintf(buffer, "ERROR_UDP_SETUP");
+                birdWrite(conn, buffer);
+                fclose(fp);
+                return false;
+            }
+            cleanBuffer(buffer);
+            sprintf(buffer, "OK udpport = %d", udpPort);
+            birdWrite(conn, buffer);
         }
         else {
-            filename = wd.getStartupPath() + "/Download/" + filename;
-        }
-        FILE* fp = fopen(filename.c_str(), "wb");
-        if (!fp) {
-            fprintf(stderr, "%s: File Open Error\n", filename.c_str());
             cleanBuffer(buffer);
-            sprintf(buffer, "ERROR_OPEN_FILE");
-            birdWrite(fd, buffer);
+            sprintf(buffer, "OK");
+            birdWrite(conn, buffer);
+        }
+        info("Download File \"%s\"\n", getFileName(nargu).c_str());
+        unsigned long fileSize, from = 0;
+        conn.expectFd(!udp && !continuing);
+        birdRead(conn, buffer);
+        sscanf(buffer, "%*s%*s%lu%*s%*s%llu", &fileSize, &mtime);
+        // the server passed its open file along with the size message
+        bool local = !udp && !continuing && strstr(buffer, " local");
+        int sourceFd = local ? conn.takeFd() : -1;
+        conn.expectFd(false);
+        // the server picked where the data starts: after our partial copy, or
+        // at 0 when the file changed in between
+        const char* range = strstr(buffer, " from = ");
+        if (range && sscanf(range, " from = %lu", &from) != 1) {
+            from = 0;
+        }
+        if (continuing && (ftruncate(fileno(fp), from) < 0 || fseek(fp, from, SEEK_SET) < 0)) {
+            fprintf(stderr, "%s: File Write Error\n", filename.c_str());
+            fclose(fp);
             return false;
         }
-        cleanBuffer(buffer);
-        sprintf(buffer, "OK");
-        birdWrite(fd, buffer);
-        printf("Download File \"%s\"\n", getFileName(nargu).c_str());
-        unsigned long fileSize;
-        birdRead(fd, buffer);
-        sscanf(buffer, "%*s%*s%lu", &fileSize);
-        printf("File size: %lu bytes\n", fileSize);
-        birdReadFile(fd, fp, fileSize);
-        printf("Download File \"%s\" Completed\n", getFileName(nargu).c_str());
-        fclose(fp);
-        return true;
-    }
-
-private:
+        info("File size: %lu bytes\n", fileSize);
+        monitor.begin(fileSize - from);
+        // the content hash is computed on the fly over plain TCP only: UDP chunks
+        // arrive out of order and sparse streams skip the holes
+        unsigned long long hash = 0;
+        if (udp) {
+            UdpConfig channel = *udp;
+            channel.progress = monitor.callback();
+            bool ok = UdpTransfer::recvFile(conn.getFd(), udpFd, fileno(fp), fileSize, channel);
+            monitor.end();
+            close(udpFd);
+            cleanBuffer(buffer);
+            sprintf(buffer, "%s", ok ? "UDP_COMPLETE" : "UDP_FAILED");
+            birdWrite(conn, buffer);
+            if (!ok) {
+                fprintf(stderr, "Download File \"%s\" Failed\n", getFileName(nargu).c_str());
+                fclose(fp);
+                monitor.finish(false);
+                return false;
+            }
+        }
+        else if (local) {
+            bool ok = sourceFd >= 0 && Transport::copyFile(sourceFd, fileno(fp), fileSize);
+            if (sourceFd >= 0) {
+                close(sourceFd);
+            }
+            if (!ok) {
+                fprintf(stderr, "Download File \"%s\" Failed: %s\n", getFileName(nargu).c_str(),
+                        sourceFd >= 0 ? strerror(errno) : "no file passed by the server");
+                fclose(fp);
+                monitor.finish(false);
+                return false;
+            }
+            monitor.complete();
+            monitor.end();
+        }
+        else {
+            bool sparse = strstr(buffer, " sparse");
+            if (!sparse && conn.isRecoverable()) {
+                interrupted.op = "d";
+                interrupted.argu = argu;
+                interrupted.mtime = mtime;
+            }
+            conn.setProgress(monitor.callback());
+            try {
+                if (sparse) {
+                    conn.readSparseFile(fp, fileSize);
+                }
+                else if (continuing) {
+                    // the hash would only cover the tail, the index records it as unknown
+                    conn.readFile(fp, fileSize - from);
+                }
+                else if (isStreaming(fileSize)) {
+                    conn.streamReadFile(fp, fileSize, directIO, &hash);
+                }
+                else {
+                    conn.readFile(fp, fileSize, &hash);
+                }
+            }
+            catch (const ConnectionLost&) {
+                fclose(fp);
+                throw;
+            }
+            interrupted.op = "";
+            conn.setProgress(nullptr);
+            monitor.end();
+        }
+        info("Download File \"%s\" Completed\n", getFileName(nargu).c_str());
+        fclose(fp);
+        DownloadIndex::Entry entry;
+        entry.size = fileSize;
+        entry.mtime = mtime;
+        entry.hash = hash;
+        entry.remote = remote;
+        DownloadIndex::record(filename, entry);
+        monitor.finish(true);
+        return true;
+    }
+    // u - <name>: stdin to name on the server, sent in chunks as it arrives,
+    // so a pipeline never needs a temp file; cannot be resumed after a drop
+    static bool uStream(Transport& conn, const std::string& argu) {
+        const std::string name = getFileName(processArgument(argu));
+        TransferMonitor monitor("u", name);
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        snprintf(buffer, maxn, "u %s", argu.c_str());
+        birdWrite(conn, buffer);
+        cleanBuffer(buffer);
+        birdRead(conn, buffer);
+        if (std::string(buffer) == "ERROR_OPEN_FILE") {
+            fprintf(stderr, "Cannot open file \"%s\" on Remote Server\n", name.c_str());
+            return false;
+        }
+        info("Upload stdin to \"%s\"\n", name.c_str());
+        cleanBuffer(buffer);
+        sprintf(buffer, "filesize = 0 chunked");
+        birdWrite(conn, buffer);
+        monitor.begin(0);
+        conn.setProgress(monitor.callback());
+        unsigned long size = conn.writeChunkedFile(stdin);
+        conn.flush();
+        conn.setProgress(nullptr);
+        monitor.end();
+        cleanBuffer(buffer);
+        birdRead(conn, buffer);
+        if (std::string(buffer) != "COMMITTED") {
+            fprintf(stderr, "Upload to \"%s\" Failed: %s\n", name.c_str(),
+                    !strncmp(buffer, "COMMIT_FAILED ", 14) ? buffer + 14 : buffer);
+            monitor.finish(false);
+            return false;
+        }
+        info("Upload to \"%s\" Completed, %lu bytes\n", name.c_str(), size);
+        monitor.finish(true);
+        return true;
+    }
+    // d <file> -: the file to stdout instead of Download/, for a pipeline;
+    // nothing else is printed on stdout
+    static bool dStream(Transport& conn, const std::string& argu) {
+        const std::string nargu = processArgument(argu);
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        snprintf(buffer, maxn, "d -stream %s", argu.c_str());
+        birdWrite(conn, buffer);
+        cleanBuffer(buffer);
+        birdRead(conn, buffer);
+        if (refused(buffer, nargu)) {
+            return false;
+        }
+        cleanBuffer(buffer);
+        sprintf(buffer, "OK");
+        birdWrite(conn, buffer);
+        cleanBuffer(buffer);
+        birdRead(conn, buffer);
+        unsigned long fileSize;
+        sscanf(buffer, "%*s%*s%lu", &fileSize);
+        fflush(stdout);
+        conn.readFile(stdout, fileSize);
+        return true;
+    }
+    // Compare the server's Merkle tree of file with the copy in Download/ and
+    // report the blocks that differ.  With repair, the copy is first cut or
+    // extended to the remote size, then only the differing blocks are fetched,
+    // with ranged d's, and the result is checked against the remote root.
+    static bool hash(Transport& conn, const std::string& argu, const WorkingDirectory& wd, const std::string& serverPath,
+                     const bool& repair) {
+        const std::string nargu = processArgument(argu);
+        const std::string filename = downloadPath(wd, nargu);
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        snprintf(buffer, maxn, "hash %s", argu.c_str());
+        birdWrite(conn, buffer);
+        cleanBuffer(buffer);
+        birdRead(conn, buffer);
+        unsigned long size, blockSize;
+        unsigned long long mtime;
+        int levels;
+        char rootHex[maxn];
+        MerkleTree::Digest remoteRoot;
+        if (sscanf(buffer, "MERKLE size = %lu mtime = %llu block = %lu levels = %d root = %64s", &size, &mtime,
+                   &blockSize, &levels, rootHex) != 5 || !MerkleTree::fromHex(rootHex, remoteRoot)) {
+            fprintf(stderr, "%s\n", !strncmp(buffer, "ERROR ", 6) ? buffer + 6 : buffer);
+            return false;
+        }
+        info("Remote \"%s\": %lu bytes, blocks of %lu bytes, root %s\n", getFileName(nargu).c_str(), size,
+             blockSize, rootHex);
+        FILE* fp = fopen(filename.c_str(), repair ? "r+b" : "rb");
+        if (!fp && repair && errno == ENOENT) {
+            fp = fopen(filename.c_str(), "w+b");
+        }
+        if (!fp) {
+            if (!repair && errno == ENOENT) {
+                info("No local copy in Download/\n");
+                return true;
+            }
+            fprintf(stderr, "%s: File Open Error\n", filename.c_str());
+            return false;
+        }
+        struct stat st;
+        fstat(fileno(fp), &st);
+        if (static_cast<unsigned long>(st.st_size) != size) {
+            if (!repair) {
+                info("Local copy has %lu bytes, remote %lu\n", static_cast<unsigned long>(st.st_size), size);
+                fclose(fp);
+                return true;
+            }
+            if (ftruncate(fileno(fp), size) < 0) {
+                fprintf(stderr, "%s: File Write Error\n", filename.c_str());
+                fclose(fp);
+                return false;
+            }
+        }
+        MerkleTree local;
+        std::vector<unsigned long> blocks;
+        if (!local.build(fileno(fp), size, blockSize, 0) || local.levels() != levels) {
+            fprintf(stderr, "%s: File Read Error\n", filename.c_str());
+            fclose(fp);
+            return false;
+        }
+        bool compared;
+        try {
+            compared = differingBlocks(conn, local, remoteRoot, blocks);
+        }
+        catch (const ConnectionLost&) {
+            fclose(fp);
+            throw;
+        }
+        if (!compared) {
+            fclose(fp);
+            return false;
+        }
+        // runs of consecutive blocks, one ranged d each
+        std::vector<std::pair<unsigned long, unsigned long>> runs;
+        for (unsigned long block : blocks) {
+            if (!runs.empty() && runs.back().second == block) {
+                ++runs.back().second;
+            }
+            else {
+                runs.push_back(std::make_pair(block, block + 1));
+            }
+        }
+        if (blocks.empty()) {
+            info("Local copy matches\n");
+        }
+        else {
+            std::string list = "";
+            for (const auto& run : runs) {
+                if (&run - &runs.front() == 32) {
+                    list += ", ...";
+                    break;
+                }
+                list += (list == "" ? "" : ", ") + std::to_string(run.first);
+                if (run.second - run.first > 1) {
+                    list += "-" + std::to_string(run.second - 1);
+                }
+            }
+            info("%lu of %lu block(s) differ: %s\n", static_cast<unsigned long>(blocks.size()),
+                 static_cast<unsigned long>(local.width(0)), list.c_str());
+        }
+        if (!repair) {
+            fclose(fp);
+            return true;
+        }
+        DownloadIndex::forget(filename);
+        TransferMonitor monitor("repair", getFileName(nargu));
+        unsigned long total = 0;
+        for (const auto& run : runs) {
+            total += std::min(run.second * blockSize, size) - run.first * blockSize;
+        }
+        monitor.begin(total);
+        conn.setProgress(monitor.callback());
+        for (const auto& run : runs) {
+            unsigned long offset = run.first * blockSize;
+            unsigned long length = std::min(run.second * blockSize, size) - offset;
+            bool fetched;
+            try {
+                fetched = fetchRange(conn, argu, fp, offset, length, mtime);
+            }
+            catch (const ConnectionLost&) {
+                fclose(fp);
+                throw;
+            }
+            if (!fetched) {
+                conn.setProgress(nullptr);
+                fclose(fp);
+                monitor.finish(false);
+                return false;
+            }
+        }
+        conn.setProgress(nullptr);
+        monitor.end();
+        fflush(fp);
+        bool ok = local.build(fileno(fp), size, blockSize, 0) && local.root() == remoteRoot;
+        fclose(fp);
+        if (!ok) {
+            fprintf(stderr, "Repair of \"%s\" Failed: local root still differs\n", getFileName(nargu).c_str());
+            monitor.finish(false);
+            return false;
+        }
+        info("Repair of \"%s\" Completed, %lu bytes fetched\n", getFileName(nargu).c_str(), total);
+        // the content hash would need another pass, the index records it as unknown
+        DownloadIndex::Entry entry;
+        entry.size = size;
+        entry.mtime = mtime;
+        entry.hash = 0;
+        entry.remote = remotePath(serverPath, nargu);
+        DownloadIndex::record(filename, entry);
+        monitor.finish(true);
+        return true;
+    }
+
+private:
+    // the u / d that was moving data when the connection dropped; only a
+    // recoverable connection records it, and per thread, since batch workers
+    // run transfers side by side
+    struct Transfer {
+        std::string op;             // "u", "d", empty = none
+        std::string argu;
+        unsigned long long mtime;   // of the remote file, d only
+    };
+
+private:
+    static bool quiet;
+    static unsigned long streamThreshold;
+    static bool directIO;
+    static std::string token;
+    static thread_local Transfer interrupted;
+    // hashnodes: digests per reply message, nodes per request, requests in flight
+    static constexpr unsigned long hashesPerMessage = (maxn - 1) / 64;
+    static constexpr unsigned long maxHashNodes = 4096;
+    static constexpr size_t hashWindow = 16;
+
+private:
+    static bool copyOrMove(Transport& conn, const char* op, const std::string& source, const std::string& target,
+                           std::string* how) {
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        snprintf(buffer, maxn, "%s %s %s", op, source.c_str(), target.c_str());
+        birdWrite(conn, buffer);
+        bool progress = false;
+        while (true) {
+            cleanBuffer(buffer);
+            birdRead(conn, buffer);
+            unsigned long done, total;
+            if (sscanf(buffer, "PROGRESS %lu %lu", &done, &total) == 2) {
+                info("\r%s: %lu / %lu bytes (%.0f%%)", op, done, total, 100.0 * done / total);
+                fflush(stdout);
+                progress = true;
+                continue;
+            }
+            if (progress) {
+                info("\n");
+            }
+            if (!strncmp(buffer, "DONE ", 5)) {
+                info("%s \"%s\" to \"%s\" Completed (%s)\n", strcmp(op, "cp") ? "Move" : "Copy",
+                     getFileName(processArgument(source)).c_str(), processArgument(target).c_str(), buffer + 5);
+                if (how) {
+                    *how = buffer + 5;
+                }
+                return true;
+            }
+            fprintf(stderr, "%s\n", !strncmp(buffer, "ERROR ", 6) ? buffer + 6 : buffer);
+            return false;
+        }
+    }
+    // (re)start watching dir, then list it (first) or print how it differs
+    // from names; events the server pushed before the answer are stale
+    static bool watchSnapshot(Transport& conn, const std::string& argu, std::set<std::string>& names,
+                              unsigned long long& version, const bool& first) {
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        snprintf(buffer, maxn, "watch %s", argu.c_str());
+        birdWrite(conn, buffer);
+        int length;
+        do {
+            cleanBuffer(buffer);
+            birdRead(conn, buffer);
+        } while (!strncmp(buffer, "EVENT ", 6));
+        if (sscanf(buffer, "WATCHING version = %llu length = %d", &version, &length) != 2) {
+            fprintf(stderr, "%s\n", !strncmp(buffer, "ERROR ", 6) ? buffer + 6 : buffer);
+            return false;
+        }
+        std::set<std::string> current;
+        for (int i = 0; i < length; ++i) {
+            cleanBuffer(buffer);
+            birdRead(conn, buffer);
+            current.insert(buffer);
+        }
+        if (first) {
+            printf("Watching %s, %d entries\n", processArgument(argu).c_str(), length);
+            for (const std::string& name : current) {
+                printf("%s\n", name.c_str());
+            }
+        }
+        else {
+            for (const std::string& name : names) {
+                if (!current.count(name)) {
+                    printf("deleted %s\n", name.c_str());
+                }
+            }
+            for (const std::string& name : current) {
+                if (!names.count(name)) {
+                    printf("created %s\n", name.c_str());
+                }
+            }
+        }
+        names.swap(current);
+        return true;
+    }
+    // change is "<created|deleted|modified> <name>" from an EVENT message
+    static void printChange(const char* change, std::set<std::string>& names) {
+        const char* name = strchr(change, ' ');
+        if (!name) {
+            return;
+        }
+        if (!strncmp(change, "created ", 8)) {
+            names.insert(name + 1);
+        }
+        else if (!strncmp(change, "deleted ", 8)) {
+            names.erase(name + 1);
+        }
+        printf("%s\n", change);
+    }
+    static bool isStreaming(const unsigned long& size) {
+        return streamThreshold > 0 && size >= streamThreshold;
+    }
+    // the server's answer to d when it will not send nargu, printed
+    static bool refused(const char* reply, const std::string& nargu) {
+        if (std::string(reply) == "UNEXPECTED_ERROR") {
+            fprintf(stderr, "Unexpected Error\n");
+        }
+        else if (std::string(reply) == "PERMISSION_DENIED") {
+            fprintf(stderr, "%s: Permission denied\n", nargu.c_str());
+        }
+        else if (std::string(reply) == "FILE_NOT_EXIST") {
+            fprintf(stderr, "%s: No such file or directory\n", nargu.c_str());
+        }
+        else if (std::string(reply) == "IS_DIR") {
+            fprintf(stderr, "%s is a directory\n", nargu.c_str());
+        }
+        else if (std::string(reply) == "NOT_REGULAR_FILE") {
+            fprintf(stderr, "%s is not a regular file\n", nargu.c_str());
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+    // the file nargu names on the server from its directory serverPath, as the
+    // server resolves it; . and .. are left in, which at worst misses the index
+    static std::string remotePath(const std::string& serverPath, const std::string& nargu) {
+        if (nargu.empty() || nargu[0] == '/') {
+            return nargu;
+        }
+        return serverPath + (!serverPath.empty() && serverPath.back() == '/' ? "" : "/") + nargu;
+    }
+    static std::string downloadPath(const WorkingDirectory& wd, const std::string& nargu) {
+        if (wd.getStartupPath().back() == '/') {
+            return wd.getStartupPath() + "Download/" + getFileName(nargu);
+        }
+        return wd.getStartupPath() + "/Download/" + getFileName(nargu);
+    }
+    // Walk the server's tree from the last hash down from the root, only into
+    // subtrees whose root differs from local's, leaving the differing blocks.
+    // Each level's hashnodes requests go out hashWindow ahead of the replies.
+    static bool differingBlocks(Transport& conn, const MerkleTree& local, const MerkleTree::Digest& remoteRoot,
+                                std::vector<unsigned long>& blocks) {
+        blocks.clear();
+        if (local.root() == remoteRoot) {
+            return true;
+        }
+        std::vector<unsigned long> differing(1, 0);
+        std::string error = "";
+        for (int level = local.levels() - 2; level >= 0 && error == ""; --level) {
+            // children of the differing nodes, in runs [first, last) of at most maxHashNodes
+            std::vector<std::pair<unsigned long, unsigned long>> runs;
+            for (unsigned long parent : differing) {
+                unsigned long first = 2 * parent;
+                unsigned long last = std::min<unsigned long>(first + 2, local.width(level));
+                if (!runs.empty() && runs.back().second == first && last - runs.back().first <= maxHashNodes) {
+                    runs.back().second = last;
+                }
+                else {
+                    runs.push_back(std::make_pair(first, last));
+                }
+            }
+            std::vector<unsigned long> next;
+            size_t sent = 0, received = 0;
+            while (received < sent || (sent < runs.size() && error == "")) {
+                while (sent < runs.size() && sent - received < hashWindow && error == "") {
+                    char buffer[maxn];
+                    cleanBuffer(buffer);
+                    sprintf(buffer, "hashnodes %d %lu %lu", level, runs[sent].first,
+                            runs[sent].second - runs[sent].first);
+                    birdWrite(conn, buffer);
+                    ++sent;
+                }
+                // replies to requests already sent are read even after an error, to stay in step
+                std::vector<MerkleTree::Digest> nodes;
+                const auto& run = runs[received++];
+                if (!readNodes(conn, nodes, error) || error != "") {
+                    continue;
+                }
+                if (nodes.size() != run.second - run.first) {
+                    error = "unexpected number of hash nodes";
+                    continue;
+                }
+                for (unsigned long i = 0; i < nodes.size(); ++i) {
+                    if (nodes[i] != local.node(level, run.first + i)) {
+                        next.push_back(run.first + i);
+                    }
+                }
+            }
+            differing.swap(next);
+        }
+        if (error != "") {
+            fprintf(stderr, "%s\n", error.c_str());
+            return false;
+        }
+        blocks = differing;
+        return true;
+    }
+    // one hashnodes reply into nodes; false with the reason in error on ERROR
+    static bool readNodes(Transport& conn, std::vector<MerkleTree::Digest>& nodes, std::string& error) {
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        birdRead(conn, buffer);
+        unsigned long count;
+        if (sscanf(buffer, "NODES %lu", &count) != 1) {
+            if (error == "") {
+                error = !strncmp(buffer, "ERROR ", 6) ? buffer + 6 : buffer;
+            }
+            return false;
+        }
+        nodes.resize(count);
+        for (unsigned long i = 0; i < count; i += hashesPerMessage) {
+            cleanBuffer(buffer);
+            birdRead(conn, buffer);
+            for (unsigned long j = i; j < count && j < i + hashesPerMessage; ++j) {
+                if (!MerkleTree::fromHex(buffer + 64 * (j - i), nodes[j]) && error == "") {
+                    error = "malformed hash node";
+                }
+            }
+        }
+        return true;
+    }
+    // length bytes at offset of the remote file into fp at the same offset,
+    // provided the file still has the mtime it was hashed with
+    static bool fetchRange(Transport& conn, const std::string& argu, FILE* fp, const unsigned long& offset,
+                           const unsigned long& length, const unsigned long long& mtime) {
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        snprintf(buffer, maxn, "d -range %lu %lu %llu %s", offset, length, mtime, argu.c_str());
+        birdWrite(conn, buffer);
+        cleanBuffer(buffer);
+        birdRead(conn, buffer);
+        if (std::string(buffer) == "FILE_CHANGED") {
+            fprintf(stderr, "%s changed on Remote Server since it was hashed, repair again\n",
+                    processArgument(argu).c_str());
+            return false;
+        }
+        else if (std::string(buffer) != "FILE_EXISTS") {
+            fprintf(stderr, "%s: %s\n", processArgument(argu).c_str(), buffer);
+            return false;
+        }
+        if (fseek(fp, offset, SEEK_SET) < 0) {
+            cleanBuffer(buffer);
+            sprintf(buffer, "ERROR_OPEN_FILE");
+            birdWrite(conn, buffer);
+            return false;
+        }
+        cleanBuffer(buffer);
+        sprintf(buffer, "OK");
+        birdWrite(conn, buffer);
+        cleanBuffer(buffer);
+        birdRead(conn, buffer);
+        conn.readFile(fp, length);
+        return true;
+    }
+    static void info(const char* format, ...) {
+        if (quiet) {
+            return;
+        }
+        va_list args;
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+    }
     // return -2: error, -1: no permission 0: don't exist, 1: regular file, 2: directory, 3: other
     static int isExist(const std::string& filePath) {
         struct stat st;
@@ -275,147 +1538,435 @@ private:
             if (errno == ENOENT) {
                 return 0;
             }
-            else if (errno == EACCES) {
-                return -1;
+            else if (errno == EACCES) {
+                return -1;
+            }
+            else {
+                return -2;
+            }
+        }
+        if (S_ISREG(st.st_mode)) {
+            return 1;
+        }
+        else if (S_ISDIR(st.st_mode)) {
+            return 2;
+        }
+        else {
+            return 3;
+        }
+    }
+    static std::string getFileName(const std::string& filePath) {
+        unsigned long pos = filePath.rfind("/");
+        if (pos + 1 >= filePath.length()) {
+            return "";
+        }
+        else if (pos == std::string::npos) {
+            return filePath;
+        }
+        else {
+            return filePath.substr(pos + 1);
+        }
+    }
+    static std::string processArgument(const std::string& base) {
+        std::string basep = base;
+        if (base.front() == '\"' && base.back() == '\"') {
+            basep = base.substr(1, base.length() - 2);
+            return basep;
+        }
+        std::string ret = "";
+        bool backSlashFlag = false;
+        for (unsigned i = 0; i < basep.length(); ++i) {
+            if (basep[i] == '\\') {
+                backSlashFlag = true;
+                continue;
+            }
+            if (backSlashFlag) {
+                backSlashFlag = false;
+            }
+            ret += basep[i];
+        }
+        if (backSlashFlag) {
+            ret += " ";
+        }
+        return ret;
+    }
+    static void cleanBuffer(char *buffer, const int &n = maxn) {
+        memset(buffer, 0, sizeof(char) * n);
+    }
+    static void birdRead(Transport& conn, char* buffer) {
+        if (!conn.readMessage(buffer)) {
+            conn.lost("\nConnection closed by Remote Server");
+        }
+        if (!strcmp(buffer, "IDLE_TIMEOUT")) {
+            conn.lost("\nSession closed by Remote Server: idle timeout");
+        }
+    }
+    static void birdWrite(Transport& conn, const char* buffer) {
+        conn.writeMessage(buffer);
+    }
+};
+
+bool ClientFunc::quiet = false;
+unsigned long ClientFunc::streamThreshold = 64ul << 20;
+bool ClientFunc::directIO = false;
+std::string ClientFunc::token = "";
+thread_local ClientFunc::Transfer ClientFunc::interrupted = {"", "", 0};
+
+// -unix: every connection goes to this socket, address and port are ignored
+std::string unixSocketPath = "";
+
+bool isValidArguments(int argc, char const *argv[]);
+bool parseOptions(int argc, char const *argv[], ClientConfig& config);
+void printUsage(const char* name);
+bool isAllSpace(const char* str);
+int clientConnect(const char* addr, const int& port);
+int clientInit(const char* addr, const int& port);
+void closeClient(Transport& conn);
+bool reconnect(Transport& conn, const char* host, const int& port, const int& timeout,
+               const WorkingDirectory& wd, std::string& serverPath);
+void init();
+bool TCPClient(Transport& conn, const char* host, const int& port, const int& reconnectTimeout,
+               const int& prefetch, const std::string& oneShot);
+void printInfo();
+void trimNewLine(char* str);
+std::string toLowerString(const std::string& src);
+std::string trimSpaceLE(const std::string& str);
+std::string nextArgument(std::string& base);
+
+// Non-interactive execution of a command script, one JSON result line per
+// command on stdout.  Commands run concurrently over several sessions unless
+// they conflict with an earlier command still pending: the same remote file,
+// the same local download target, or a listing of a directory being uploaded
+// into.  cd is a barrier; every session follows the script's working
+// directory lazily before running its next command.
+class BatchRunner {
+public:
+    BatchRunner(const char* host, const int& port, const int& sessions)
+        : host(host), port(port), sessions(sessions), failed(0), done(false) {
+
+    }
+    // returns the number of failed commands
+    int run(FILE* script) {
+        std::vector<Transport> conns;
+        conns.reserve(sessions);
+        for (int i = 0; i < sessions; ++i) {
+            conns.emplace_back(clientInit(host, port));
+            if (!ClientFunc::welcome(conns.back())) {
+                closeClient(conns.back());
+                conns.pop_back();
+                break;
+            }
+        }
+        if (conns.empty()) {
+            exit(EXIT_FAILURE);
+        }
+        cwd = ClientFunc::pwd(conns[0]);
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < conns.size(); ++i) {
+            workers.push_back(std::thread(&BatchRunner::worker, this, &conns[i], cwd));
+        }
+        bool udpMode = false;
+        UdpConfig udpConfig;
+        char line[maxn];
+        for (int lineNo = 1; fgets(line, maxn, script); ++lineNo) {
+            trimNewLine(line);
+            if (isAllSpace(line) || trimSpaceLE(line)[0] == '#') {
+                continue;
+            }
+            Task task;
+            task.line = lineNo;
+            task.text = trimSpaceLE(line);
+            std::string input = line;
+            task.command = nextArgument(input);
+            task.argu = nextArgument(input);
+            task.extra = trimSpaceLE(input);
+            task.udp = udpMode;
+            task.udpConfig = udpConfig;
+            task.started = false;
+            if (task.command == "exit") {
+                break;
+            }
+            else if (task.command == "mode") {
+                std::string loss = nextArgument(input);
+                std::string delay = nextArgument(input);
+                double lossPercent = 0.0;
+                UdpConfig requested;
+                bool ok = true;
+                if (task.argu == "tcp") {
+                    udpMode = false;
+                }
+                else if (task.argu == "udp" && unixSocketPath != "") {
+                    ok = false;
+                }
+                else if (task.argu == "udp" &&
+                         (loss == "" || sscanf(loss.c_str(), "%lf", &lossPercent) == 1) &&
+                         (delay == "" || sscanf(delay.c_str(), "%d", &requested.delayMs) == 1)) {
+                    requested.lossRate = lossPercent / 100.0;
+                    ok = requested.valid();
+                    if (ok) {
+                        udpMode = true;
+                        udpConfig.lossRate = requested.lossRate;
+                        udpConfig.delayMs = requested.delayMs;
+                    }
+                }
+                else {
+                    ok = false;
+                }
+                std::lock_guard<std::mutex> guard(lock);
+                report(task, ok, 0.0, ok ? "" : task.argu == "udp" && unixSocketPath != "" ?
+                       "udp needs a network connection, -unix passes open files instead" : "Invalid mode");
+            }
+            else if (task.command == "cd") {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [this] { return active.empty(); });
+                task.cwd = cwd;
+                active.push_back(task);
+                changed.notify_all();
+                changed.wait(guard, [this] { return active.empty(); });
+            }
+            else if (task.command == "pwd" || task.command == "ls" || task.command == "find" ||
+                     task.command == "u" || task.command == "d" || task.command == "cp" || task.command == "mv") {
+                std::unique_lock<std::mutex> guard(lock);
+                task.cwd = cwd;
+                if (task.command == "ls") {
+                    task.keys.push_back(std::make_pair("dir:" + cwd, 'r'));
+                }
+                else if (task.command == "u") {
+                    std::string name = ClientFunc::targetName(task.argu);
+                    task.keys.push_back(std::make_pair("remote:" + cwd + "/" + name, 'w'));
+                    task.keys.push_back(std::make_pair("dir:" + cwd, 'a'));
+                }
+                else if (task.command == "d") {
+                    task.keys.push_back(std::make_pair("remote:" + remotePath(task.argu), 'r'));
+                    task.keys.push_back(std::make_pair("local:" + ClientFunc::targetName(task.argu), 'w'));
+                }
+                else if (task.command == "cp" || task.command == "mv") {
+                    // the target may be a directory, so claim both possible names
+                    std::string target = remotePath(task.extra);
+                    task.keys.push_back(std::make_pair("remote:" + remotePath(task.argu), task.command == "mv" ? 'w' : 'r'));
+                    task.keys.push_back(std::make_pair("remote:" + target, 'w'));
+                    task.keys.push_back(std::make_pair("remote:" + target + "/" + ClientFunc::targetName(task.argu), 'w'));
+                    task.keys.push_back(std::make_pair("dir:" + cwd, 'a'));
+                }
+                changed.wait(guard, [this, &task] { return !conflicts(task); });
+                active.push_back(task);
+                changed.notify_all();
+            }
+            else {
+                std::lock_guard<std::mutex> guard(lock);
+                report(task, false, 0.0, task.command + ": Command not supported in batch mode");
+            }
+        }
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [this] { return active.empty(); });
+            done = true;
+            changed.notify_all();
+        }
+        for (unsigned i = 0; i < workers.size(); ++i) {
+            workers[i].join();
+            ClientFunc::q(conns[i]);
+            closeClient(conns[i]);
+        }
+        return failed;
+    }
+
+private:
+    struct Task {
+        int line;
+        std::string text;
+        std::string command;
+        std::string argu;
+        std::string extra;      // anything after the first argument
+        std::string cwd;        // remote working directory the command runs in
+        bool udp;
+        UdpConfig udpConfig;
+        // resources touched: 'r' read, 'w' write, 'a' add an entry to a directory
+        std::vector<std::pair<std::string, char> > keys;
+        bool started;
+    };
+
+private:
+    const char* host;
+    int port;
+    int sessions;
+    int failed;
+    bool done;
+    std::string cwd;
+    std::list<Task> active;     // queued or running
+    std::mutex lock;
+    std::condition_variable changed;
+
+private:
+    // caller holds lock
+    std::string remotePath(const std::string& argu) const {
+        std::string path = ClientFunc::targetPath(argu);
+        if (path.empty() || path[0] != '/') {
+            path = cwd + "/" + path;
+        }
+        return path;
+    }
+    // caller holds lock
+    bool conflicts(const Task& task) const {
+        for (const auto& other : active) {
+            for (const auto& mine : task.keys) {
+                for (const auto& theirs : other.keys) {
+                    if (mine.first != theirs.first) {
+                        continue;
+                    }
+                    if ((mine.second == 'r' && theirs.second == 'r') ||
+                        (mine.second == 'a' && theirs.second == 'a')) {
+                        continue;
+                    }
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    void worker(Transport* conn, std::string sessionCwd) {
+        WorkingDirectory wd;
+        while (true) {
+            std::list<Task>::iterator it;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [this, &it] {
+                    for (it = active.begin(); it != active.end(); ++it) {
+                        if (!it->started) {
+                            return true;
+                        }
+                    }
+                    return done;
+                });
+                if (it == active.end()) {
+                    return;
+                }
+                it->started = true;
+            }
+            const Task& task = *it;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            bool ok = true;
+            std::string output;
+            if (sessionCwd != task.cwd) {
+                output = ClientFunc::cd(*conn, "\"" + task.cwd + "\"");
+                ok = output == "";
+                sessionCwd = task.cwd;
             }
-            else {
-                return -2;
+            if (ok) {
+                execute(*conn, task, wd, sessionCwd, ok, output);
             }
-        }
-        if (S_ISREG(st.st_mode)) {
-            return 1;
-        }
-        else if (S_ISDIR(st.st_mode)) {
-            return 2;
-        }
-        else {
-            return 3;
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            std::lock_guard<std::mutex> guard(lock);
+            if (task.command == "cd") {
+                cwd = sessionCwd;
+            }
+            report(task, ok, ms, output);
+            active.erase(it);
+            changed.notify_all();
         }
     }
-    static std::string getFileName(const std::string& filePath) {
-        unsigned long pos = filePath.rfind("/");
-        if (pos + 1 >= filePath.length()) {
-            return "";
-        }
-        else if (pos == std::string::npos) {
-            return filePath;
+    void execute(Transport& conn, const Task& task, const WorkingDirectory& wd, std::string& sessionCwd,
+                 bool& ok, std::string& output) {
+        if (task.command == "pwd") {
+            output = ClientFunc::pwd(conn);
         }
-        else {
-            return filePath.substr(pos + 1);
+        else if (task.command == "ls") {
+            output = ClientFunc::ls(conn);
         }
-    }
-    static std::string processArgument(const std::string& base) {
-        std::string basep = base;
-        if (base.front() == '\"' && base.back() == '\"') {
-            basep = base.substr(1, base.length() - 2);
-            return basep;
+        else if (task.command == "find") {
+            ok = ClientFunc::find(conn, task.argu, task.extra, &output) >= 0;
         }
-        std::string ret = "";
-        bool backSlashFlag = false;
-        for (unsigned i = 0; i < basep.length(); ++i) {
-            if (basep[i] == '\\') {
-                backSlashFlag = true;
-                continue;
+        else if (task.command == "cd") {
+            output = ClientFunc::cd(conn, task.argu, &sessionCwd);
+            ok = output == "";
+            if (ok) {
+                output = sessionCwd;
             }
-            if (backSlashFlag) {
-                backSlashFlag = false;
-            }
-            ret += basep[i];
         }
-        if (backSlashFlag) {
-            ret += " ";
+        else if (task.command == "u") {
+            ok = ClientFunc::u(conn, task.argu, task.udp ? &task.udpConfig : nullptr);
         }
-        return ret;
-    }
-    static void cleanBuffer(char *buffer, const int &n = maxn) {
-        memset(buffer, 0, sizeof(char) * n);
-    }
-    static int birdRead(const int& fd, char* buffer, const int& n = maxn) {
-        int byteRead = read(fd, buffer, n);
-        if (byteRead < 0) {
-            fprintf(stderr, "read() Error\n");
-            exit(EXIT_FAILURE);
+        else if (task.command == "d") {
+            ok = ClientFunc::d(conn, task.argu, wd, sessionCwd, task.udp ? &task.udpConfig : nullptr);
         }
-        return byteRead;
-    }
-    static int birdWrite(const int& fd, const char* buffer, const int& n = maxn) {
-        int byteWrite = write(fd, buffer, sizeof(char) * n);
-        if (byteWrite < 0) {
-            fprintf(stderr, "write() Error\n");
-            exit(EXIT_FAILURE);
+        else if (task.command == "cp") {
+            ok = ClientFunc::cp(conn, task.argu, task.extra, &output);
         }
-        return byteWrite;
-    }
-    static void birdWriteFile(const int& fd, FILE* fp, const unsigned long& size) {
-        char buffer[maxn];
-        unsigned byteRead = 0u;
-        while (byteRead < size) {
-            int n = read(fileno(fp), buffer, maxn);
-            if (n < 0) {
-                fprintf(stderr, "Error When Reading File\n");
-                exit(EXIT_FAILURE);
-            }
-            byteRead += n;
-            int m = birdWrite(fd, buffer, n);
-            if (m != n) {
-                fprintf(stderr, "Error When Transmitting Data\n");
-                exit(EXIT_FAILURE);
-            }
+        else if (task.command == "mv") {
+            ok = ClientFunc::mv(conn, task.argu, task.extra, &output);
         }
     }
-    static void birdReadFile(const int& fd, FILE* fp, const unsigned long& size) {
-        char buffer[maxn];
-        unsigned byteWrite = 0u;
-        while (byteWrite < size) {
-            int n = read(fd, buffer, maxn);
-            if (n < 0) {
-                fprintf(stderr, "Error When Receiving Data\n");
-                exit(EXIT_FAILURE);
-            }
-            byteWrite += n;
-            int m = write(fileno(fp), buffer, n);
-            if (m != n) {
-                fprintf(stderr, "Error When Writing to File\n");
-                exit(EXIT_FAILURE);
-            }
+    // caller holds lock
+    void report(const Task& task, const bool& ok, const double& ms, const std::string& output) {
+        if (!ok) {
+            ++failed;
         }
+        printf("{\"line\":%d,\"command\":\"%s\",\"status\":\"%s\",\"ms\":%.3f,\"output\":\"%s\"}\n",
+               task.line, jsonEscape(task.text).c_str(), ok ? "ok" : "error", ms, jsonEscape(output).c_str());
+        fflush(stdout);
     }
 };
 
-bool isValidArguments(int argc, char const *argv[]);
-bool isAllSpace(const char* str);
-int clientInit(const char* addr, const int& port);
-void closeClient(const int& fd);
-void init();
-void TCPClient(const int& fd, const char* host);
-void printInfo();
-void trimNewLine(char* str);
-std::string toLowerString(const std::string& src);
-std::string trimSpaceLE(const std::string& str);
-std::string nextArgument(std::string& base);
-
 int main(int argc, char const *argv[])
 {
-    if (argc != 3) {
-        fprintf(stderr, "usage: %s <server address> <port>\n", argv[0]);
+    if (argc < 3) {
+        printUsage(argv[0]);
         exit(EXIT_FAILURE);
     }
-    if (!isValidArguments(argc, argv)) {
+    ClientConfig config;
+    if (!isValidArguments(argc, argv) || !parseOptions(argc, argv, config)) {
         fprintf(stderr, "Invalid Arguments\n");
         exit(EXIT_FAILURE);
     }
     init();
+    ClientFunc::setStreaming(config.streamThreshold, config.directIO);
+    TransferMonitor::setMode(config.progress);
+    unixSocketPath = config.unixPath;
     int port;
     sscanf(argv[2], "%d", &port);
-    int sockfd = clientInit(argv[1], port);
-    printf("\n\nNetwork Programming Homework 1\n\nConnected to %s:%s\n", argv[1], argv[2]);
-    TCPClient(sockfd, argv[1]);
-    closeClient(sockfd);
+    signal(SIGPIPE, SIG_IGN);
+    if (config.batchScript != "") {
+        FILE* script = config.batchScript == "-" ? stdin : fopen(config.batchScript.c_str(), "r");
+        if (!script) {
+            fprintf(stderr, "%s: %s\n", config.batchScript.c_str(), strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        ClientFunc::setQuiet(true);
+        TransferMonitor::setMode(progressOff);
+        BatchRunner runner(argv[1], port, config.sessions);
+        int failed = runner.run(script);
+        if (script != stdin) {
+            fclose(script);
+        }
+        return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    Transport conn(clientInit(argv[1], port));
+    if (!ClientFunc::welcome(conn)) {
+        closeClient(conn);
+        exit(EXIT_FAILURE);
+    }
+    if (config.command != "") {
+        // stdout may be carrying a download, keep everything else off it
+        ClientFunc::setQuiet(true);
+        TransferMonitor::setMode(progressOff);
+        bool ok = TCPClient(conn, argv[1], port, config.reconnect, 0, config.command);
+        ClientFunc::q(conn);
+        closeClient(conn);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (unixSocketPath != "") {
+        printf("\n\nNetwork Programming Homework 1\n\nConnected to %s\n", unixSocketPath.c_str());
+    }
+    else {
+        printf("\n\nNetwork Programming Homework 1\n\nConnected to %s:%s\n", argv[1], argv[2]);
+    }
+    TCPClient(conn, argv[1], port, config.reconnect, config.prefetch, "");
+    closeClient(conn);
     return 0;
 }
 
 bool isValidArguments(int argc, char const *argv[]) {
-    if (argc != 3) {
+    if (argc < 3) {
         return false;
     }
     sockaddr_in tmp;
@@ -433,6 +1984,89 @@ bool isValidArguments(int argc, char const *argv[]) {
     return true;
 }
 
+bool parseOptions(int argc, char const *argv[], ClientConfig& config) {
+    for (int i = 3; i < argc; ++i) {
+        std::string option = argv[i];
+        if (option == "-b" && i + 1 < argc) {
+            config.batchScript = argv[++i];
+        }
+        else if (option == "-c" && i + 1 < argc) {
+            config.command = argv[++i];
+        }
+        else if (option == "-unix" && i + 1 < argc) {
+            config.unixPath = argv[++i];
+        }
+        else if (option == "-prefetch" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d", &config.prefetch) != 1 || config.prefetch < 0) {
+                fprintf(stderr, "-prefetch needs a non-negative number\n");
+                return false;
+            }
+        }
+        else if (option == "-j" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d", &config.sessions) != 1 || config.sessions < 1) {
+                fprintf(stderr, "-j needs a positive number\n");
+                return false;
+            }
+        }
+        else if (option == "-stream-threshold" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d", &config.streamThreshold) != 1 || config.streamThreshold < 0) {
+                fprintf(stderr, "-stream-threshold needs a non-negative number\n");
+                return false;
+            }
+        }
+        else if (option == "-direct") {
+            config.directIO = true;
+        }
+        else if (option == "-reconnect" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d", &config.reconnect) != 1 || config.reconnect < 0) {
+                fprintf(stderr, "-reconnect needs a non-negative number\n");
+                return false;
+            }
+        }
+        else if (option == "-progress" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "text") {
+                config.progress = progressText;
+            }
+            else if (mode == "json") {
+                config.progress = progressJson;
+            }
+            else if (mode == "off") {
+                config.progress = progressOff;
+            }
+            else {
+                fprintf(stderr, "-progress must be text, json or off\n");
+                return false;
+            }
+        }
+        else {
+            fprintf(stderr, "Unrecognized Argument %s\n", argv[i]);
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+void printUsage(const char* name) {
+    fprintf(stderr, "usage: %s <server address> <port> [options]\n", name);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "    -b <script>    run commands from script (- for stdin) without prompts,\n");
+    fprintf(stderr, "                   printing one JSON result line per command\n");
+    fprintf(stderr, "    -c <command>   run one command and exit, status 0 when it succeeded; with\n");
+    fprintf(stderr, "                   \"u - <name>\" and \"d <file> -\" the client fits in a pipeline\n");
+    fprintf(stderr, "    -j <n>         sessions used to run independent batch commands concurrently (default 4)\n");
+    fprintf(stderr, "    -stream-threshold <MB>  stream larger files past the page cache, 0 = never (default 64)\n");
+    fprintf(stderr, "    -direct        stream with O_DIRECT where the filesystem supports it\n");
+    fprintf(stderr, "    -progress <text|json|off>  live progress and a summary for every transfer (default text)\n");
+    fprintf(stderr, "    -reconnect <sec>  keep reconnecting this long when the connection drops, resuming\n");
+    fprintf(stderr, "                   the session and any interrupted transfer; 0 = exit (default 60)\n");
+    fprintf(stderr, "    -unix <path>   connect through the server's Unix socket (server on this host):\n");
+    fprintf(stderr, "                   u and d then hand over open files instead of sending their data\n");
+    fprintf(stderr, "    -prefetch <sec>  fetch the new directory's listing along with every cd and answer\n");
+    fprintf(stderr, "                   ls from it for up to sec seconds; 0 = off (default 0)\n");
+}
+
 bool isAllSpace(const char* str) {
     for (int i = 0; str[i]; ++i) {
         if (str[i] != ' ' && str[i] != '\t' && str[i] != '\n') {
@@ -442,29 +2076,83 @@ bool isAllSpace(const char* str) {
     return true;
 }
 
-int clientInit(const char* addr, const int& port) {
+// -1 when the server cannot be reached
+int clientConnect(const char* addr, const int& port) {
+    if (unixSocketPath != "") {
+        sockaddr_un unixAddr;
+        memset(&unixAddr, 0, sizeof(unixAddr));
+        unixAddr.sun_family = AF_UNIX;
+        strncpy(unixAddr.sun_path, unixSocketPath.c_str(), sizeof(unixAddr.sun_path) - 1);
+        int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sockfd >= 0 && connect(sockfd, reinterpret_cast<sockaddr*>(&unixAddr), sizeof(unixAddr)) < 0) {
+            close(sockfd);
+            sockfd = -1;
+        }
+        return sockfd;
+    }
     int sockfd;
     sockaddr_in serverAddr;
     if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        fprintf(stderr, "Socket Error\n");
-        exit(EXIT_FAILURE);
+        return -1;
     }
     memset(&serverAddr, 0, sizeof(serverAddr));
     serverAddr.sin_family = AF_INET;
     serverAddr.sin_port = htons(port);
-    if (inet_pton(AF_INET, addr, &serverAddr.sin_addr) <= 0) {
-        fprintf(stderr, "%s: Inet_pton Error\n", addr);
-        exit(EXIT_FAILURE);
+    if (inet_pton(AF_INET, addr, &serverAddr.sin_addr) <= 0 ||
+        connect(sockfd, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(sockaddr_in)) < 0) {
+        close(sockfd);
+        return -1;
     }
-    if (connect(sockfd, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(sockaddr_in)) < 0) {
-        fprintf(stderr, "Connect Error\n");
+    return sockfd;
+}
+
+int clientInit(const char* addr, const int& port) {
+    int sockfd = clientConnect(addr, port);
+    if (sockfd < 0) {
+        fprintf(stderr, "Connect Error: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
     return sockfd;
 }
 
-void closeClient(const int& fd) {
-    close(fd);
+void closeClient(Transport& conn) {
+    conn.flush();
+    close(conn.getFd());
+}
+
+// The connection dropped: connect again with exponential backoff, jittered
+// so clients cut off together do not come back in lockstep, and pick the
+// session up where it was.  Gives up after timeout seconds.
+bool reconnect(Transport& conn, const char* host, const int& port, const int& timeout,
+               const WorkingDirectory& wd, std::string& serverPath) {
+    static std::mt19937 rng(std::random_device{}());
+    close(conn.getFd());
+    std::string token = ClientFunc::getToken();
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+    int delayMs = 100;
+    for (int attempt = 1; ; ++attempt) {
+        int fd = clientConnect(host, port);
+        if (fd >= 0) {
+            conn.reset(fd);
+            try {
+                if (ClientFunc::welcome(conn)) {
+                    ClientFunc::resume(conn, token, wd, serverPath);
+                    return true;
+                }
+            }
+            catch (const ConnectionLost& e) {
+                fprintf(stderr, "%s\n", e.what());
+            }
+            close(fd);
+        }
+        std::chrono::milliseconds wait(std::uniform_int_distribution<int>(delayMs / 2, delayMs)(rng));
+        if (std::chrono::steady_clock::now() + wait > deadline) {
+            return false;
+        }
+        fprintf(stderr, "Reconnecting to %s:%d, attempt %d in %.1f s\n", host, port, attempt + 1, wait.count() / 1e3);
+        std::this_thread::sleep_for(wait);
+        delayMs = std::min(delayMs * 2, 5000);
+    }
 }
 
 void init() {
@@ -476,203 +2164,448 @@ void init() {
     }
 }
 
-void TCPClient(const int& fd, const char* host) {
-    std::string serverPath = ClientFunc::pwd(fd);
+// runs oneShot and returns, when given, instead of prompting on stdin;
+// returns whether the last transfer or file command succeeded
+bool TCPClient(Transport& conn, const char* host, const int& port, const int& reconnectTimeout,
+               const int& prefetch, const std::string& oneShot) {
+    std::string serverPath = ClientFunc::pwd(conn);
+    ListingCache listings(prefetch);
     WorkingDirectory wd;
-    printInfo();
-    while (true) {
-        printf("%s:%s$ ", host, serverPath.c_str());
+    bool udpMode = false;
+    UdpConfig udpConfig;
+    bool ok = true;
+    if (oneShot == "") {
+        printInfo();
+    }
+    conn.setRecoverable(reconnectTimeout > 0);
+    for (bool last = false; !last;) {
         char userInputCStr[maxn];
-        if (!fgets(userInputCStr, maxn, stdin)) {
-            break;
+        if (oneShot != "") {
+            snprintf(userInputCStr, maxn, "%s", oneShot.c_str());
+            last = true;
+        }
+        else {
+            printf("%s:%s$ ", host, serverPath.c_str());
+            if (!fgets(userInputCStr, maxn, stdin)) {
+                break;
+            }
         }
         if (!strcmp(userInputCStr, "\n") || isAllSpace(userInputCStr)) {
             continue;
         }
         std::string userInput = userInputCStr;
         std::string command = nextArgument(userInput);
-        if (command == "help") {
-            std::string argu = nextArgument(userInput);
-            if (argu != "") {
-                if (argu == "-h" || argu == "-help" || argu == "--help") {
-                    printf("usage: help\n");
-                    printf("Print help information.\n");
+        ok = true;
+        // everything else may change what the directory holds
+        if (command != "ls" && command != "pwd" && command != "cd" && command != "help") {
+            listings.clear();
+        }
+        try {
+            if (command == "help") {
+                std::string argu = nextArgument(userInput);
+                if (argu != "") {
+                    if (argu == "-h" || argu == "-help" || argu == "--help") {
+                        printf("usage: help\n");
+                        printf("Print help information.\n");
+                    }
+                    else {
+                        fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    }
                 }
                 else {
-                    fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    printInfo();
                 }
             }
-            else {
-                printInfo();
-            }
-        }
-        else if (command == "lpwd") {
-            std::string argu = nextArgument(userInput);
-            if (argu != "") {
-                if (argu == "-h" || argu == "-help" || argu == "--help") {
-                    printf("usage: lpwd\n");
-                    printf("Print local current working directory.\n");
+            else if (command == "lpwd") {
+                std::string argu = nextArgument(userInput);
+                if (argu != "") {
+                    if (argu == "-h" || argu == "-help" || argu == "--help") {
+                        printf("usage: lpwd\n");
+                        printf("Print local current working directory.\n");
+                    }
+                    else {
+                        fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    }
                 }
                 else {
-                    fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    printf("%s\n", wd.getPath().c_str());
                 }
             }
-            else {
-                printf("%s\n", wd.getPath().c_str());
+            else if (command == "lls") {
+                std::string argu = nextArgument(userInput);
+                if (argu != "") {
+                    if (argu == "-h" || argu == "-help" || argu == "--help") {
+                        printf("usage: lpwd\n");
+                        printf("List information about the files in the local current directory.\n");
+                    }
+                    else {
+                        fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    }
+                }
+                else {
+                    DIR* dir = opendir(wd.getPath().c_str());
+                    if (!dir) {
+                        fprintf(stderr, "%s: Cannot open the directory\n", wd.getPath().c_str());
+                        continue;
+                    }
+                    else {
+                        dirent *dirst;
+                        std::vector<std::string> fileList;
+                        while ((dirst = readdir(dir))) {
+                            std::string name(dirst->d_name);
+                            if (dirst->d_type == DT_DIR) {
+                                name += "/";
+                            }
+                            fileList.push_back(name);
+                        }
+                        std::sort(fileList.begin(), fileList.end());
+                        for (const auto& i : fileList) {
+                            printf("%s\n", i.c_str());
+                        }
+                        closedir(dir);
+                    }
+                }
             }
-        }
-        else if (command == "lls") {
-            std::string argu = nextArgument(userInput);
-            if (argu != "") {
-                if (argu == "-h" || argu == "-help" || argu == "--help") {
-                    printf("usage: lpwd\n");
-                    printf("List information about the files in the local current directory.\n");
+            else if (command == "exit") {
+                std::string argu = nextArgument(userInput);
+                if (argu != "") {
+                    if (argu == "-h" || argu == "-help" || argu == "--help") {
+                        printf("usage: exit\n");
+                        printf("Terminate the connection.\n");
+                    }
+                    else {
+                        fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    }
                 }
                 else {
-                    fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    ClientFunc::q(conn);
+                    printf("\nConnection Terminated\n\n");
+                    break;
                 }
             }
-            else {
-                DIR* dir = opendir(wd.getPath().c_str());
-                if (!dir) {
-                    fprintf(stderr, "%s: Cannot open the directory\n", wd.getPath().c_str());
-                    continue;
+            else if (command == "pwd") {
+                std::string argu = nextArgument(userInput);
+                if (argu != "") {
+                    if (argu == "-h" || argu == "-help" || argu == "--help") {
+                        printf("usage: pwd\n");
+                        printf("Print current working directory on Remote Server.\n");
+                    }
+                    else {
+                        fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    }
                 }
                 else {
-                    dirent *dirst;
-                    std::vector<std::string> fileList;
-                    while ((dirst = readdir(dir))) {
-                        std::string name(dirst->d_name);
-                        if (dirst->d_type == DT_DIR) {
-                            name += "/";
-                        }
-                        fileList.push_back(name);
+                    printf("%s\n", ClientFunc::pwd(conn).c_str());
+                }
+            }
+            else if (command == "ls") {
+                std::string argu = nextArgument(userInput);
+                if (argu != "") {
+                    if (argu == "-h" || argu == "-help" || argu == "--help") {
+                        printf("usage: ls\n");
+                        printf("List information about the files in the current directory on Remote Server.\n");
                     }
-                    std::sort(fileList.begin(), fileList.end());
-                    for (const auto& i : fileList) {
-                        printf("%s\n", i.c_str());
+                    else {
+                        fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
                     }
-                    closedir(dir);
+                }
+                else {
+                    std::string names;
+                    if (!listings.lookup(serverPath, names)) {
+                        names = ClientFunc::ls(conn);
+                    }
+                    printf("%s\n", names.c_str());
                 }
             }
-        }
-        else if (command == "exit") {
-            std::string argu = nextArgument(userInput);
-            if (argu != "") {
-                if (argu == "-h" || argu == "-help" || argu == "--help") {
-                    printf("usage: exit\n");
-                    printf("Terminate the connection.\n");
+            else if (command == "cd") {
+                std::string argu = nextArgument(userInput);
+                if (argu == "" || argu[0] == '-') {
+                    if (argu == "-h" || argu == "-help" || argu == "--help") {
+                        printf("usage: cd <path>\n");
+                        printf("Change working directory to <path> on Remote Server.\n");
+                        printf("ex:\n");
+                        printf("    cd \"Network Programming\"\n");
+                        printf("    cd ../Download\n");
+                    }
+                    else if (argu == "") {
+                        continue;
+                    }
+                    else {
+                        fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    }
                 }
                 else {
-                    fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    // the reply carries the new directory, the listing comes along if wanted
+                    std::string names;
+                    std::string ret = ClientFunc::cd(conn, argu, &serverPath, listings.enabled() ? &names : nullptr);
+                    if (ret != "") {
+                        printf("%s\n", ret.c_str());
+                    }
+                    if (listings.enabled()) {
+                        listings.store(serverPath, names);
+                    }
                 }
             }
-            else {
-                ClientFunc::q(fd);
-                printf("\nConnection Terminated\n\n");
-                break;
+            else if (command == "u") {
+                std::string argu = nextArgument(userInput);
+                if (argu == "-") {
+                    std::string name = nextArgument(userInput);
+                    if (name == "") {
+                        printf("usage: u - <name>\nu --help for more information\n");
+                        ok = false;
+                    }
+                    else {
+                        ok = ClientFunc::uStream(conn, name);
+                    }
+                }
+                else if (argu == "" || argu[0] == '-') {
+                    if (argu == "-h" || argu == "-help" || argu == "--help") {
+                        printf("usage: u <file>\n");
+                        printf("       u - <name>\n");
+                        printf("Upload file(path related to local working directory) to Remote Server.\n");
+                        printf("With -, upload stdin as <name> while it is being read, for use in a pipeline with -c.\n");
+                        printf("ex:\n");
+                        printf("    u hw1.tar\n");
+                        printf("    u ../client.cpp\n");
+                        printf("    (pg_dump db | client <server address> <port> -c \"u - db.sql\")\n");
+                    }
+                    else if (argu == "") {
+                        printf("usage: u <file>\nu --help for more information\n");
+                        continue;
+                    }
+                    else {
+                        fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    }
+                }
+                else {
+                    ok = ClientFunc::u(conn, argu, udpMode ? &udpConfig : nullptr);
+                }
             }
-        }
-        else if (command == "pwd") {
-            std::string argu = nextArgument(userInput);
-            if (argu != "") {
-                if (argu == "-h" || argu == "-help" || argu == "--help") {
-                    printf("usage: pwd\n");
-                    printf("Print current working directory on Remote Server.\n");
+            else if (command == "d") {
+                std::string argu = nextArgument(userInput);
+                if (argu == "" || argu[0] == '-') {
+                    if (argu == "-h" || argu == "-help" || argu == "--help") {
+                        printf("usage: d <file> [-]\n");
+                        printf("Download file(path related to working directory on server) to Download.\n");
+                        printf("With -, write it to stdout instead, for use in a pipeline with -c.\n");
+                        printf("ex:\n");
+                        printf("    d hw1.tar\n");
+                        printf("    d ../server.cpp\n");
+                        printf("    (client <server address> <port> -c \"d hw1.tar -\" | tar x)\n");
+                    }
+                    else if (argu == "") {
+                        printf("usage: d <file>\nd --help for more information\n");
+                        continue;
+                    }
+                    else {
+                        fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    }
                 }
                 else {
-                    fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    std::string target = nextArgument(userInput);
+                    if (target == "-") {
+                        ok = ClientFunc::dStream(conn, argu);
+                    }
+                    else if (target != "") {
+                        fprintf(stderr, "Unrecognized Argument %s\n", target.c_str());
+                        ok = false;
+                    }
+                    else {
+                        ok = ClientFunc::d(conn, argu, wd, serverPath, udpMode ? &udpConfig : nullptr);
+                    }
                 }
             }
-            else {
-                printf("%s\n", ClientFunc::pwd(fd).c_str());
+            else if (command == "watch") {
+                std::string argu = nextArgument(userInput);
+                if (argu == "" || argu[0] == '-') {
+                    if (argu == "-h" || argu == "-help" || argu == "--help") {
+                        printf("usage: watch <dir>\n");
+                        printf("List <dir> on Remote Server, then show files created, deleted or modified there as it happens.\n");
+                        printf("Press Enter to stop; without a terminal on stdin it runs until the connection ends.\n");
+                        printf("ex:\n");
+                        printf("    watch Upload\n");
+                        printf("    watch .\n");
+                    }
+                    else if (argu == "") {
+                        printf("usage: watch <dir>\nwatch --help for more information\n");
+                        continue;
+                    }
+                    else {
+                        fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    }
+                }
+                else {
+                    ClientFunc::watch(conn, argu);
+                }
             }
-        }
-        else if (command == "ls") {
-            std::string argu = nextArgument(userInput);
-            if (argu != "") {
-                if (argu == "-h" || argu == "-help" || argu == "--help") {
-                    printf("usage: ls\n");
-                    printf("List information about the files in the current directory on Remote Server.\n");
+            else if (command == "hash" || command == "repair") {
+                std::string argu = nextArgument(userInput);
+                if (argu == "" || argu[0] == '-') {
+                    if (argu == "-h" || argu == "-help" || argu == "--help") {
+                        printf("usage: %s <file>\n", command.c_str());
+                        if (command == "hash") {
+                            printf("Compare file on Remote Server with its copy in Download, block by block.\n");
+                            printf("The server hashes the file into a Merkle tree using all of its cores.\n");
+                        }
+                        else {
+                            printf("Bring the copy of file in Download up to date, fetching only the blocks that differ.\n");
+                        }
+                        printf("ex:\n");
+                        printf("    %s hw1.tar\n", command.c_str());
+                    }
+                    else if (argu == "") {
+                        printf("usage: %s <file>\n%s --help for more information\n", command.c_str(), command.c_str());
+                        continue;
+                    }
+                    else {
+                        fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    }
                 }
                 else {
-                    fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    ok = ClientFunc::hash(conn, argu, wd, serverPath, command == "repair");
                 }
             }
-            else {
-                printf("%s\n", ClientFunc::ls(fd).c_str());
+            else if (command == "find") {
+                std::string path = nextArgument(userInput);
+                std::string pattern = nextArgument(userInput);
+                if (path == "" || path[0] == '-' || pattern == "") {
+                    if (path == "-h" || path == "-help" || path == "--help") {
+                        printf("usage: find <path> <pattern>\n");
+                        printf("Search the subtree under <path> on Remote Server for names matching <pattern>.\n");
+                        printf("The walk runs in parallel on the server and matches are shown as they are found.\n");
+                        printf("ex:\n");
+                        printf("    find . \"*.cpp\"\n");
+                        printf("    find /var/log \"syslog*\"\n");
+                    }
+                    else {
+                        printf("usage: find <path> <pattern>\nfind --help for more information\n");
+                    }
+                }
+                else {
+                    long count = ClientFunc::find(conn, path, pattern);
+                    if (count >= 0) {
+                        printf("%ld match(es)\n", count);
+                    }
+                }
             }
-        }
-        else if (command == "cd") {
-            std::string argu = nextArgument(userInput);
-            if (argu == "" || argu[0] == '-') {
-                if (argu == "-h" || argu == "-help" || argu == "--help") {
-                    printf("usage: cd <path>\n");
-                    printf("Change working directory to <path> on Remote Server.\n");
-                    printf("ex:\n");
-                    printf("    cd \"Network Programming\"\n");
-                    printf("    cd ../Download\n");
+            else if (command == "cp" || command == "mv") {
+                std::string source = nextArgument(userInput);
+                std::string target = nextArgument(userInput);
+                if (source == "" || source[0] == '-' || target == "") {
+                    if (source == "-h" || source == "-help" || source == "--help") {
+                        printf("usage: %s <source> <target>\n", command.c_str());
+                        if (command == "cp") {
+                            printf("Copy <source> to <target> on Remote Server, without sending the data over the network.\n");
+                            printf("The server clones the file where the filesystem supports it.\n");
+                        }
+                        else {
+                            printf("Move or rename <source> to <target> on Remote Server.\n");
+                            printf("Across filesystems the file is copied on the server, then removed.\n");
+                        }
+                        printf("ex:\n");
+                        printf("    %s hw1.tar backup/\n", command.c_str());
+                        printf("    %s \"Network Programming/hw1.tar\" hw1-old.tar\n", command.c_str());
+                    }
+                    else {
+                        printf("usage: %s <source> <target>\n%s --help for more information\n", command.c_str(), command.c_str());
+                    }
                 }
-                else if (argu == "") {
-                    continue;
+                else if (command == "cp") {
+                    ok = ClientFunc::cp(conn, source, target);
                 }
                 else {
-                    fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    ok = ClientFunc::mv(conn, source, target);
                 }
             }
-            else {
-                ClientFunc::cd(fd, argu);
-                serverPath = ClientFunc::pwd(fd);
-            }
-        }
-        else if (command == "u") {
-            std::string argu = nextArgument(userInput);
-            if (argu == "" || argu[0] == '-') {
-                if (argu == "-h" || argu == "-help" || argu == "--help") {
-                    printf("usage: u <file>\n");
-                    printf("Upload file(path related to local working directory) to Remote Server.\n");
-                    printf("ex:\n");
-                    printf("    u hw1.tar\n");
-                    printf("    u ../client.cpp\n");
-                }
-                else if (argu == "") {
-                    printf("usage: u <file>\nu --help for more information\n");
-                    continue;
+            else if (command == "trace") {
+                std::string argu = nextArgument(userInput);
+                if (argu != "on" && argu != "off" && argu != "dump") {
+                    if (argu == "-h" || argu == "-help" || argu == "--help") {
+                        printf("usage: trace <on|off|dump>\n");
+                        printf("Record timing spans of this session on Remote Server.\n");
+                        printf("dump writes them as Chrome trace JSON on the server, for chrome://tracing or Perfetto.\n");
+                        printf("ex:\n");
+                        printf("    trace on\n");
+                        printf("    trace dump\n");
+                    }
+                    else {
+                        printf("usage: trace <on|off|dump>\ntrace --help for more information\n");
+                    }
                 }
                 else {
-                    fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    std::string ret = ClientFunc::trace(conn, argu);
+                    if (ret.find("TRACE ") == 0) {
+                        printf("trace %s\n", ret.c_str() + strlen("TRACE "));
+                    }
+                    else {
+                        fprintf(stderr, "%s\n", ret.find("ERROR ") == 0 ? ret.c_str() + strlen("ERROR ") : ret.c_str());
+                    }
                 }
             }
-            else {
-                ClientFunc::u(fd, argu);
-            }
-        }
-        else if (command == "d") {
-            std::string argu = nextArgument(userInput);
-            if (argu == "" || argu[0] == '-') {
-                if (argu == "-h" || argu == "-help" || argu == "--help") {
-                    printf("usage: d <file>\n");
-                    printf("Download file(path related to working directory on server) to Download.\n");
-                    printf("ex:\n");
-                    printf("    d hw1.tar\n");
-                    printf("    d ../server.cpp\n");
+            else if (command == "mode") {
+                std::string argu = nextArgument(userInput);
+                if (argu == "" || argu[0] == '-') {
+                    if (argu == "-h" || argu == "-help" || argu == "--help") {
+                        printf("usage: mode <tcp|udp> [loss percent] [delay ms]\n");
+                        printf("Select the data channel used by u and d.\n");
+                        printf("udp streams file data over a paced UDP channel with selective acknowledgements.\n");
+                        printf("loss and delay are injected by the transport itself, for testing over loopback.\n");
+                        printf("ex:\n");
+                        printf("    mode udp\n");
+                        printf("    mode udp 2 50\n");
+                        printf("    mode tcp\n");
+                    }
+                    else if (argu == "") {
+                        printf("data channel: %s\n", udpMode ? "udp" : "tcp");
+                    }
+                    else {
+                        fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
+                    }
                 }
-                else if (argu == "") {
-                    printf("usage: d <file>\nd --help for more information\n");
-                    continue;
+                else if (argu == "tcp") {
+                    udpMode = false;
+                }
+                else if (argu == "udp" && unixSocketPath != "") {
+                    fprintf(stderr, "udp needs a network connection, -unix passes open files instead\n");
+                }
+                else if (argu == "udp") {
+                    std::string loss = nextArgument(userInput);
+                    std::string delay = nextArgument(userInput);
+                    double lossPercent = 0.0;
+                    UdpConfig requested;
+                    bool parsed = (loss == "" || sscanf(loss.c_str(), "%lf", &lossPercent) == 1) &&
+                                  (delay == "" || sscanf(delay.c_str(), "%d", &requested.delayMs) == 1);
+                    requested.lossRate = lossPercent / 100.0;
+                    if (!parsed || !requested.valid()) {
+                        fprintf(stderr, "Invalid loss or delay\n");
+                        continue;
+                    }
+                    udpMode = true;
+                    udpConfig.lossRate = requested.lossRate;
+                    udpConfig.delayMs = requested.delayMs;
                 }
                 else {
                     fprintf(stderr, "Unrecognized Argument %s\n", argu.c_str());
                 }
             }
             else {
-                ClientFunc::d(fd, argu, wd);
+                fprintf(stderr, "%s: Command not found\n", command.c_str());
+                ok = false;
             }
         }
-        else {
-            fprintf(stderr, "%s: Command not found\n", command.c_str());
+        catch (const ConnectionLost& e) {
+            // commands other than u / d are not repeated, they may have run before the drop
+            fprintf(stderr, "%s\n", e.what());
+            ok = false;
+            listings.clear();
+            if (!reconnect(conn, host, port, reconnectTimeout, wd, serverPath)) {
+                fprintf(stderr, "Could not reconnect to %s:%d\n", host, port);
+                exit(EXIT_FAILURE);
+            }
         }
     }
+    conn.setRecoverable(false);
+    return ok;
 }
 
 void printInfo() {
@@ -687,6 +2620,14 @@ void printInfo() {
     puts("    cd <path>: change working directory on remote server");
     puts("    u <file>: upload file to remote server");
     puts("    d <file>: download file from server");
+    puts("    hash <file>: compare a file on remote server with its downloaded copy");
+    puts("    repair <file>: fetch only the blocks of a downloaded copy that differ");
+    puts("    find <path> <pattern>: search a directory tree on remote server");
+    puts("    watch <dir>: follow changes to a directory on remote server");
+    puts("    cp <source> <target>: copy a file on remote server");
+    puts("    mv <source> <target>: move or rename a file on remote server");
+    puts("    mode <tcp|udp>: select the data channel used by u and d");
+    puts("    trace <on|off|dump>: record timing spans of this session on remote server");
     puts("    exit: terminate connection");
     puts("");
     puts("    help: print information");
@@ -769,3 +2710,26 @@ std::string nextArgument(std::string& base) {
     ret = trimSpaceLE(ret);
     return ret;
 }
+
+std::string jsonEscape(const std::string& src) {
+    std::string ret;
+    for (unsigned i = 0; i < src.length(); ++i) {
+        unsigned char c = src[i];
+        if (c == '"' || c == '\\') {
+            ret += '\\';
+            ret += c;
+        }
+        else if (c == '\n') {
+            ret += "\\n";
+        }
+        else if (c < 0x20) {
+            char hex[8];
+            sprintf(hex, "\\u%04x", c);
+            ret += hex;
+        }
+        else {
+            ret += c;
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,75 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+// Command table and lookup of the server's dispatcher, shared with
+// dispatchbench.
+//
+// A command line is split at its first space into the name and the argument,
+// the argument trimmed of surrounding spaces, and the name looked up in a
+// constant table.  Everything works on views into the line, nothing is
+// copied or allocated.
+
+#include <cstddef>
+#include <string_view>
+
+// Every command the server takes as X(name, hasArgument), in lookup order.
+// The server expands it into its table with a handler of the same name per
+// row, dispatchbench into commandSpecs, so both always parse the same set.
+// Commands without hasArgument reject trailing text as unknown.
+#define BIRD_COMMANDS(X) \
+    X(q, false) \
+    X(pwd, false) \
+    X(ls, false) \
+    X(cd, true) \
+    X(u, true) \
+    X(d, true) \
+    X(udpu, true) \
+    X(udpd, true) \
+    X(find, true) \
+    X(cp, true) \
+    X(mv, true) \
+    X(replica, false) \
+    X(trace, true) \
+    X(resume, true) \
+    X(hash, true) \
+    X(hashnodes, true) \
+    X(watch, true) \
+    X(unwatch, false)
+
+struct CommandSpec {
+    std::string_view name;
+    bool hasArgument;
+};
+
+#define BIRD_COMMAND_SPEC(name, hasArgument) {#name, hasArgument},
+constexpr CommandSpec commandSpecs[] = {
+    BIRD_COMMANDS(BIRD_COMMAND_SPEC)
+};
+#undef BIRD_COMMAND_SPEC
+
+inline std::string_view trimSpaces(std::string_view str) {
+    while (!str.empty() && str.front() == ' ') {
+        str.remove_prefix(1);
+    }
+    while (!str.empty() && str.back() == ' ') {
+        str.remove_suffix(1);
+    }
+    return str;
+}
+
+// the entry of table named by the first word of line, nullptr when none is or
+// when an entry without hasArgument gets one; Entry has name and hasArgument
+template <typename Entry, size_t N>
+const Entry* parseCommand(const Entry (&table)[N], std::string_view line, std::string_view& argu) {
+    std::string_view::size_type space = line.find(' ');
+    std::string_view name = line.substr(0, space);
+    argu = space == std::string_view::npos ? std::string_view() : trimSpaces(line.substr(space));
+    for (const Entry& entry : table) {
+        if (entry.name == name) {
+            return (entry.hasArgument || argu.empty()) ? &entry : nullptr;
+        }
+    }
+    return nullptr;
+}
+
+#endif // DISPATCH_H
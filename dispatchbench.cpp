@@ -0,0 +1,164 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+#include "dispatch.h"
+#include "transport.h"
+
+// Per-command parse cost of the server's dispatcher.  Command lines of a
+// typical session mix sit in zero-padded maxn-byte frames, as they come off
+// the wire, and are looked up with the same parseCommand() and the same
+// command table the server uses, round robin for a number of iterations.
+// For comparison the same lines go through the copying split the server used
+// before the table (std::string of the frame, find, substr, trim).  Heap
+// allocations are counted by replacing operator new.
+
+typedef std::chrono::steady_clock Clock;
+
+namespace {
+
+unsigned long long allocations = 0;
+
+const char* const mix[] = {
+    "pwd",
+    "ls",
+    "cd -cwd Upload",
+    "cd ..",
+    "u data.bin",
+    "u -resume 1048576 4194304 \"big file.bin\"",
+    "d data.bin",
+    "d -if 65536 1760860800123456789 9ae16a3b2f90404f data.bin",
+    "d -range 1048576 1048576 1760860800123456789 big.bin",
+    "udpd 0.050000 0 data.bin",
+    "find . *.log",
+    "hash big.bin",
+    "hashnodes 3 0 16",
+    "mv a.txt b.txt",
+    "ls -l",
+    "nosuchcommand arg",
+};
+
+struct BenchConfig {
+    unsigned long iterations;
+    BenchConfig() : iterations(10000000) {}
+};
+
+// the pre-table split: copy, find the space, copy both halves, trim
+const CommandSpec* copyingParse(const char* frame, std::string& argu) {
+    std::string line = frame;
+    std::string::size_type space = line.find(' ');
+    std::string name = line.substr(0, space);
+    argu = space == std::string::npos ? "" : line.substr(space);
+    while (!argu.empty() && argu[0] == ' ') {
+        argu.erase(0, 1);
+    }
+    while (!argu.empty() && argu.back() == ' ') {
+        argu.pop_back();
+    }
+    for (const CommandSpec& entry : commandSpecs) {
+        if (entry.name == name) {
+            return (entry.hasArgument || argu.empty()) ? &entry : nullptr;
+        }
+    }
+    return nullptr;
+}
+
+} // namespace
+
+void* operator new(size_t size) {
+    ++allocations;
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+// GCC sees the inlined pair as malloc()/delete, which it is not here
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+#pragma GCC diagnostic pop
+
+bool parseOptions(int argc, char const *argv[], BenchConfig& config);
+void printUsage(const char* name);
+void report(const char* label, const unsigned long& iterations, const Clock::duration& elapsed,
+            const unsigned long long& allocated, const unsigned long long& matched);
+
+int main(int argc, char const *argv[])
+{
+    BenchConfig config;
+    if (!parseOptions(argc, argv, config)) {
+        fprintf(stderr, "Invalid Arguments\n");
+        exit(EXIT_FAILURE);
+    }
+    const size_t lines = sizeof(mix) / sizeof(mix[0]);
+    std::vector<std::vector<char>> frames(lines, std::vector<char>(maxn, 0));
+    for (size_t i = 0; i < lines; ++i) {
+        strncpy(frames[i].data(), mix[i], maxn - 1);
+    }
+    printf("%lu parses over %lu command lines\n", config.iterations, static_cast<unsigned long>(lines));
+    printf("%-10s %12s %14s %12s\n", "parser", "ns/parse", "allocs/parse", "matched");
+
+    // the matches feed the result, so the loops cannot be optimized away
+    unsigned long long matched = 0, before = allocations;
+    Clock::time_point start = Clock::now();
+    for (unsigned long i = 0; i < config.iterations; ++i) {
+        std::string_view argu;
+        const CommandSpec* entry = parseCommand(commandSpecs, std::string_view(frames[i % lines].data()), argu);
+        matched += entry ? argu.size() + 1 : 0;
+    }
+    report("table", config.iterations, Clock::now() - start, allocations - before, matched);
+
+    matched = 0;
+    before = allocations;
+    start = Clock::now();
+    for (unsigned long i = 0; i < config.iterations; ++i) {
+        std::string argu;
+        const CommandSpec* entry = copyingParse(frames[i % lines].data(), argu);
+        matched += entry ? argu.size() + 1 : 0;
+    }
+    report("copying", config.iterations, Clock::now() - start, allocations - before, matched);
+    return 0;
+}
+
+bool parseOptions(int argc, char const *argv[], BenchConfig& config) {
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if (option == "-n" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%lu", &config.iterations) != 1 || config.iterations == 0) {
+                fprintf(stderr, "-n needs a positive number\n");
+                return false;
+            }
+        }
+        else {
+            fprintf(stderr, "Unrecognized Argument %s\n", argv[i]);
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+void printUsage(const char* name) {
+    fprintf(stderr, "usage: %s [options]\n", name);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "    -n <count>        parses per parser (default 10000000)\n");
+}
+
+void report(const char* label, const unsigned long& iterations, const Clock::duration& elapsed,
+            const unsigned long long& allocated, const unsigned long long& matched) {
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    printf("%-10s %12.2f %14.2f %12llu\n", label, ns / iterations, static_cast<double>(allocated) / iterations,
+           matched);
+}
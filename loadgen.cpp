@@ -0,0 +1,803 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <queue>
+#include <random>
+#include "transport.h"
+
+// Synthetic load for the file server: thousands of sessions from one process,
+// all driven by a single epoll loop.  Every session connects, waits for the
+// greeting and then repeatedly thinks (exponentially distributed pause) and
+// runs one command picked from the configured mix.  Uploads send generated
+// data with sizes drawn from the size distribution; downloads fetch files the
+// same session uploaded before.  Throughput, error rate and latency
+// percentiles are reported every interval, per command at the end.
+//
+// The server limits sessions per address, so run it with -max-per-ip 0 and a
+// large enough -max-sessions for the session count used here.
+
+typedef std::chrono::steady_clock Clock;
+
+enum Op {
+    opPwd,
+    opLs,
+    opCd,
+    opU,
+    opD,
+    opConnect,  // establishing a session, counted like a command
+    opCount
+};
+
+const char* const opNames[opCount] = { "pwd", "ls", "cd", "u", "d", "connect" };
+
+// file size distribution, sizes in bytes
+struct SizeDistribution {
+    enum Kind { fixed, uniform, exponential, lognormal } kind;
+    double a;
+    double b;
+    SizeDistribution() : kind(lognormal), a(64 << 10), b(1.0) {}
+    unsigned long sample(std::mt19937_64& rng) const {
+        double size = a;
+        if (kind == uniform) {
+            size = std::uniform_real_distribution<double>(a, b)(rng);
+        }
+        else if (kind == exponential) {
+            size = std::exponential_distribution<double>(1.0 / a)(rng);
+        }
+        else if (kind == lognormal) {
+            size = std::lognormal_distribution<double>(std::log(a), b)(rng);
+        }
+        return static_cast<unsigned long>(std::max(0.0, std::min(size, 1e12)));
+    }
+};
+
+struct LoadConfig {
+    std::string host;
+    std::string port;
+    int sessions;
+    int duration;       // seconds
+    int weights[opConnect];
+    double thinkMs;     // mean pause between commands, 0 = back to back
+    SizeDistribution size;
+    int files;          // distinct upload names per session
+    double interval;    // seconds between report lines
+    int ramp;           // new sessions per second, 0 = all at once
+    unsigned long seed;
+    LoadConfig() : sessions(100), duration(30), thinkMs(100.0), files(4), interval(1.0), ramp(0), seed(1) {
+        weights[opPwd] = 20;
+        weights[opLs] = 10;
+        weights[opCd] = 10;
+        weights[opU] = 30;
+        weights[opD] = 30;
+    }
+};
+
+struct Stats {
+    std::vector<double> latency[opCount];   // milliseconds, successful commands
+    unsigned long errors[opCount];
+    unsigned long bytes;
+    Stats() : bytes(0) {
+        memset(errors, 0, sizeof(errors));
+    }
+    unsigned long count() const {
+        unsigned long n = 0;
+        for (int op = 0; op < opCount; ++op) {
+            n += latency[op].size() + errors[op];
+        }
+        return n;
+    }
+    unsigned long errorCount() const {
+        unsigned long n = 0;
+        for (int op = 0; op < opCount; ++op) {
+            n += errors[op];
+        }
+        return n;
+    }
+};
+
+class LoadGenerator {
+public:
+    explicit LoadGenerator(const LoadConfig& config)
+        : config(config), rng(config.seed), active(0), epollFd(-1) {
+        payload.resize(64 << 10);
+        for (auto& byte : payload) {
+            byte = static_cast<char>(rng());
+        }
+        scratch.resize(64 << 10);
+    }
+    void run() {
+        epollFd = epoll_create1(0);
+        if (epollFd < 0) {
+            fprintf(stderr, "epoll_create1 Error: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        begin = Clock::now();
+        end = begin + std::chrono::seconds(config.duration);
+        sessions.resize(config.sessions);
+        for (int i = 0; i < config.sessions; ++i) {
+            sessions[i].id = i;
+            double delay = config.ramp > 0 ? static_cast<double>(i) / config.ramp : 0.0;
+            schedule(sessions[i], begin + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(delay)));
+        }
+        printf("%8s %8s %10s %9s %8s %7s %9s %9s %9s\n",
+               "time", "sessions", "ops/s", "MB/s", "errors", "err%", "p50 ms", "p99 ms", "max ms");
+        fflush(stdout);
+        Clock::time_point nextReport = begin + std::chrono::duration_cast<Clock::duration>(
+                                                   std::chrono::duration<double>(config.interval));
+        Clock::time_point lastReport = begin;
+        std::vector<epoll_event> events(1024);
+        while (true) {
+            Clock::time_point now = Clock::now();
+            while (!timers.empty() && timers.top().first <= now) {
+                std::pair<Clock::time_point, std::pair<int, unsigned> > timer = timers.top();
+                timers.pop();
+                Session& s = sessions[timer.second.first];
+                if (s.timerGeneration == timer.second.second) {
+                    wake(s);
+                }
+            }
+            if (now >= nextReport) {
+                report(std::chrono::duration<double>(now - begin).count(),
+                       std::chrono::duration<double>(now - lastReport).count(), interval);
+                total.bytes += interval.bytes;
+                interval = Stats();
+                lastReport = now;
+                nextReport += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(config.interval));
+            }
+            if (now >= end && active == 0 && timers.empty()) {
+                break;
+            }
+            Clock::time_point wakeAt = nextReport;
+            if (!timers.empty()) {
+                wakeAt = std::min(wakeAt, timers.top().first);
+            }
+            int timeout = std::max<long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(wakeAt - now).count() + 1);
+            int n = epoll_wait(epollFd, events.data(), events.size(), timeout);
+            for (int i = 0; i < n; ++i) {
+                Session& s = sessions[events[i].data.u32];
+                if (s.fd < 0) {
+                    continue;
+                }
+                if (s.phase == Session::connecting) {
+                    connected(s);
+                    continue;
+                }
+                if (events[i].events & (EPOLLOUT | EPOLLERR)) {
+                    flush(s);
+                }
+                if (s.fd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                    receive(s);
+                }
+            }
+        }
+        total.bytes += interval.bytes;
+        summary(std::chrono::duration<double>(Clock::now() - begin).count());
+    }
+
+private:
+    struct Session {
+        enum Phase { closed, connecting, greeting, thinking, running } phase;
+        int id;
+        int fd;
+        unsigned timerGeneration;
+        Op op;
+        int step;
+        Clock::time_point started;
+        std::string out;            // queued control messages
+        size_t outPos;
+        unsigned long payloadOut;   // generated upload bytes still to send
+        char in[maxn];
+        size_t inLen;
+        size_t inWant;              // maxn for messages, 16 for sparse extent headers
+        unsigned long payloadIn;    // download bytes still to receive
+        bool sparse;
+        long lsLeft;
+        bool inUpload;              // working directory is Upload/ rather than the root
+        unsigned long uploadSize;
+        int uploadSlot;
+        std::vector<bool> uploaded[2];  // per directory, which slots exist on the server
+        Session() : phase(closed), id(0), fd(-1), timerGeneration(0), op(opPwd), step(0), outPos(0),
+                    payloadOut(0), inLen(0), inWant(maxn), payloadIn(0), sparse(false), lsLeft(0),
+                    inUpload(false), uploadSize(0), uploadSlot(0) {}
+    };
+
+private:
+    const LoadConfig& config;
+    std::mt19937_64 rng;
+    std::vector<Session> sessions;
+    std::priority_queue<std::pair<Clock::time_point, std::pair<int, unsigned> >,
+                        std::vector<std::pair<Clock::time_point, std::pair<int, unsigned> > >,
+                        std::greater<std::pair<Clock::time_point, std::pair<int, unsigned> > > > timers;
+    int active;             // sessions with an open connection
+    int epollFd;
+    Clock::time_point begin;
+    Clock::time_point end;
+    Stats interval;
+    Stats total;
+    std::vector<char> payload;
+    std::vector<char> scratch;
+
+private:
+    void schedule(Session& s, const Clock::time_point& at) {
+        timers.push(std::make_pair(at, std::make_pair(s.id, ++s.timerGeneration)));
+    }
+    void think(Session& s) {
+        s.phase = Session::thinking;
+        double pause = config.thinkMs > 0 ? std::exponential_distribution<double>(1.0 / config.thinkMs)(rng) : 0.0;
+        schedule(s, Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(pause)));
+    }
+    void wake(Session& s) {
+        if (s.phase == Session::closed) {
+            if (Clock::now() < end) {
+                open(s);
+            }
+        }
+        else if (s.phase == Session::thinking) {
+            if (Clock::now() >= end) {
+                send(s, "q");
+                flush(s);
+                close(s);
+            }
+            else {
+                start(s);
+            }
+        }
+    }
+    void open(Session& s) {
+        addrinfo hints, *result;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        s.started = Clock::now();
+        s.op = opConnect;
+        if (getaddrinfo(config.host.c_str(), config.port.c_str(), &hints, &result) != 0) {
+            failed(s);
+            return;
+        }
+        s.fd = socket(result->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (s.fd < 0 || (connect(s.fd, result->ai_addr, result->ai_addrlen) < 0 && errno != EINPROGRESS)) {
+            freeaddrinfo(result);
+            failed(s);
+            return;
+        }
+        freeaddrinfo(result);
+        int one = 1;
+        setsockopt(s.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        ++active;
+        s.phase = Session::connecting;
+        s.inLen = 0;
+        s.inWant = maxn;
+        s.payloadIn = 0;
+        s.out.clear();
+        s.outPos = 0;
+        s.payloadOut = 0;
+        s.inUpload = false;
+        epoll_event ev;
+        ev.events = EPOLLOUT;
+        ev.data.u32 = s.id;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, s.fd, &ev);
+    }
+    void connected(Session& s) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(s.fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            failed(s);
+            return;
+        }
+        s.phase = Session::greeting;
+        watch(s);
+    }
+    void close(Session& s) {
+        if (s.fd >= 0) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, s.fd, nullptr);
+            ::close(s.fd);
+            s.fd = -1;
+            --active;
+        }
+        s.phase = Session::closed;
+    }
+    // the connection broke: the command (or connect) in progress fails and
+    // the session reconnects after a pause
+    void failed(Session& s) {
+        ++interval.errors[s.phase == Session::running ? s.op : opConnect];
+        close(s);
+        schedule(s, Clock::now() + std::chrono::seconds(1));
+    }
+    void finish(Session& s, const bool& ok) {
+        if (ok) {
+            interval.latency[s.op].push_back(std::chrono::duration<double, std::milli>(Clock::now() - s.started).count());
+        }
+        else {
+            ++interval.errors[s.op];
+        }
+        think(s);
+    }
+    Op pick() {
+        int sum = 0;
+        for (int op = 0; op < opConnect; ++op) {
+            sum += config.weights[op];
+        }
+        int x = std::uniform_int_distribution<int>(0, sum - 1)(rng);
+        for (int op = 0; op < opConnect; ++op) {
+            if (x < config.weights[op]) {
+                return static_cast<Op>(op);
+            }
+            x -= config.weights[op];
+        }
+        return opPwd;
+    }
+    void start(Session& s) {
+        s.phase = Session::running;
+        s.op = pick();
+        s.step = 0;
+        s.started = Clock::now();
+        std::vector<bool>& files = s.uploaded[s.inUpload];
+        files.resize(config.files, false);
+        std::vector<int> existing;
+        for (int i = 0; i < config.files; ++i) {
+            if (files[i]) {
+                existing.push_back(i);
+            }
+        }
+        if (s.op == opD && existing.empty()) {
+            s.op = opU;
+        }
+        if (s.op == opPwd) {
+            send(s, "pwd");
+        }
+        else if (s.op == opLs) {
+            send(s, "ls");
+        }
+        else if (s.op == opCd) {
+            send(s, s.inUpload ? "cd .." : "cd Upload");
+        }
+        else if (s.op == opU) {
+            s.uploadSlot = std::uniform_int_distribution<int>(0, config.files - 1)(rng);
+            s.uploadSize = config.size.sample(rng);
+            send(s, "u " + fileName(s, s.uploadSlot));
+        }
+        else {
+            int slot = existing[std::uniform_int_distribution<int>(0, existing.size() - 1)(rng)];
+            send(s, "d " + fileName(s, slot));
+        }
+        flush(s);
+    }
+    std::string fileName(const Session& s, const int& slot) const {
+        return "loadgen-" + std::to_string(getpid()) + "-" + std::to_string(s.id) + "-" + std::to_string(slot) + ".bin";
+    }
+    void send(Session& s, const std::string& message) {
+        size_t at = s.out.size();
+        s.out.resize(at + maxn, '\0');
+        memcpy(&s.out[at], message.c_str(), std::min<size_t>(message.length(), maxn - 1));
+    }
+    void watch(Session& s) {
+        epoll_event ev;
+        ev.events = EPOLLIN | (s.outPos < s.out.size() || s.payloadOut > 0 ? EPOLLOUT : 0);
+        ev.data.u32 = s.id;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, s.fd, &ev);
+    }
+    void flush(Session& s) {
+        while (s.outPos < s.out.size() || s.payloadOut > 0) {
+            iovec iov[2];
+            int count = 0;
+            if (s.outPos < s.out.size()) {
+                iov[count].iov_base = &s.out[s.outPos];
+                iov[count].iov_len = s.out.size() - s.outPos;
+                ++count;
+            }
+            if (s.payloadOut > 0) {
+                iov[count].iov_base = payload.data();
+                iov[count].iov_len = std::min<unsigned long>(payload.size(), s.payloadOut);
+                ++count;
+            }
+            ssize_t n = writev(s.fd, iov, count);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && errno == EAGAIN) {
+                break;
+            }
+            if (n <= 0) {
+                failed(s);
+                return;
+            }
+            size_t control = std::min<size_t>(n, s.out.size() - s.outPos);
+            s.outPos += control;
+            s.payloadOut -= n - control;
+            interval.bytes += n - control;
+        }
+        if (s.outPos == s.out.size()) {
+            s.out.clear();
+            s.outPos = 0;
+        }
+        watch(s);
+    }
+    void receive(Session& s) {
+        while (s.fd >= 0) {
+            ssize_t n;
+            if (s.payloadIn > 0) {
+                n = read(s.fd, scratch.data(), std::min<unsigned long>(scratch.size(), s.payloadIn));
+            }
+            else {
+                n = read(s.fd, s.in + s.inLen, s.inWant - s.inLen);
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && errno == EAGAIN) {
+                return;
+            }
+            if (n <= 0) {
+                failed(s);
+                return;
+            }
+            if (s.payloadIn > 0) {
+                s.payloadIn -= n;
+                interval.bytes += n;
+                if (s.payloadIn == 0 && !s.sparse) {
+                    finish(s, true);
+                }
+                continue;
+            }
+            s.inLen += n;
+            if (s.inLen == s.inWant) {
+                s.inLen = 0;
+                message(s);
+            }
+        }
+    }
+    // one complete message (or sparse extent header) in s.in
+    void message(Session& s) {
+        if (s.phase == Session::greeting) {
+            if (!strncmp(s.in, "WELCOME", strlen("WELCOME"))) {
+                s.op = opConnect;
+                finish(s, true);
+            }
+            else {
+                failed(s);  // SERVER_BUSY
+            }
+            return;
+        }
+        if (s.phase != Session::running) {
+            failed(s);      // IDLE_TIMEOUT or anything else unsolicited
+            return;
+        }
+        if (s.op == opPwd) {
+            finish(s, s.in[0] == '/');
+        }
+        else if (s.op == opLs) {
+            if (s.step == 0) {
+                if (sscanf(s.in, "length = %ld", &s.lsLeft) != 1) {
+                    finish(s, false);
+                    return;
+                }
+                s.step = 1;
+            }
+            else {
+                --s.lsLeft;
+            }
+            if (s.lsLeft == 0) {
+                finish(s, true);
+            }
+        }
+        else if (s.op == opCd) {
+            if (s.in[0] == '\0') {
+                s.inUpload = !s.inUpload;
+            }
+            finish(s, s.in[0] == '\0');
+        }
+        else if (s.op == opU) {
+            if (s.step == 0) {
+                if (strcmp(s.in, "OK")) {
+                    finish(s, false);
+                    return;
+                }
+                s.step = 1;
+                send(s, "filesize = " + std::to_string(s.uploadSize));
+                s.payloadOut = s.uploadSize;
+                flush(s);
+            }
+            else {
+                bool ok = !strcmp(s.in, "COMMITTED");
+                if (ok) {
+                    s.uploaded[s.inUpload][s.uploadSlot] = true;
+                }
+                finish(s, ok);
+            }
+        }
+        else if (s.op == opD) {
+            if (s.step == 0) {
+                if (strcmp(s.in, "FILE_EXISTS")) {
+                    finish(s, false);
+                    return;
+                }
+                s.step = 1;
+                send(s, "OK");
+                flush(s);
+            }
+            else if (s.step == 1) {
+                unsigned long size;
+                if (sscanf(s.in, "filesize = %lu", &size) != 1) {
+                    finish(s, false);
+                    return;
+                }
+                s.sparse = strstr(s.in, " sparse") != nullptr;
+                if (s.sparse) {
+                    s.step = 2;
+                    s.inWant = 16;
+                }
+                else if (size == 0) {
+                    finish(s, true);
+                }
+                else {
+                    s.payloadIn = size;
+                }
+            }
+            else {
+                uint64_t length;
+                memcpy(&length, s.in + 8, 8);
+                length = be64toh(length);
+                if (length == 0) {
+                    s.inWant = maxn;
+                    s.sparse = false;
+                    finish(s, true);
+                }
+                else {
+                    s.payloadIn = length;
+                }
+            }
+        }
+    }
+    static double percentile(std::vector<double>& samples, const double& p) {
+        if (samples.empty()) {
+            return 0.0;
+        }
+        size_t k = std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()));
+        std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+        return samples[k];
+    }
+    void report(const double& elapsed, const double& seconds, Stats& stats) {
+        std::vector<double> all;
+        for (int op = 0; op < opCount; ++op) {
+            all.insert(all.end(), stats.latency[op].begin(), stats.latency[op].end());
+            total.latency[op].insert(total.latency[op].end(), stats.latency[op].begin(), stats.latency[op].end());
+            total.errors[op] += stats.errors[op];
+        }
+        unsigned long count = stats.count(), errors = stats.errorCount();
+        double maxMs = all.empty() ? 0.0 : *std::max_element(all.begin(), all.end());
+        double p50 = percentile(all, 0.50), p99 = percentile(all, 0.99);
+        printf("%8.1f %8d %10.1f %9.2f %8lu %7.2f %9.3f %9.3f %9.3f\n",
+               elapsed, active, count / seconds, stats.bytes / seconds / 1e6, errors,
+               count ? 100.0 * errors / count : 0.0, p50, p99, maxMs);
+        fflush(stdout);
+    }
+    void summary(const double& elapsed) {
+        printf("\n%-8s %10s %8s %9s %9s %9s\n", "command", "ok", "errors", "p50 ms", "p99 ms", "max ms");
+        for (int op = 0; op < opCount; ++op) {
+            std::vector<double>& samples = total.latency[op];
+            if (samples.empty() && total.errors[op] == 0) {
+                continue;
+            }
+            double maxMs = samples.empty() ? 0.0 : *std::max_element(samples.begin(), samples.end());
+            double p50 = percentile(samples, 0.50), p99 = percentile(samples, 0.99);
+            printf("%-8s %10lu %8lu %9.3f %9.3f %9.3f\n", opNames[op], static_cast<unsigned long>(samples.size()),
+                   total.errors[op], p50, p99, maxMs);
+        }
+        unsigned long count = total.count(), errors = total.errorCount();
+        printf("\n%lu commands in %.1f s: %.1f ops/s, %.2f MB/s, %.2f%% errors\n", count, elapsed,
+               count / elapsed, total.bytes / elapsed / 1e6, count ? 100.0 * errors / count : 0.0);
+    }
+};
+
+bool parseOptions(int argc, char const *argv[], LoadConfig& config);
+bool parseSize(const std::string& text, double& size);
+void printUsage(const char* name);
+
+int main(int argc, char const *argv[])
+{
+    if (argc < 3) {
+        printUsage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    LoadConfig config;
+    if (!parseOptions(argc, argv, config)) {
+        fprintf(stderr, "Invalid Arguments\n");
+        exit(EXIT_FAILURE);
+    }
+    // every session is a socket
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < static_cast<rlim_t>(config.sessions) + 16) {
+        fprintf(stderr, "Warning: open file limit %lu is below the session count\n",
+                static_cast<unsigned long>(limit.rlim_cur));
+    }
+    signal(SIGPIPE, SIG_IGN);
+    LoadGenerator generator(config);
+    generator.run();
+    return 0;
+}
+
+bool parseOptions(int argc, char const *argv[], LoadConfig& config) {
+    config.host = argv[1];
+    config.port = argv[2];
+    for (int i = 3; i < argc; ++i) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "%s needs a value\n", argv[i]);
+            return false;
+        }
+        std::string value = argv[++i];
+        if (option == "-c") {
+            if (sscanf(value.c_str(), "%d", &config.sessions) != 1 || config.sessions < 1) {
+                fprintf(stderr, "-c needs a positive number\n");
+                return false;
+            }
+        }
+        else if (option == "-t") {
+            if (sscanf(value.c_str(), "%d", &config.duration) != 1 || config.duration < 1) {
+                fprintf(stderr, "-t needs a positive number\n");
+                return false;
+            }
+        }
+        else if (option == "-think") {
+            if (sscanf(value.c_str(), "%lf", &config.thinkMs) != 1 || config.thinkMs < 0) {
+                fprintf(stderr, "-think needs a non-negative number\n");
+                return false;
+            }
+        }
+        else if (option == "-files") {
+            if (sscanf(value.c_str(), "%d", &config.files) != 1 || config.files < 1) {
+                fprintf(stderr, "-files needs a positive number\n");
+                return false;
+            }
+        }
+        else if (option == "-interval") {
+            if (sscanf(value.c_str(), "%lf", &config.interval) != 1 || config.interval <= 0) {
+                fprintf(stderr, "-interval needs a positive number\n");
+                return false;
+            }
+        }
+        else if (option == "-ramp") {
+            if (sscanf(value.c_str(), "%d", &config.ramp) != 1 || config.ramp < 0) {
+                fprintf(stderr, "-ramp needs a non-negative number\n");
+                return false;
+            }
+        }
+        else if (option == "-seed") {
+            if (sscanf(value.c_str(), "%lu", &config.seed) != 1) {
+                fprintf(stderr, "-seed needs a number\n");
+                return false;
+            }
+        }
+        else if (option == "-mix") {
+            // pwd=20,ls=10,... commands left out get weight 0
+            int weights[opConnect] = { 0, 0, 0, 0, 0 };
+            int sum = 0;
+            size_t pos = 0;
+            while (pos < value.length()) {
+                size_t comma = value.find(',', pos);
+                std::string item = value.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+                pos = comma == std::string::npos ? value.length() : comma + 1;
+                size_t eq = item.find('=');
+                int op = opConnect, weight = -1;
+                for (int k = 0; k < opConnect && eq != std::string::npos; ++k) {
+                    if (item.substr(0, eq) == opNames[k]) {
+                        op = k;
+                    }
+                }
+                if (op == opConnect || sscanf(item.c_str() + eq + 1, "%d", &weight) != 1 || weight < 0) {
+                    fprintf(stderr, "-mix: bad entry \"%s\"\n", item.c_str());
+                    return false;
+                }
+                weights[op] = weight;
+                sum += weight;
+            }
+            if (sum == 0) {
+                fprintf(stderr, "-mix needs a positive weight\n");
+                return false;
+            }
+            memcpy(config.weights, weights, sizeof(weights));
+        }
+        else if (option == "-size") {
+            // fixed:<size>, uniform:<min>:<max>, exp:<mean>, lognormal:<median>:<sigma>
+            size_t colon = value.find(':');
+            std::string kind = value.substr(0, colon);
+            std::string first = colon == std::string::npos ? "" : value.substr(colon + 1);
+            std::string second = "";
+            if (first.find(':') != std::string::npos) {
+                second = first.substr(first.find(':') + 1);
+                first = first.substr(0, first.find(':'));
+            }
+            SizeDistribution& size = config.size;
+            bool ok = parseSize(first, size.a);
+            if (kind == "fixed" && second == "") {
+                size.kind = SizeDistribution::fixed;
+            }
+            else if (kind == "uniform") {
+                size.kind = SizeDistribution::uniform;
+                ok = ok && parseSize(second, size.b) && size.a <= size.b;
+            }
+            else if (kind == "exp" && second == "") {
+                size.kind = SizeDistribution::exponential;
+                ok = ok && size.a > 0;
+            }
+            else if (kind == "lognormal") {
+                size.kind = SizeDistribution::lognormal;
+                ok = ok && size.a > 0 && sscanf(second.c_str(), "%lf", &size.b) == 1 && size.b >= 0;
+            }
+            else {
+                ok = false;
+            }
+            if (!ok) {
+                fprintf(stderr, "-size: bad distribution \"%s\"\n", value.c_str());
+                return false;
+            }
+        }
+        else {
+            fprintf(stderr, "Unrecognized Argument %s\n", option.c_str());
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// bytes with an optional K, M or G suffix
+bool parseSize(const std::string& text, double& size) {
+    char suffix = '\0';
+    int n = sscanf(text.c_str(), "%lf%c", &size, &suffix);
+    if (n < 1 || size < 0) {
+        return false;
+    }
+    if (suffix == 'K' || suffix == 'k') {
+        size *= 1 << 10;
+    }
+    else if (suffix == 'M' || suffix == 'm') {
+        size *= 1 << 20;
+    }
+    else if (suffix == 'G' || suffix == 'g') {
+        size *= 1 << 30;
+    }
+    else if (suffix != '\0') {
+        return false;
+    }
+    return true;
+}
+
+void printUsage(const char* name) {
+    fprintf(stderr, "usage: %s <server host> <port> [options]\n", name);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "    -c <n>            concurrent sessions (default 100)\n");
+    fprintf(stderr, "    -t <sec>          test duration (default 30)\n");
+    fprintf(stderr, "    -mix <weights>    command mix (default pwd=20,ls=10,cd=10,u=30,d=30)\n");
+    fprintf(stderr, "    -think <ms>       mean think time between commands, exponential (default 100)\n");
+    fprintf(stderr, "    -size <dist>      upload sizes (default lognormal:64K:1.0):\n");
+    fprintf(stderr, "                          fixed:<size>  uniform:<min>:<max>  exp:<mean>  lognormal:<median>:<sigma>\n");
+    fprintf(stderr, "    -files <n>        distinct file names each session uploads to (default 4)\n");
+    fprintf(stderr, "    -interval <sec>   report interval (default 1)\n");
+    fprintf(stderr, "    -ramp <n>         sessions started per second, 0 = all at once (default 0)\n");
+    fprintf(stderr, "    -seed <n>         random seed (default 1)\n");
+    fprintf(stderr, "the server limits sessions per address: run it with -max-per-ip 0 -max-sessions 0\n");
+}
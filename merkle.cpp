@@ -0,0 +1,222 @@
+#include "merkle.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include "trace.h"
+
+namespace {
+
+constexpr uint32_t roundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// FIPS 180-4 SHA-256, incremental
+class Sha256 {
+public:
+    Sha256() : length(0), used(0) {
+        static const uint32_t initial[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        memcpy(state, initial, sizeof(state));
+    }
+    void update(const unsigned char* data, size_t n) {
+        length += n;
+        if (used > 0) {
+            size_t take = std::min(n, sizeof(block) - used);
+            memcpy(block + used, data, take);
+            used += take;
+            data += take;
+            n -= take;
+            if (used < sizeof(block)) {
+                return;
+            }
+            compress(block);
+            used = 0;
+        }
+        for (; n >= sizeof(block); data += sizeof(block), n -= sizeof(block)) {
+            compress(data);
+        }
+        memcpy(block, data, n);
+        used = n;
+    }
+    void finish(MerkleTree::Digest& digest) {
+        uint64_t bits = length * 8;
+        unsigned char pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (used != 56) {
+            update(&pad, 1);
+        }
+        unsigned char tail[8];
+        for (int i = 0; i < 8; ++i) {
+            tail[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        }
+        update(tail, 8);
+        for (int i = 0; i < 8; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                digest[4 * i + j] = static_cast<unsigned char>(state[i] >> (24 - 8 * j));
+            }
+        }
+    }
+
+private:
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+
+private:
+    static uint32_t rotate(const uint32_t& x, const int& n) {
+        return (x >> n) | (x << (32 - n));
+    }
+    void compress(const unsigned char* data) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = static_cast<uint32_t>(data[4 * i]) << 24 | static_cast<uint32_t>(data[4 * i + 1]) << 16 |
+                   static_cast<uint32_t>(data[4 * i + 2]) << 8 | data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) +
+                          roundConstants[i] + w[i];
+            uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+};
+
+bool hashBlock(const int& fileFd, const unsigned long& offset, const unsigned long& length,
+               std::vector<unsigned char>& buffer, MerkleTree::Digest& digest) {
+    Sha256 sha;
+    const unsigned char leaf = 0x00;
+    sha.update(&leaf, 1);
+    unsigned long done = 0;
+    while (done < length) {
+        size_t want = std::min<unsigned long>(buffer.size(), length - done);
+        ssize_t n = pread(fileFd, buffer.data(), want, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        sha.update(buffer.data(), n);
+        done += n;
+    }
+    sha.finish(digest);
+    return true;
+}
+
+} // namespace
+
+std::string MerkleTree::toHex(const Digest& digest) {
+    char text[2 * sizeof(Digest) + 1];
+    for (size_t i = 0; i < digest.size(); ++i) {
+        sprintf(text + 2 * i, "%02x", digest[i]);
+    }
+    return text;
+}
+
+bool MerkleTree::fromHex(const char* text, Digest& digest) {
+    for (size_t i = 0; i < digest.size(); ++i) {
+        unsigned int byte;
+        if (!isxdigit(static_cast<unsigned char>(text[2 * i])) ||
+            !isxdigit(static_cast<unsigned char>(text[2 * i + 1])) || sscanf(text + 2 * i, "%2x", &byte) != 1) {
+            return false;
+        }
+        digest[i] = static_cast<unsigned char>(byte);
+    }
+    return true;
+}
+
+bool MerkleTree::build(const int& fileFd, const unsigned long& size, const unsigned long& blockSize,
+                       const int& threads) {
+    TraceSpan span("merkle build", size);
+    this->size = size;
+    this->blockSize = blockSize;
+    tree.clear();
+    // an empty file still has one (empty) block
+    size_t blocks = std::max<size_t>((size + blockSize - 1) / blockSize, 1);
+    std::vector<Digest> leaves(blocks);
+    size_t workers = threads > 0 ? threads : std::max(std::thread::hardware_concurrency(), 1u);
+    workers = std::min(workers, blocks);
+    // blocks are handed out one at a time, so a slow region does not hold up a whole share
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    auto hashLeaves = [&] {
+        std::vector<unsigned char> buffer(std::min<unsigned long>(blockSize, 1ul << 20));
+        size_t i;
+        while (!failed.load(std::memory_order_relaxed) && (i = next.fetch_add(1)) < blocks) {
+            unsigned long offset = i * blockSize;
+            unsigned long length = std::min<unsigned long>(blockSize, size - std::min(size, offset));
+            if (!hashBlock(fileFd, offset, length, buffer, leaves[i])) {
+                failed = true;
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < workers; ++i) {
+        pool.push_back(std::thread(hashLeaves));
+    }
+    hashLeaves();
+    for (auto& worker : pool) {
+        worker.join();
+    }
+    if (failed) {
+        return false;
+    }
+    tree.push_back(std::move(leaves));
+    while (tree.back().size() > 1) {
+        const std::vector<Digest>& below = tree.back();
+        std::vector<Digest> level((below.size() + 1) / 2);
+        for (size_t i = 0; i < level.size(); ++i) {
+            if (2 * i + 1 == below.size()) {
+                level[i] = below[2 * i];
+                continue;
+            }
+            Sha256 sha;
+            const unsigned char inner = 0x01;
+            sha.update(&inner, 1);
+            sha.update(below[2 * i].data(), below[2 * i].size());
+            sha.update(below[2 * i + 1].data(), below[2 * i + 1].size());
+            sha.finish(level[i]);
+        }
+        tree.push_back(std::move(level));
+    }
+    return true;
+}
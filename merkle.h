@@ -0,0 +1,62 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+// SHA-256 Merkle tree over the fixed-size blocks of a file.
+//
+// Level 0 holds one leaf per block, SHA-256(0x00 || block); every level
+// above pairs up the nodes below, SHA-256(0x01 || left || right), and a node
+// without a partner moves up unchanged, until a single root is left.  The
+// prefixes keep leaves and inner nodes from ever colliding.  Two copies of a
+// file are compared top down: only the subtrees under differing nodes are
+// looked at, which ends in the exact blocks that differ.  Leaves are hashed
+// by several threads taking blocks one at a time, each with its own preads.
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+class MerkleTree {
+public:
+    typedef std::array<unsigned char, 32> Digest;
+
+public:
+    static std::string toHex(const Digest& digest);
+    // 64 hex digits at text, false when they are not
+    static bool fromHex(const char* text, Digest& digest);
+
+public:
+    MerkleTree() : size(0), blockSize(0) {}
+    // hash the first size bytes of fileFd, threads = 0 for one per core;
+    // false on a read error
+    bool build(const int& fileFd, const unsigned long& size, const unsigned long& blockSize, const int& threads);
+    bool empty() const {
+        return tree.empty();
+    }
+    unsigned long getSize() const {
+        return size;
+    }
+    unsigned long getBlockSize() const {
+        return blockSize;
+    }
+    // level 0 = leaves, levels() - 1 = root
+    int levels() const {
+        return static_cast<int>(tree.size());
+    }
+    size_t width(const int& level) const {
+        return tree[level].size();
+    }
+    const Digest& node(const int& level, const size_t& index) const {
+        return tree[level][index];
+    }
+    const Digest& root() const {
+        return tree.back().front();
+    }
+
+private:
+    unsigned long size;
+    unsigned long blockSize;
+    std::vector<std::vector<Digest>> tree;
+};
+
+#endif // MERKLE_H
@@ -0,0 +1,478 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <thread>
+#include "sessionlog.h"
+#include "transport.h"
+
+// Re-drives sessions a server recorded with -record.  Every log becomes one
+// connection, started at its original offset from the first session, that
+// sends the recorded messages in order: before each, the client data the
+// server consumed ahead of it (generated, sized as recorded) goes out and the
+// bytes the server sent ahead of it are read, then the message waits for its
+// recorded time, divided by -speed (0 = no waiting at all).  Command times,
+// from a command's message to the point the next one could go, are reported
+// per command next to the times of the recorded session.
+//
+// The server must start from the same tree the recorded sessions saw, or the
+// replies differ in size and the replay loses step with the log; sessions
+// that do are reported as diverged.  Uploads carry generated data; a chunked
+// one keeps its size on the wire, but not its chunk count, so the file comes
+// out slightly different in size.  Data travelling over UDP and session
+// resumption cannot be replayed.
+
+typedef std::chrono::steady_clock Clock;
+
+struct ReplayConfig {
+    std::string host;
+    std::string port;
+    std::vector<std::string> logs;
+    double speed;       // 1 = recorded pace, 0 = as fast as possible
+    int timeout;        // seconds without progress before a session counts as diverged
+    ReplayConfig() : speed(1.0), timeout(30) {}
+};
+
+// one command, in milliseconds
+struct Sample {
+    std::string command;
+    double recorded;
+    double replayed;
+};
+
+class SessionReplay {
+public:
+    SessionReplay(const ReplayConfig& config, const std::vector<SessionLog::Record>& records)
+        : config(config), records(records), fd(-1), diverged(false) {
+        filler.resize(64 << 10);
+        uint32_t x = 2463534242u;
+        for (auto& byte : filler) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            byte = static_cast<char>(x);
+        }
+        scratch.resize(64 << 10);
+    }
+    ~SessionReplay() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    // replay the whole log starting at begin; what went wrong, empty when nothing did
+    std::string run(const Clock::time_point& begin) {
+        std::this_thread::sleep_until(begin);
+        if (!open()) {
+            return "cannot connect: " + error;
+        }
+        char greeting[maxn];
+        if (!pump({}, maxn, greeting) || strncmp(greeting, "WELCOME", strlen("WELCOME"))) {
+            return error != "" ? error : std::string("turned away: ") + greeting;
+        }
+        std::vector<Piece> payload;
+        const SessionLog::Record* command = nullptr;
+        Clock::time_point commandSent;
+        Clock::duration waited(0);
+        for (const SessionLog::Record& record : records) {
+            if (!pump(payload, record.sent, nullptr)) {
+                return error;
+            }
+            if (command && record.kind != SessionLog::reply) {
+                Sample sample;
+                sample.command = command->text.substr(0, command->text.find(' '));
+                sample.recorded = std::max<int64_t>(0, record.at - record.idle - command->at) / 1000.0;
+                sample.replayed = std::chrono::duration<double, std::milli>(Clock::now() - commandSent - waited).count();
+                samples.push_back(sample);
+                command = nullptr;
+            }
+            if (record.kind == SessionLog::end) {
+                break;
+            }
+            Clock::time_point before = Clock::now();
+            if (config.speed > 0) {
+                std::this_thread::sleep_until(begin + std::chrono::duration_cast<Clock::duration>(
+                                                          std::chrono::duration<double, std::micro>(record.at / config.speed)));
+            }
+            waited += Clock::now() - before;
+            std::string text = record.kind == SessionLog::command ? revalidated(record.text) : record.text;
+            std::string message(maxn, '\0');
+            memcpy(&message[0], text.data(), std::min<size_t>(text.length(), maxn - 1));
+            payload = { Piece(message, 0) };
+            if (!pump(payload, 0, nullptr)) {
+                return error;
+            }
+            if (record.kind == SessionLog::command) {
+                command = &record;
+                commandSent = Clock::now();
+                waited = Clock::duration(0);
+            }
+            payload = framed(record.text, nextPayload(record));
+            if (command && !command->text.compare(0, 2, "u ") && command->text.compare(0, 10, "u -resume ") &&
+                payload.size() == 1 && payload[0].header == "") {
+                uploaded[command->text.substr(2)] = fillerHash(payload[0].filler);
+            }
+        }
+        // the server hangs up after q; anything it still sends was not in the log
+        shutdown(fd, SHUT_WR);
+        unsigned long extra = 0;
+        while (waitFor(POLLIN)) {
+            ssize_t n = read(fd, scratch.data(), scratch.size());
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            extra += n;
+        }
+        if (extra > 0 || diverged) {
+            return "diverged, " + std::to_string(extra) + " bytes more than recorded";
+        }
+        return "";
+    }
+    const std::vector<Sample>& getSamples() const {
+        return samples;
+    }
+
+private:
+    // a header (or message) followed by that many filler bytes
+    struct Piece {
+        std::string header;
+        unsigned long long filler;
+        Piece(const std::string& header, const unsigned long long& filler) : header(header), filler(filler) {}
+    };
+
+private:
+    const ReplayConfig& config;
+    const std::vector<SessionLog::Record>& records;
+    int fd;
+    bool diverged;
+    std::string error;
+    std::vector<char> filler;
+    std::vector<char> scratch;
+    std::vector<Sample> samples;
+    std::map<std::string, unsigned long long> uploaded;  // FNV-1a of what went up under each u argument
+
+private:
+    bool open() {
+        addrinfo hints, *result;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int status = getaddrinfo(config.host.c_str(), config.port.c_str(), &hints, &result);
+        if (status != 0) {
+            error = gai_strerror(status);
+            return false;
+        }
+        fd = socket(result->ai_family, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, result->ai_addr, result->ai_addrlen) < 0) {
+            error = strerror(errno);
+            freeaddrinfo(result);
+            return false;
+        }
+        freeaddrinfo(result);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return true;
+    }
+    // The client validates its copy of a file it uploaded by content hash;
+    // the replayed upload carried filler, so the hash has to be the filler's
+    // for the server to answer as it did in the recording.
+    std::string revalidated(const std::string& text) const {
+        unsigned long size;
+        unsigned long long mtime, hash;
+        int consumed = 0;
+        if (sscanf(text.c_str(), "d -if %lu %llu %llx %n", &size, &mtime, &hash, &consumed) != 3 || consumed == 0) {
+            return text;
+        }
+        std::map<std::string, unsigned long long>::const_iterator it = uploaded.find(text.substr(consumed));
+        if (it == uploaded.end()) {
+            return text;
+        }
+        char validators[96];
+        sprintf(validators, "d -if %lu %llu %llx ", size, mtime, it->second);
+        return validators + text.substr(consumed);
+    }
+    unsigned long long fillerHash(const unsigned long long& size) const {
+        unsigned long long hash = 14695981039346656037ull;
+        for (unsigned long long i = 0; i < size; ++i) {
+            hash = (hash ^ static_cast<unsigned char>(filler[i % filler.size()])) * 1099511628211ull;
+        }
+        return hash;
+    }
+    // client bytes the server consumed after record and before the next one
+    unsigned long long nextPayload(const SessionLog::Record& record) const {
+        const SessionLog::Record* next = &record + 1;
+        return next < records.data() + records.size() ? next->payload : 0;
+    }
+    // Data after a size message has to be framed the way the message
+    // announced, or the server misreads it: one extent for a sparse upload,
+    // 64KB chunks for a chunked one.  The sizes add up to what was recorded.
+    static std::vector<Piece> framed(const std::string& message, const unsigned long long& total) {
+        std::vector<Piece> pieces;
+        bool sizeMessage = message.compare(0, 11, "filesize = ") == 0;
+        if (sizeMessage && message.find(" sparse") != std::string::npos && total >= 16) {
+            if (total >= 32) {
+                pieces.push_back(Piece(header(0, total - 32), total - 32));
+            }
+            pieces.push_back(Piece(header(0, 0), 0));
+            return pieces;
+        }
+        if (sizeMessage && message.find(" chunked") != std::string::npos && total >= 8) {
+            unsigned long long left = total - 8;
+            while (left > 8) {
+                unsigned long long length = std::min<unsigned long long>(64 << 10, left - 8);
+                // a remainder too short for a header of its own goes into the next chunk
+                if (left - 8 - length > 0 && left - 8 - length <= 8) {
+                    length -= 8;
+                }
+                pieces.push_back(Piece(chunkHeader(length), length));
+                left -= 8 + length;
+            }
+            pieces.push_back(Piece(chunkHeader(0), left));
+            return pieces;
+        }
+        if (total > 0) {
+            pieces.push_back(Piece("", total));
+        }
+        return pieces;
+    }
+    static std::string header(const uint64_t& offset, const uint64_t& length) {
+        uint64_t fields[2] = { htobe64(offset), htobe64(length) };
+        return std::string(reinterpret_cast<const char*>(fields), sizeof(fields));
+    }
+    static std::string chunkHeader(const uint64_t& length) {
+        uint64_t field = htobe64(length);
+        return std::string(reinterpret_cast<const char*>(&field), sizeof(field));
+    }
+    // poll for events, false when the server made no progress within the timeout
+    bool waitFor(const short& events) {
+        pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = events;
+        int ready;
+        do {
+            ready = poll(&pfd, 1, config.timeout * 1000);
+        } while (ready < 0 && errno == EINTR);
+        return ready > 0;
+    }
+    // Send pieces and read receive bytes at the same time, either side may
+    // block on the other; the last maxn bytes read go to message if given.
+    bool pump(std::vector<Piece> pieces, unsigned long long receive, char* message) {
+        size_t piece = 0, headerPos = 0;
+        unsigned long long fillerLeft = pieces.empty() ? 0 : pieces[0].filler;
+        size_t messagePos = 0;
+        while (piece < pieces.size() || receive > 0) {
+            short events = (piece < pieces.size() ? POLLOUT : 0) | (receive > 0 ? POLLIN : 0);
+            if (!waitFor(events)) {
+                diverged = true;
+                error = "diverged, the server stopped " + std::string(receive > 0 ? "sending" : "reading") +
+                        " before the log did";
+                return false;
+            }
+            if (receive > 0) {
+                ssize_t n;
+                if (message && receive <= maxn) {
+                    n = recv(fd, message + messagePos, receive, MSG_DONTWAIT);
+                    messagePos += std::max<ssize_t>(n, 0);
+                }
+                else {
+                    n = recv(fd, scratch.data(), std::min<unsigned long long>(scratch.size(), receive), MSG_DONTWAIT);
+                }
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                    error = n == 0 ? "diverged, the server hung up before the log did" : strerror(errno);
+                    diverged = n == 0;
+                    return false;
+                }
+                receive -= std::max<ssize_t>(n, 0);
+            }
+            while (piece < pieces.size()) {
+                const Piece& p = pieces[piece];
+                ssize_t n;
+                if (headerPos < p.header.size()) {
+                    n = send(fd, p.header.data() + headerPos, p.header.size() - headerPos, MSG_DONTWAIT | MSG_NOSIGNAL);
+                }
+                else if (fillerLeft > 0) {
+                    // the filler repeats, whatever sizes the sends come out in
+                    size_t at = (p.filler - fillerLeft) % filler.size();
+                    n = send(fd, filler.data() + at, std::min<unsigned long long>(filler.size() - at, fillerLeft),
+                             MSG_DONTWAIT | MSG_NOSIGNAL);
+                }
+                else {
+                    headerPos = 0;
+                    if (++piece < pieces.size()) {
+                        fillerLeft = pieces[piece].filler;
+                    }
+                    continue;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                    break;
+                }
+                if (n < 0) {
+                    error = strerror(errno);
+                    return false;
+                }
+                if (headerPos < p.header.size()) {
+                    headerPos += n;
+                }
+                else {
+                    fillerLeft -= n;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+bool parseOptions(int argc, char const *argv[], ReplayConfig& config);
+double percentile(std::vector<double>& samples, const double& p);
+void printUsage(const char* name);
+
+int main(int argc, char const *argv[])
+{
+    if (argc < 4) {
+        printUsage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    ReplayConfig config;
+    if (!parseOptions(argc, argv, config)) {
+        fprintf(stderr, "Invalid Arguments\n");
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    std::vector<uint64_t> starts(config.logs.size());
+    std::vector<std::vector<SessionLog::Record>> logs(config.logs.size());
+    uint64_t first = UINT64_MAX;
+    double recordedSeconds = 0;
+    for (size_t i = 0; i < config.logs.size(); ++i) {
+        if (!SessionLog::load(config.logs[i], starts[i], logs[i])) {
+            fprintf(stderr, "%s: not a session log\n", config.logs[i].c_str());
+            exit(EXIT_FAILURE);
+        }
+        first = std::min(first, starts[i]);
+    }
+    for (size_t i = 0; i < logs.size(); ++i) {
+        if (!logs[i].empty()) {
+            recordedSeconds = std::max(recordedSeconds, (starts[i] - first + logs[i].back().at) / 1e6);
+        }
+    }
+    // sessions keep their recorded offsets from the first one
+    Clock::time_point begin = Clock::now();
+    std::vector<SessionReplay*> replays;
+    std::vector<std::string> outcomes(logs.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < logs.size(); ++i) {
+        replays.push_back(new SessionReplay(config, logs[i]));
+        Clock::time_point start = begin;
+        if (config.speed > 0) {
+            start += std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double, std::micro>((starts[i] - first) / config.speed));
+        }
+        threads.push_back(std::thread([&, i, start] {
+            outcomes[i] = replays[i]->run(start);
+        }));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+    std::map<std::string, std::pair<std::vector<double>, std::vector<double>>> byCommand;
+    int failed = 0;
+    unsigned long commands = 0;
+    for (size_t i = 0; i < replays.size(); ++i) {
+        if (outcomes[i] != "") {
+            fprintf(stderr, "%s: %s\n", config.logs[i].c_str(), outcomes[i].c_str());
+            ++failed;
+        }
+        for (const Sample& sample : replays[i]->getSamples()) {
+            byCommand[sample.command].first.push_back(sample.recorded);
+            byCommand[sample.command].second.push_back(sample.replayed);
+            ++commands;
+        }
+        delete replays[i];
+    }
+    printf("%-10s %8s %11s %11s %11s %11s %11s %11s\n", "command", "count",
+           "rec p50 ms", "rec p99 ms", "rec max ms", "p50 ms", "p99 ms", "max ms");
+    for (auto& entry : byCommand) {
+        std::vector<double>& recorded = entry.second.first;
+        std::vector<double>& replayed = entry.second.second;
+        double recordedMax = *std::max_element(recorded.begin(), recorded.end());
+        double replayedMax = *std::max_element(replayed.begin(), replayed.end());
+        printf("%-10s %8lu %11.3f %11.3f %11.3f %11.3f %11.3f %11.3f\n", entry.first.c_str(),
+               static_cast<unsigned long>(recorded.size()), percentile(recorded, 0.50), percentile(recorded, 0.99),
+               recordedMax, percentile(replayed, 0.50), percentile(replayed, 0.99), replayedMax);
+    }
+    printf("\n%lu commands from %lu sessions in %.1f s (recorded %.1f s), %d diverged\n", commands,
+           static_cast<unsigned long>(logs.size()), elapsed, recordedSeconds, failed);
+    return failed > 0 ? EXIT_FAILURE : 0;
+}
+
+bool parseOptions(int argc, char const *argv[], ReplayConfig& config) {
+    config.host = argv[1];
+    config.port = argv[2];
+    for (int i = 3; i < argc; ++i) {
+        std::string option = argv[i];
+        if (option[0] != '-') {
+            config.logs.push_back(option);
+            continue;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "%s needs a value\n", argv[i]);
+            return false;
+        }
+        std::string value = argv[++i];
+        if (option == "-speed") {
+            if (sscanf(value.c_str(), "%lf", &config.speed) != 1 || config.speed < 0) {
+                fprintf(stderr, "-speed needs a non-negative number\n");
+                return false;
+            }
+        }
+        else if (option == "-timeout") {
+            if (sscanf(value.c_str(), "%d", &config.timeout) != 1 || config.timeout < 1) {
+                fprintf(stderr, "-timeout needs a positive number\n");
+                return false;
+            }
+        }
+        else {
+            fprintf(stderr, "Unrecognized Argument %s\n", option.c_str());
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+    if (config.logs.empty()) {
+        fprintf(stderr, "no session logs given\n");
+        return false;
+    }
+    return true;
+}
+
+double percentile(std::vector<double>& samples, const double& p) {
+    if (samples.empty()) {
+        return 0.0;
+    }
+    size_t k = std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+    return samples[k];
+}
+
+void printUsage(const char* name) {
+    fprintf(stderr, "usage: %s <server host> <port> <session log>... [options]\n", name);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "    -speed <x>        replay x times as fast as recorded, 0 = without pauses (default 1)\n");
+    fprintf(stderr, "    -timeout <sec>    give up on a session the server stops answering (default 30)\n");
+}
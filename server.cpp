@@ -1,16 +1,25 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/random.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <linux/fs.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <poll.h>
 #include <signal.h>
 #include <unistd.h>
 #include <cstdio>
@@ -18,247 +27,2162 @@
 #include <cstdlib>
 #include <ctime>
 #include <cctype>
+#include <cstdint>
+#include <charconv>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include "dispatch.h"
+#include "merkle.h"
+#include "sessionlog.h"
+#include "storage.h"
+#include "trace.h"
+#include "transport.h"
+#include "udptransfer.h"
+#include "workingdirectory.h"
 
-constexpr int maxn = 2048;
 
-class WorkingDirectory {
+enum Durability {
+    durabilityNone,     // write straight into the final name
+    durabilityRename,   // write a temp file, rename() into place when complete
+    durabilityFsync,    // rename, with fsync of the file and the directory
+    durabilityGroup     // rename, with syncfs batched across concurrent uploads
+};
+
+struct ServerConfig {
+    int maxSessions;    // concurrent sessions, 0 = unlimited
+    int maxPerIp;       // concurrent sessions per client address, 0 = unlimited
+    int idleTimeout;    // seconds a session may sit between commands, 0 = forever
+    int ioTimeout;      // seconds a single read/write may stall mid-command, 0 = forever
+    int findThreads;    // directory walkers per find, 0 = one per core
+    int hashThreads;    // threads hashing the blocks of a file, 0 = one per core
+    int hashBlock;      // KB per Merkle tree leaf
+    int watchCoalesce;  // ms changes in a watched directory are held to be merged
+    Durability durability;
+    int groupWindowMs;  // how long a group commit leader waits for others to join
+    int streamThreshold;    // MB from which transfers stream past the page cache, 0 = never
+    bool directIO;          // stream with O_DIRECT instead of fadvise
+    std::vector<std::string> peers; // host:port of servers every upload is replicated to
+    int replicaQueue;       // pending replications kept before new ones are dropped
+    bool trace;             // record tracing spans in every session from the start
+    std::string traceDir;   // where trace dumps go, the startup directory when empty
+    std::string recordDir;  // where session logs go (-record), "" = not recorded
+    std::string handoffPath;    // Unix socket for passing the listening socket to a new instance
+    std::string unixPath;   // Unix socket same-host clients connect to, "" = TCP only
+    int resumeTtl;          // seconds a dropped session can be resumed with its token, 0 = no tokens
+    std::string storage;    // backend the files live in, see StorageBackend::select()
+    ServerConfig() : maxSessions(256), maxPerIp(16), idleTimeout(300), ioTimeout(30), findThreads(0),
+                     hashThreads(0), hashBlock(1024), watchCoalesce(100), durability(durabilityNone), groupWindowMs(2), streamThreshold(64), directIO(false),
+                     replicaQueue(1024), trace(false), traceDir(""), recordDir(""), handoffPath(""),
+                     unixPath(""), resumeTtl(300), storage("posix") {}
+};
+
+std::string trimSpaceLE(const std::string& str);
+
+// Multi-threaded subtree walk behind the find command.  Every walker owns a
+// deque of directories: it pops its own work from the back (depth first,
+// warm dentry cache) and, when dry, steals from the front of another
+// walker's deque, where the large subtrees near the root sit.  Matches are
+// collected under a lock and drained incrementally by the session thread.
+class ParallelFind {
 public:
-    static bool isDirExist(const std::string& path) {
-        struct stat st;
-        if (lstat(path.c_str(), &st) != 0) {
-            if (errno == ENOENT) {
-                return false;
+    ParallelFind(const std::string& root, const std::string& pattern, const int& threads)
+        : root(root), pattern(pattern), queues(std::max(threads, 1)), pending(0), queued(0), finished(false) {
+
+    }
+    // walk the tree, calling emit() on this thread with each batch of matches
+    template <typename Emit>
+    void run(Emit emit) {
+        queues[0].dirs.push_back(root);
+        pending = 1;
+        queued = 1;
+        std::vector<std::thread> walkers;
+        for (unsigned i = 0; i < queues.size(); ++i) {
+            walkers.push_back(std::thread(&ParallelFind::walk, this, i));
+        }
+        std::vector<std::string> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> guard(matchLock);
+                matchReady.wait_for(guard, std::chrono::milliseconds(50),
+                                    [this] { return !matches.empty() || finished; });
+                batch.swap(matches);
+                if (batch.empty() && finished) {
+                    break;
+                }
             }
-            else if (errno == EACCES) {
-                return false;
+            emit(batch);
+            batch.clear();
+        }
+        for (auto& walker : walkers) {
+            walker.join();
+        }
+    }
+
+private:
+    struct WorkQueue {
+        std::mutex lock;
+        std::deque<std::string> dirs;
+    };
+
+private:
+    std::string root;
+    std::string pattern;
+    std::vector<WorkQueue> queues;
+    std::atomic<long> pending;      // directories queued or being read
+    std::atomic<long> queued;       // directories waiting in the queues
+    std::mutex idleLock;
+    std::condition_variable workReady;
+    bool finished;
+    std::mutex matchLock;
+    std::condition_variable matchReady;
+    std::vector<std::string> matches;
+
+private:
+    bool take(const unsigned& self, std::string& dir) {
+        {
+            std::lock_guard<std::mutex> guard(queues[self].lock);
+            if (!queues[self].dirs.empty()) {
+                dir.swap(queues[self].dirs.back());
+                queues[self].dirs.pop_back();
+                --queued;
+                return true;
+            }
+        }
+        for (unsigned i = 1; i < queues.size(); ++i) {
+            WorkQueue& victim = queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.dirs.empty()) {
+                dir.swap(victim.dirs.front());
+                victim.dirs.pop_front();
+                --queued;
+                return true;
+            }
+        }
+        return false;
+    }
+    void walk(const unsigned self) {
+        std::string dir;
+        std::vector<std::string> names, found;
+        while (true) {
+            if (!take(self, dir)) {
+                // idle until a directory is queued or the walk is over
+                std::unique_lock<std::mutex> guard(idleLock);
+                workReady.wait(guard, [this] { return queued > 0 || pending == 0; });
+                if (pending == 0) {
+                    return;
+                }
+                continue;
+            }
+            bool queuedMore = false;
+            StorageBackend::get().list(dir, names);
+            for (std::string& name : names) {
+                bool isDir = name.back() == '/';
+                if (isDir) {
+                    name.pop_back();
+                }
+                std::string path = dir == "/" ? "/" + name : dir + "/" + name;
+                if (fnmatch(pattern.c_str(), name.c_str(), 0) == 0) {
+                    found.push_back(isDir ? path + "/" : path);
+                }
+                if (isDir) {
+                    ++pending;
+                    std::lock_guard<std::mutex> guard(queues[self].lock);
+                    queues[self].dirs.push_back(path);
+                    ++queued;
+                    queuedMore = true;
+                }
+            }
+            bool done;
+            {
+                std::lock_guard<std::mutex> guard(matchLock);
+                matches.insert(matches.end(), found.begin(), found.end());
+                found.clear();
+                done = --pending == 0;
+                if (done) {
+                    finished = true;
+                }
+                matchReady.notify_one();
+            }
+            if (queuedMore || done) {
+                // under the lock, so a walker between its check and its wait cannot miss it
+                std::lock_guard<std::mutex> guard(idleLock);
+                workReady.notify_all();
+            }
+        }
+    }
+};
+
+// Group commit for uploads across session processes.  The state lives in
+// an anonymous shared mapping created before the first fork.  An upload
+// that needs durability takes a ticket for its filesystem; the first one
+// becomes leader, waits a short window for others to join, then issues a
+// single syncfs() that covers every ticket handed out before it started.
+// The mutex is robust so a session dying inside it cannot wedge the rest.
+class GroupCommit {
+public:
+    static void init() {
+        void* mem = mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "mmap Error\n");
+            exit(EXIT_FAILURE);
+        }
+        shared = static_cast<Shared*>(mem);
+        memset(shared, 0, sizeof(Shared));
+        pthread_mutexattr_t mattr;
+        pthread_mutexattr_init(&mattr);
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&shared->lock, &mattr);
+        pthread_mutexattr_destroy(&mattr);
+        pthread_condattr_t cattr;
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+        pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+        pthread_cond_init(&shared->done, &cattr);
+        pthread_condattr_destroy(&cattr);
+    }
+    // returns once everything written to fileFd's filesystem before the call is durable
+    static bool sync(const int& fileFd, const int& windowMs) {
+        struct stat st;
+        if (!shared || fstat(fileFd, &st) < 0) {
+            return fsync(fileFd) == 0;
+        }
+        lock();
+        Group* group = groupFor(st.st_dev);
+        if (!group) {
+            // more filesystems than slots, fall back to a private flush
+            pthread_mutex_unlock(&shared->lock);
+            return syncfs(fileFd) == 0;
+        }
+        unsigned long long ticket = ++group->requested;
+        bool ok = true;
+        while (group->completed < ticket) {
+            if (group->leader == 0 || kill(group->leader, 0) < 0) {
+                group->leader = getpid();
+                pthread_mutex_unlock(&shared->lock);
+                if (windowMs > 0) {
+                    usleep(windowMs * 1000);
+                }
+                lock();
+                unsigned long long target = group->requested;
+                pthread_mutex_unlock(&shared->lock);
+                ok = syncfs(fileFd) == 0;
+                lock();
+                if (ok) {
+                    group->completed = std::max(group->completed, target);
+                }
+                group->leader = 0;
+                pthread_cond_broadcast(&shared->done);
+                if (!ok) {
+                    break;
+                }
             }
             else {
-                return false;
+                // timed, so a leader that died mid-sync is noticed
+                timespec deadline;
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += 1;
+                if (pthread_cond_timedwait(&shared->done, &shared->lock, &deadline) == EOWNERDEAD) {
+                    pthread_mutex_consistent(&shared->lock);
+                }
             }
         }
-        if (S_ISREG(st.st_mode)) {
+        pthread_mutex_unlock(&shared->lock);
+        return ok;
+    }
+
+private:
+    struct Group {
+        dev_t dev;
+        unsigned long long requested;   // tickets handed out
+        unsigned long long completed;   // every ticket up to this one is durable
+        pid_t leader;                   // process running the current syncfs, 0 = none
+    };
+    struct Shared {
+        pthread_mutex_t lock;
+        pthread_cond_t done;
+        int groups;
+        Group group[16];
+    };
+
+private:
+    static Shared* shared;
+
+private:
+    static void lock() {
+        if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD) {
+            pthread_mutex_consistent(&shared->lock);
+        }
+    }
+    static Group* groupFor(const dev_t& dev) {
+        for (int i = 0; i < shared->groups; ++i) {
+            if (shared->group[i].dev == dev) {
+                return &shared->group[i];
+            }
+        }
+        if (shared->groups == 16) {
+            return nullptr;
+        }
+        Group* group = &shared->group[shared->groups++];
+        group->dev = dev;
+        return group;
+    }
+};
+
+GroupCommit::Shared* GroupCommit::shared = nullptr;
+
+// Session resumption.  Every admitted connection gets a random token in its
+// greeting, "WELCOME token = <hex>".  A slot in a table shared by all session
+// processes maps the token to the session's working directory and to the
+// upload it is receiving, if any.  When the connection drops, the slot
+// outlives the session for ttl seconds; a new connection presenting the
+// token with resume continues in that directory, and a partial upload stays
+// on disk so the client only sends the rest.  The table is private to this
+// instance, tokens issued before a hot restart are unknown to the new one.
+class SessionTokens {
+public:
+    struct Upload {
+        std::string name;       // empty = none in flight
+        std::string path;       // absolute path of the file being written
+        bool temporary;         // path is a temp file, removed when the slot expires
+        unsigned long size;     // announced by the client
+        unsigned long received; // on disk
+    };
+
+public:
+    static void init(const int& slots, const int& ttl) {
+        void* mem = mmap(nullptr, sizeof(Shared) + sizeof(Slot) * slots, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "mmap Error\n");
+            exit(EXIT_FAILURE);
+        }
+        // anonymous memory starts zeroed: every slot is free
+        shared = static_cast<Shared*>(mem);
+        shared->slots = slots;
+        shared->ttl = ttl;
+        pthread_mutexattr_t mattr;
+        pthread_mutexattr_init(&mattr);
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&shared->lock, &mattr);
+        pthread_mutexattr_destroy(&mattr);
+    }
+    // accept loop: a token for a new connection, empty when disabled or every
+    // slot belongs to a live session; slot stays reserved until attach() or release()
+    static std::string issue(int& slot) {
+        slot = -1;
+        char token[tokenLength + 1];
+        if (!shared || !randomToken(token)) {
+            return "";
+        }
+        time_t now = time(nullptr);
+        lock();
+        int oldest = -1;
+        for (int i = 0; i < shared->slots && slot < 0; ++i) {
+            Slot& s = at(i);
+            if (s.token[0] && s.owner == 0 && now - s.detachedAt > shared->ttl) {
+                vacate(s);
+            }
+            if (!s.token[0]) {
+                slot = i;
+            }
+            else if (s.owner == 0 && (oldest < 0 || s.detachedAt < at(oldest).detachedAt)) {
+                oldest = i;
+            }
+        }
+        if (slot < 0 && oldest >= 0) {
+            vacate(at(oldest));
+            slot = oldest;
+        }
+        if (slot >= 0) {
+            Slot& s = at(slot);
+            memcpy(s.token, token, sizeof(s.token));
+            s.owner = reserved;
+            s.cwd[0] = '\0';
+            s.uploadName[0] = '\0';
+        }
+        pthread_mutex_unlock(&shared->lock);
+        return slot >= 0 ? token : "";
+    }
+    static void attach(const int& slot, const pid_t& pid) {
+        if (slot < 0) {
+            return;
+        }
+        lock();
+        at(slot).owner = pid;
+        pthread_mutex_unlock(&shared->lock);
+    }
+    static void release(const int& slot) {
+        if (slot < 0) {
+            return;
+        }
+        lock();
+        vacate(at(slot));
+        pthread_mutex_unlock(&shared->lock);
+    }
+    // the session process pid is gone, its slot starts to age
+    static void detach(const pid_t& pid) {
+        if (!shared) {
+            return;
+        }
+        lock();
+        for (int i = 0; i < shared->slots; ++i) {
+            if (at(i).token[0] && at(i).owner == pid) {
+                at(i).owner = 0;
+                at(i).detachedAt = time(nullptr);
+            }
+        }
+        pthread_mutex_unlock(&shared->lock);
+    }
+
+    // the calls below are made by a session process on its own slot
+    static void own(const int& slot) {
+        mine = slot;
+    }
+    static void setCwd(const std::string& path) {
+        if (mine < 0) {
+            return;
+        }
+        lock();
+        snprintf(at(mine).cwd, sizeof(at(mine).cwd), "%s", path.c_str());
+        pthread_mutex_unlock(&shared->lock);
+    }
+    // false when the session has no slot: the upload cannot be resumed
+    static bool beginUpload(const std::string& name, const std::string& path, const bool& temporary,
+                            const unsigned long& size) {
+        if (mine < 0 || name.length() >= sizeof(Slot::uploadName) || path.length() >= sizeof(Slot::uploadPath)) {
             return false;
         }
-        else if (S_ISDIR(st.st_mode)) {
-            return true;
+        lock();
+        Slot& s = at(mine);
+        // a partial upload left from before the drop is not coming back now
+        if (s.uploadName[0] && s.uploadTemporary && path != s.uploadPath) {
+            StorageBackend::get().remove(s.uploadPath);
         }
-        else {
+        strcpy(s.uploadName, name.c_str());
+        strcpy(s.uploadPath, path.c_str());
+        s.uploadTemporary = temporary;
+        s.uploadSize = size;
+        pthread_mutex_unlock(&shared->lock);
+        return true;
+    }
+    // committed or discarded, the file is no concern of the slot any more
+    static void endUpload() {
+        if (mine < 0) {
+            return;
+        }
+        lock();
+        at(mine).uploadName[0] = '\0';
+        pthread_mutex_unlock(&shared->lock);
+    }
+    static bool pendingUpload(Upload& upload) {
+        if (mine < 0) {
+            return false;
+        }
+        lock();
+        copyUpload(at(mine), upload);
+        pthread_mutex_unlock(&shared->lock);
+        return upload.name != "";
+    }
+    // Take over the slot of token: its session process, if still around
+    // (the client noticed the drop first), is terminated.  Returns an error
+    // message, empty on success with the slot's directory and upload.
+    static std::string resume(std::string_view token, std::string& cwd, Upload& upload) {
+        if (!shared) {
+            return "session resumption is disabled";
+        }
+        if (token.length() != tokenLength) {
+            return "malformed token";
+        }
+        lock();
+        int slot = find(token);
+        Clock::time_point deadline = Clock::now() + std::chrono::seconds(2);
+        while (slot >= 0 && slot != mine && at(slot).owner != 0) {
+            pid_t previous = at(slot).owner;
+            pthread_mutex_unlock(&shared->lock);
+            if (previous == reserved || Clock::now() > deadline) {
+                return "session still active";
+            }
+            // the accept loop detaches the slot once it reaped the process
+            kill(previous, SIGTERM);
+            usleep(20000);
+            lock();
+            slot = find(token);
+        }
+        if (slot >= 0 && slot != mine && time(nullptr) - at(slot).detachedAt > shared->ttl) {
+            vacate(at(slot));
+            slot = -1;
+        }
+        if (slot < 0) {
+            pthread_mutex_unlock(&shared->lock);
+            return "unknown or expired token";
+        }
+        if (slot != mine) {
+            at(slot).owner = getpid();
+            if (mine >= 0) {
+                vacate(at(mine));
+            }
+            mine = slot;
+        }
+        cwd = at(slot).cwd;
+        copyUpload(at(slot), upload);
+        pthread_mutex_unlock(&shared->lock);
+        return "";
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    static constexpr size_t tokenLength = 32;   // hex digits, 128 random bits
+    static constexpr pid_t reserved = -1;       // issued, the session process is being forked
+
+    struct Slot {
+        char token[tokenLength + 1];    // empty = free
+        pid_t owner;                    // session process, 0 = detached
+        time_t detachedAt;
+        char cwd[maxn];
+        char uploadName[256];
+        char uploadPath[maxn];
+        bool uploadTemporary;
+        unsigned long uploadSize;
+    };
+    struct Shared {
+        pthread_mutex_t lock;
+        int slots;
+        int ttl;
+    };
+
+private:
+    static Shared* shared;
+    static int mine;
+
+private:
+    static void lock() {
+        if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD) {
+            pthread_mutex_consistent(&shared->lock);
+        }
+    }
+    // the slots follow the header
+    static Slot& at(const int& i) {
+        return reinterpret_cast<Slot*>(shared + 1)[i];
+    }
+    // caller holds lock
+    static int find(std::string_view token) {
+        for (int i = 0; i < shared->slots; ++i) {
+            if (token == at(i).token) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    // caller holds lock
+    static void vacate(Slot& s) {
+        if (s.uploadName[0] && s.uploadTemporary) {
+            StorageBackend::get().remove(s.uploadPath);
+        }
+        s.token[0] = '\0';
+        s.owner = 0;
+        s.uploadName[0] = '\0';
+    }
+    // caller holds lock
+    static void copyUpload(const Slot& s, Upload& upload) {
+        upload.name = s.uploadName;
+        upload.path = s.uploadPath;
+        upload.temporary = s.uploadTemporary;
+        upload.size = s.uploadSize;
+        upload.received = 0;
+        struct stat st;
+        if (upload.name != "" && StorageBackend::get().stat(upload.path, st) == 0) {
+            upload.received = std::min<unsigned long>(st.st_size, upload.size);
+        }
+    }
+    static bool randomToken(char* token) {
+        unsigned char bytes[tokenLength / 2];
+        if (getrandom(bytes, sizeof(bytes), 0) != static_cast<ssize_t>(sizeof(bytes))) {
+            return false;
+        }
+        for (size_t i = 0; i < sizeof(bytes); ++i) {
+            sprintf(token + 2 * i, "%02x", bytes[i]);
+        }
+        return true;
+    }
+};
+
+SessionTokens::Shared* SessionTokens::shared = nullptr;
+int SessionTokens::mine = -1;
+
+// Replication of completed uploads to peer servers.  A replicator process is
+// forked at startup; sessions hand it the path of every committed upload over
+// a non-blocking datagram socketpair, so a slow or dead peer never holds up
+// an upload.  Jobs (one per file and peer) wait in a bounded queue and each
+// push runs in a short-lived child speaking the ordinary client protocol, so
+// a peer failing mid-transfer only takes that child down.  Failed pushes are
+// retried with exponential backoff.  Push sessions announce themselves with
+// "replica" and the peer does not forward those uploads again, so every
+// server lists all of its peers rather than relying on chains.  That also
+// makes the listed peers the only addresses replica is accepted from.
+class Replicator {
+public:
+    static void start(const ServerConfig& config) {
+        resolvePeers(config.peers);
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+            fprintf(stderr, "socketpair Error: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "fork() Error: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            close(sv[0]);
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            run(sv[1], config);
+            exit(EXIT_SUCCESS);
+        }
+        close(sv[1]);
+        fcntl(sv[0], F_SETFL, O_NONBLOCK);
+        queueFd = sv[0];
+    }
+    // whether the session on fd comes from one of the peers' addresses
+    static bool isPeer(const int& fd) {
+        sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        char host[NI_MAXHOST];
+        if (getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &len) < 0 ||
+            getnameinfo(reinterpret_cast<sockaddr*>(&addr), len, host, sizeof(host), nullptr, 0, NI_NUMERICHOST) != 0) {
             return false;
         }
+        return peerAddresses.count(host) > 0;
+    }
+    // called by sessions for every committed upload, never blocks
+    static void enqueue(const std::string& path) {
+        if (queueFd < 0) {
+            return;
+        }
+        if (send(queueFd, path.c_str(), path.length(), MSG_DONTWAIT) < 0) {
+            fprintf(stderr, "Replication of %s dropped: %s\n", path.c_str(), strerror(errno));
+        }
+    }
+
+private:
+    struct Job {
+        std::string path;
+        unsigned peer;
+        int attempts;
+        std::chrono::steady_clock::time_point due;
+    };
+    // exit status of a push child
+    enum {
+        pushDone = 0,
+        pushFailed = 1,     // worth retrying, also what a transport error exits with
+        pushRejected = 2    // retrying cannot help
+    };
+    static constexpr int maxAttempts = 8;
+    static constexpr int maxBackoffSec = 60;
+
+private:
+    static int queueFd;
+    static std::set<std::string> peerAddresses;    // numeric, resolved once at startup
+
+private:
+    static void childExited(int) {
+
+    }
+    static void run(const int& fd, const ServerConfig& config) {
+        // wake poll() when a push finishes
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = childExited;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGCHLD, &sa, nullptr);
+        signal(SIGPIPE, SIG_IGN);
+        const std::string root = WorkingDirectory(StorageBackend::get()).getPath();
+        std::deque<Job> jobs;
+        std::map<pid_t, Job> pushing;
+        std::vector<bool> busy(config.peers.size(), false);
+        char path[8192];
+        while (true) {
+            pid_t pid;
+            int status;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                std::map<pid_t, Job>::iterator it = pushing.find(pid);
+                if (it == pushing.end()) {
+                    continue;
+                }
+                Job job = it->second;
+                pushing.erase(it);
+                busy[job.peer] = false;
+                const std::string& peer = config.peers[job.peer];
+                int code = WIFEXITED(status) ? WEXITSTATUS(status) : pushFailed;
+                if (code == pushDone) {
+                    fprintf(stdout, "Replicated %s to %s\n", job.path.c_str(), peer.c_str());
+                }
+                else if (code == pushRejected || ++job.attempts >= maxAttempts) {
+                    fprintf(stderr, "Replication of %s to %s abandoned\n", job.path.c_str(), peer.c_str());
+                }
+                else {
+                    int backoff = std::min(maxBackoffSec, 1 << job.attempts);
+                    job.due = std::chrono::steady_clock::now() + std::chrono::seconds(backoff);
+                    fprintf(stderr, "Replication of %s to %s failed, retry in %d s\n",
+                            job.path.c_str(), peer.c_str(), backoff);
+                    jobs.push_back(job);
+                }
+                fflush(stdout);
+            }
+            // start every due job whose peer is idle, one push per peer at a time
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            int timeout = 1000;
+            for (std::deque<Job>::iterator it = jobs.begin(); it != jobs.end();) {
+                if (busy[it->peer]) {
+                    ++it;
+                    continue;
+                }
+                if (it->due > now) {
+                    int wait = std::chrono::duration_cast<std::chrono::milliseconds>(it->due - now).count() + 1;
+                    timeout = std::min(timeout, wait);
+                    ++it;
+                    continue;
+                }
+                fflush(stdout);
+                pid_t child = fork();
+                if (child == 0) {
+                    close(fd);
+                    exit(push(config.peers[it->peer], root, it->path, config.ioTimeout));
+                }
+                if (child < 0) {
+                    ++it;
+                    continue;
+                }
+                busy[it->peer] = true;
+                pushing.insert(std::make_pair(child, *it));
+                it = jobs.erase(it);
+            }
+            pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, timeout) <= 0) {
+                continue;
+            }
+            ssize_t n = recv(fd, path, sizeof(path) - 1, 0);
+            if (n <= 0) {
+                continue;
+            }
+            path[n] = '\0';
+            for (unsigned peer = 0; peer < config.peers.size(); ++peer) {
+                // a pending push of the same file sends the latest content anyway
+                bool pending = false;
+                for (const Job& job : jobs) {
+                    pending = pending || (job.peer == peer && job.path == path);
+                }
+                if (pending) {
+                    continue;
+                }
+                if (static_cast<int>(jobs.size()) >= config.replicaQueue) {
+                    fprintf(stderr, "Replication queue full, %s to %s dropped\n", path, config.peers[peer].c_str());
+                    continue;
+                }
+                Job job;
+                job.path = path;
+                job.peer = peer;
+                job.attempts = 0;
+                job.due = std::chrono::steady_clock::now();
+                jobs.push_back(job);
+            }
+        }
     }
+    // upload path to peer, into the same directory relative to the server root
+    static int push(const std::string& peer, const std::string& root, const std::string& path, const int& ioTimeout) {
+        int fileFd = StorageBackend::get().openRead(path);
+        FILE* fp = fileFd < 0 ? nullptr : fdopen(fileFd, "rb");
+        struct stat st;
+        if (!fp || fstat(fileno(fp), &st) < 0) {
+            return pushRejected;
+        }
+        unsigned long pos = path.rfind('/');
+        std::string dir = pos == 0 ? "/" : path.substr(0, pos);
+        std::string name = path.substr(pos + 1);
+        if (dir == root) {
+            dir = ".";
+        }
+        else if (dir.compare(0, root.length() + 1, root + "/") == 0) {
+            dir = dir.substr(root.length() + 1);
+        }
+        int fd = connectPeer(peer);
+        if (fd < 0) {
+            return pushFailed;
+        }
+        if (ioTimeout > 0) {
+            timeval tv;
+            tv.tv_sec = ioTimeout;
+            tv.tv_usec = 0;
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        }
+        Transport conn(fd);
+        char buffer[maxn];
+        if (!conn.readMessage(buffer) || strncmp(buffer, "WELCOME", strlen("WELCOME"))) {
+            return pushFailed;
+        }
+        if (!request(conn, buffer, "replica") || strcmp(buffer, "OK")) {
+            fprintf(stderr, "Replication to %s refused, it does not list this server as a peer\n", peer.c_str());
+            return pushRejected;
+        }
+        if (!request(conn, buffer, "cd \"" + dir + "\"") || buffer[0] != '\0') {
+            fprintf(stderr, "Replication to %s: %s\n", peer.c_str(), buffer);
+            return pushRejected;
+        }
+        if (!request(conn, buffer, "u \"" + name + "\"") || strcmp(buffer, "OK")) {
+            return pushFailed;
+        }
+        if (!request(conn, buffer, "filesize = " + std::to_string(st.st_size), false)) {
+            return pushFailed;
+        }
+        conn.writeFile(fp, st.st_size);
+        if (!conn.readMessage(buffer) || strcmp(buffer, "COMMITTED")) {
+            return pushFailed;
+        }
+        request(conn, buffer, "q", false);
+        conn.flush();
+        close(fd);
+        fclose(fp);
+        return pushDone;
+    }
+    // send a command, and read the reply into buffer when reply is set
+    static bool request(Transport& conn, char* buffer, const std::string& message, const bool& reply = true) {
+        memset(buffer, 0, maxn);
+        snprintf(buffer, maxn, "%s", message.c_str());
+        conn.writeMessage(buffer);
+        if (!reply) {
+            return true;
+        }
+        memset(buffer, 0, maxn);
+        return conn.readMessage(buffer);
+    }
+    static void resolvePeers(const std::vector<std::string>& peers) {
+        for (const std::string& peer : peers) {
+            addrinfo hints, *result;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            if (getaddrinfo(peer.substr(0, peer.rfind(':')).c_str(), nullptr, &hints, &result) != 0) {
+                fprintf(stderr, "Cannot resolve peer %s, replicas from it are refused\n", peer.c_str());
+                continue;
+            }
+            for (addrinfo* ai = result; ai; ai = ai->ai_next) {
+                char host[NI_MAXHOST];
+                if (getnameinfo(ai->ai_addr, ai->ai_addrlen, host, sizeof(host), nullptr, 0, NI_NUMERICHOST) == 0) {
+                    peerAddresses.insert(host);
+                }
+            }
+            freeaddrinfo(result);
+        }
+    }
+    static int connectPeer(const std::string& peer) {
+        unsigned long colon = peer.rfind(':');
+        std::string host = peer.substr(0, colon), port = peer.substr(colon + 1);
+        addrinfo hints, *result;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0) {
+            return -1;
+        }
+        int fd = -1;
+        for (addrinfo* ai = result; ai && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(result);
+        return fd;
+    }
+};
+
+int Replicator::queueFd = -1;
+std::set<std::string> Replicator::peerAddresses;
 
+// Zero-downtime restart.  With -handoff <path> the server also listens on a
+// Unix socket at path.  A new server started with the same -handoff connects
+// there first and receives the listening TCP socket over SCM_RIGHTS instead
+// of binding its own: connections keep queueing in the same backlog, so a
+// restart refuses nobody.  Once the new server confirmed, the old one stops
+// accepting and exits when its last session is done; transfers in flight
+// finish in the old session processes.  SIGHUP makes a server launch its own
+// binary, as it is on disk now, with the same arguments to do exactly that.
+class HotRestart {
 public:
-    WorkingDirectory() {
-        updatePath();
-        startupPath = path;
+    // listening socket of the running instance at path, -1 when there is none
+    static int takeOver(const std::string& path) {
+        int fd = connectTo(path);
+        if (fd < 0) {
+            return -1;
+        }
+        char tag = 0;
+        char control[CMSG_SPACE(sizeof(int))];
+        iovec iov;
+        iov.iov_base = &tag;
+        iov.iov_len = 1;
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        int listenFd = -1;
+        if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) == 1 && tag == 'L') {
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                memcpy(&listenFd, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+        // the old instance keeps accepting until it sees this
+        if (listenFd >= 0 && ::write(fd, "A", 1) != 1) {
+            close(listenFd);
+            listenFd = -1;
+        }
+        close(fd);
+        if (listenFd >= 0) {
+            fprintf(stdout, "Took over the listening socket from %s\n", path.c_str());
+        }
+        return listenFd;
+    }
+    // where the next instance will come asking
+    static int listenAt(const std::string& path) {
+        sockaddr_un addr;
+        if (!makeAddress(path, addr)) {
+            exit(EXIT_FAILURE);
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(path.c_str());
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+            fprintf(stderr, "Handoff socket %s Error: %s\n", path.c_str(), strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        return fd;
+    }
+    // give listenFd to the instance connecting on handoffFd, true once it confirmed
+    static bool handOver(const int& handoffFd, const int& listenFd) {
+        int fd = accept4(handoffFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        timeval tv;
+        tv.tv_sec = 5;
+        tv.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char tag = 'L';
+        char control[CMSG_SPACE(sizeof(int))];
+        memset(control, 0, sizeof(control));
+        iovec iov;
+        iov.iov_base = &tag;
+        iov.iov_len = 1;
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &listenFd, sizeof(int));
+        char ack = 0;
+        bool confirmed = sendmsg(fd, &msg, 0) == 1 && read(fd, &ack, 1) == 1 && ack == 'A';
+        close(fd);
+        if (!confirmed) {
+            fprintf(stderr, "Handoff not confirmed by the new instance, still serving\n");
+        }
+        return confirmed;
+    }
+    // run the binary again with the same arguments; it takes over through the handoff socket
+    static void launch(char const *argv[]) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "fork() Error: %s\n", strerror(errno));
+            return;
+        }
+        if (pid == 0) {
+            execvp(argv[0], const_cast<char* const*>(argv));
+            fprintf(stderr, "exec %s Error: %s\n", argv[0], strerror(errno));
+            _exit(EXIT_FAILURE);
+        }
+        fprintf(stdout, "Restarting: launched %s as process %d\n", argv[0], static_cast<int>(pid));
     }
-    virtual ~WorkingDirectory() {
 
+private:
+    static bool makeAddress(const std::string& path, sockaddr_un& addr) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.length() >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Handoff socket path too long: %s\n", path.c_str());
+            return false;
+        }
+        strcpy(addr.sun_path, path.c_str());
+        return true;
     }
-    void init(const std::string& initPath) {
-        path = convertPath(initPath);
-        startupPath = convertPath(initPath);
+    static int connectTo(const std::string& path) {
+        sockaddr_un addr;
+        if (!makeAddress(path, addr)) {
+            return -1;
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            // nobody there: first start, or a stale socket file
+            close(fd);
+            return -1;
+        }
+        timeval tv;
+        tv.tv_sec = 5;
+        tv.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        return fd;
+    }
+};
+
+// The directory a session watches, through inotify.  Changes are held for
+// coalesceMs after the first one and merged per name meanwhile: a file
+// written in many chunks is reported modified once, one created and removed
+// in between not at all.  Every reported change takes the next version; the
+// snapshot watch answers with is as of a version, so a client that sees a
+// version skipped (or an overflow) knows to ask for a new snapshot.
+class DirectoryWatch {
+public:
+    // change kinds, the words used in EVENT messages
+    static constexpr char created = 'c', deleted = 'd', modified = 'm';
+
+public:
+    // watch path instead of whatever was watched before, errno set on failure
+    static bool start(const std::string& path, const int& coalesce) {
+        stop();
+        if (fd < 0 && (fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+            return false;
+        }
+        wd = inotify_add_watch(fd, path.c_str(), IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO |
+                                                 IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        coalesceMs = coalesce;
+        return wd >= 0;
     }
-    std::string getPath() const {
-        return path;
+    static void stop() {
+        if (wd >= 0) {
+            inotify_rm_watch(fd, wd);
+            wd = -1;
+        }
+        pending.clear();
+        overflowed = gone = false;
+        due = 0;
     }
-    std::string getStartupPath() const {
-        return startupPath;
+    static bool watching() {
+        return wd >= 0;
     }
-    std::string changeDir(const std::string& newPath) {
-        if (chdir(newPath.c_str()) < 0) {
-            if (errno == ENOENT) {
-                return newPath + ": No such file or directory";
+    // for poll(), -1 (ignored there) when not watching
+    static int getFd() {
+        return watching() ? fd : -1;
+    }
+    static unsigned long long getVersion() {
+        return version;
+    }
+    // merge the events waiting on getFd() into the pending changes
+    static void collect() {
+        alignas(inotify_event) char events[16 << 10];
+        ssize_t n;
+        while ((n = read(fd, events, sizeof(events))) > 0) {
+            for (char* p = events; p < events + n;) {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+                p += sizeof(inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    overflowed = true;
+                }
+                if (event->wd != wd) {
+                    continue;
+                }
+                if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    gone = true;
+                }
+                if (!event->len) {
+                    continue;
+                }
+                std::string name = event->name;
+                if (event->mask & IN_ISDIR) {
+                    name += "/";
+                }
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    merge(name, created);
+                }
+                else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    merge(name, deleted);
+                }
+                else {
+                    merge(name, modified);
+                }
             }
-            else if (errno == ENOTDIR) {
-                return newPath + " is not a directory";
+        }
+        if (!due && (overflowed || gone || !pending.empty())) {
+            due = nowMs() + coalesceMs;
+        }
+    }
+    // ms until the pending changes are to be reported, -1 when there are none
+    static int untilDue() {
+        if (!overflowed && !gone && pending.empty()) {
+            return -1;
+        }
+        long long left = due - nowMs();
+        return left > 0 ? static_cast<int>(left) : 0;
+    }
+    // the changes due as "EVENT <version> <created|deleted|modified> <name>"
+    // messages, or one "EVENT <version> overflow" when inotify dropped some;
+    // "EVENT <version> gone" ends the watch when the directory went away
+    static std::vector<std::string> take() {
+        std::vector<std::string> messages;
+        char buffer[maxn];
+        if (overflowed) {
+            snprintf(buffer, maxn, "EVENT %llu overflow", ++version);
+            messages.push_back(buffer);
+        }
+        else {
+            for (const auto& change : pending) {
+                snprintf(buffer, maxn, "EVENT %llu %s %s", ++version, change.second == created ? "created" :
+                         change.second == deleted ? "deleted" : "modified", change.first.c_str());
+                messages.push_back(buffer);
             }
-            else if (errno == EACCES) {
-                return newPath + ": Permission denied";
+        }
+        if (gone) {
+            snprintf(buffer, maxn, "EVENT %llu gone", ++version);
+            messages.push_back(buffer);
+            stop();
+        }
+        pending.clear();
+        overflowed = false;
+        due = 0;
+        return messages;
+    }
+
+private:
+    static int fd;
+    static int wd;
+    static int coalesceMs;
+    static unsigned long long version;
+    static std::map<std::string, char> pending;
+    static bool overflowed;
+    static bool gone;
+    static long long due;   // ms on the steady clock, 0 = nothing pending
+
+private:
+    static void merge(const std::string& name, const char& kind) {
+        std::map<std::string, char>::iterator it = pending.find(name);
+        if (it == pending.end()) {
+            pending[name] = kind;
+        }
+        else if (kind == deleted) {
+            // created and gone again in one window: nothing to report
+            if (it->second == created) {
+                pending.erase(it);
             }
             else {
-                return newPath + ": Unexpected error";
+                it->second = deleted;
             }
         }
-        updatePath();
-        return "";
+        else if (kind == created) {
+            // deleted and created again: replaced
+            it->second = it->second == deleted ? modified : created;
+        }
+    }
+    static long long nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+int DirectoryWatch::fd = -1;
+int DirectoryWatch::wd = -1;
+int DirectoryWatch::coalesceMs = 100;
+unsigned long long DirectoryWatch::version = 0;
+std::map<std::string, char> DirectoryWatch::pending;
+bool DirectoryWatch::overflowed = false;
+bool DirectoryWatch::gone = false;
+long long DirectoryWatch::due = 0;
+
+// -record: the session's exchange goes to <dir>/session-<start>-<pid>.log,
+// see SessionLog.  Nothing is recorded unless start() was called.
+class SessionRecorder {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+public:
+    static void start(const std::string& dir) {
+        uint64_t startUs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        std::string path = dir + "/session-" + std::to_string(startUs / 1000000) + "-" +
+                           std::to_string(getpid()) + ".log";
+        if (!log.create(path, startUs)) {
+            fprintf(stderr, "%s: %s, session not recorded\n", path.c_str(), strerror(errno));
+            return;
+        }
+        started = Clock::now();
+        recording = true;
+    }
+    // message was just read; the server had waited for it since waitStart
+    static void message(const Transport& conn, const char& kind, const char* message,
+                        const Clock::time_point& waitStart) {
+        if (recording) {
+            log.append(next(conn, kind, message, waitStart));
+        }
+    }
+    static void finish(const Transport& conn) {
+        if (recording) {
+            log.append(next(conn, SessionLog::end, "", Clock::now()));
+            log.close();
+            recording = false;
+        }
     }
 
 private:
-    std::string path;
-    std::string startupPath;
+    static SessionLog log;
+    static bool recording;
+    static Clock::time_point started;
+    static unsigned long long consumed;  // bytes handed out by conn at the previous record
+    static unsigned long long sent;
 
 private:
-    void updatePath() {
-        char buffer[maxn];
-        if (!getcwd(buffer, maxn)) {
-            fprintf(stderr, "getcwd Error\nProgram Terminated!\n");
-            exit(EXIT_FAILURE);
-        }
-        path = buffer;
-    }
-    std::string convertPath(const std::string& base) {
-        std::string ret = base;
-        if (ret != "/" && ret.back() == '/') {
-            ret.pop_back();
-        }
-        return ret;
+    static SessionLog::Record next(const Transport& conn, const char& kind, const char* message,
+                                   const Clock::time_point& waitStart) {
+        Clock::time_point now = Clock::now();
+        SessionLog::Record record;
+        record.kind = kind;
+        record.at = std::chrono::duration_cast<std::chrono::microseconds>(now - started).count();
+        record.idle = std::chrono::duration_cast<std::chrono::microseconds>(now - waitStart).count();
+        unsigned long long handedOut = conn.bytesReceived() - conn.buffered();
+        // the message itself is not payload
+        unsigned long long frame = kind == SessionLog::end ? 0 : maxn;
+        record.payload = handedOut - consumed - frame;
+        record.sent = conn.bytesSent() - sent;
+        record.text = message;
+        consumed = handedOut;
+        sent = conn.bytesSent();
+        return record;
     }
 };
 
+SessionLog SessionRecorder::log;
+bool SessionRecorder::recording = false;
+SessionRecorder::Clock::time_point SessionRecorder::started;
+unsigned long long SessionRecorder::consumed = 0;
+unsigned long long SessionRecorder::sent = 0;
+
 class ServerFunc {
 public:
-    static std::string nextCommand(const int& fd) {
-        char buffer[maxn];
+    // read the next command into buffer (maxn bytes), false when the client
+    // hangs up or stays idle past idleTimeout; changes to a watched directory
+    // are pushed while waiting, and a watching session is never idle
+    static bool nextCommand(Transport& conn, const int& idleTimeout, char* buffer) {
+        conn.flush();
+        traceCheckpoint();
+        SessionRecorder::Clock::time_point waitStart = SessionRecorder::Clock::now();
+        while (conn.buffered() < static_cast<size_t>(maxn)) {
+            pollfd pfds[2];
+            pfds[0].fd = conn.getFd();
+            pfds[0].events = POLLIN;
+            pfds[1].fd = DirectoryWatch::getFd();
+            pfds[1].events = POLLIN;
+            int timeout = DirectoryWatch::watching() ? DirectoryWatch::untilDue() :
+                          idleTimeout > 0 ? idleTimeout * 1000 : -1;
+            int ready = poll(pfds, 2, timeout);
+            if (ready < 0 && errno == EINTR) {
+                // SIGUSR2 interrupts the wait, so an idle session dumps its trace right away
+                traceCheckpoint();
+                continue;
+            }
+            if (ready < 0) {
+                break;
+            }
+            if (ready == 0 && !DirectoryWatch::watching()) {
+                cleanBuffer(buffer);
+                sprintf(buffer, "IDLE_TIMEOUT");
+                birdWrite(conn, buffer);
+                conn.flush();
+                return false;
+            }
+            if (pfds[1].revents & POLLIN) {
+                DirectoryWatch::collect();
+            }
+            if (DirectoryWatch::untilDue() == 0) {
+                for (const std::string& event : DirectoryWatch::take()) {
+                    cleanBuffer(buffer);
+                    snprintf(buffer, maxn, "%s", event.c_str());
+                    birdWrite(conn, buffer);
+                }
+                conn.flush();
+            }
+            if (pfds[0].revents) {
+                break;
+            }
+        }
         cleanBuffer(buffer);
-        birdRead(fd, buffer);
-        return std::string(buffer);
+        if (!conn.readMessage(buffer)) {
+            return false;
+        }
+        SessionRecorder::message(conn, SessionLog::command, buffer, waitStart);
+        return true;
     }
-    static void pwd(const int& fd, const WorkingDirectory& wd) {
+    static void pwd(Transport& conn, const WorkingDirectory& wd) {
         char buffer[maxn];
         cleanBuffer(buffer);
         sprintf(buffer, "%s", wd.getPath().c_str());
-        birdWrite(fd, buffer);
+        birdWrite(conn, buffer);
     }
-    static void ls(const int& fd, const WorkingDirectory& wd) {
-        DIR* dir = opendir(wd.getPath().c_str());
-        if (!dir) {
+    static void ls(Transport& conn, const WorkingDirectory& wd) {
+        std::vector<std::string> fileList;
+        if (StorageBackend::get().list(wd.getPath(), fileList) < 0) {
             char buffer[maxn];
             cleanBuffer(buffer);
             sprintf(buffer, "%s: Cannot open the directory", wd.getPath().c_str());
-            birdWrite(fd, buffer);
+            birdWrite(conn, buffer);
         }
         else {
-            dirent *dirst;
-            std::vector<std::string> fileList;
-            while ((dirst = readdir(dir))) {
-                std::string name(dirst->d_name);
-                if (dirst->d_type == DT_DIR) {
-                    name += "/";
-                }
-                fileList.push_back(name);
-            }
+            fileList.push_back("./");
+            fileList.push_back("../");
             std::sort(fileList.begin(), fileList.end());
             char buffer[maxn];
             cleanBuffer(buffer);
             sprintf(buffer, "length = %d", static_cast<int>(fileList.size()));
-            birdWrite(fd, buffer);
+            birdWrite(conn, buffer);
             for (unsigned i = 0; i < fileList.size(); ++i) {
                 cleanBuffer(buffer);
                 sprintf(buffer, "%s", fileList[i].c_str());
-                birdWrite(fd, buffer);
+                birdWrite(conn, buffer);
             }
-            closedir(dir);
         }
     }
-    static void cd(const int& fd, const std::string& argu, WorkingDirectory& wd) {
+    // watch <dir>: "WATCHING version = <v> length = <n>" and the n names in
+    // dir as ls sends them, then changes are pushed between commands (see
+    // DirectoryWatch); "ERROR <message>" when dir cannot be watched
+    static void watch(Transport& conn, std::string_view argu, const int& coalesce) {
         const std::string nargu = processArgument(argu);
-        std::string ret = wd.changeDir(nargu);
         char buffer[maxn];
         cleanBuffer(buffer);
-        sprintf(buffer, "%s", ret.c_str());
-        birdWrite(fd, buffer);
+        // inotify only sees the local filesystem
+        if (!StorageBackend::get().onDisk()) {
+            snprintf(buffer, maxn, "ERROR %s: %s", nargu.c_str(), strerror(EOPNOTSUPP));
+            birdWrite(conn, buffer);
+            return;
+        }
+        // watched before it is listed, so no change falls between the two
+        std::vector<std::string> fileList;
+        if (!DirectoryWatch::start(nargu, coalesce) || StorageBackend::get().list(nargu, fileList) < 0) {
+            snprintf(buffer, maxn, "ERROR %s: %s", nargu.c_str(), strerror(errno));
+            DirectoryWatch::stop();
+            birdWrite(conn, buffer);
+            return;
+        }
+        std::sort(fileList.begin(), fileList.end());
+        sprintf(buffer, "WATCHING version = %llu length = %d", DirectoryWatch::getVersion(),
+                static_cast<int>(fileList.size()));
+        birdWrite(conn, buffer);
+        for (const std::string& name : fileList) {
+            cleanBuffer(buffer);
+            snprintf(buffer, maxn, "%s", name.c_str());
+            birdWrite(conn, buffer);
+        }
+    }
+    // unwatch: "UNWATCHED", nothing is pushed after it
+    static void unwatch(Transport& conn) {
+        DirectoryWatch::stop();
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        sprintf(buffer, "UNWATCHED");
+        birdWrite(conn, buffer);
     }
-    static void u(const int& fd, const std::string& argu, const WorkingDirectory& wd) {
+    // replies the error message, empty on success; with "-cwd <path>" success
+    // is "CWD <new directory>", which saves the client a pwd, and errors are
+    // "ERROR <message>" so a path can never pass for the other
+    static void cd(Transport& conn, std::string_view argu, WorkingDirectory& wd) {
+        bool report = nextFlag(argu, "-cwd");
         const std::string nargu = processArgument(argu);
+        std::string ret = wd.changeDir(nargu);
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        if (ret == "" && report) {
+            snprintf(buffer, maxn, "CWD %s", wd.getPath().c_str());
+        }
+        else if (report) {
+            snprintf(buffer, maxn, "ERROR %s", ret.c_str());
+        }
+        else {
+            snprintf(buffer, maxn, "%s", ret.c_str());
+        }
+        birdWrite(conn, buffer);
+    }
+    // The upload ends with COMMITTED once the file is in place with the
+    // configured durability, or COMMIT_FAILED.  Except in durabilityNone the
+    // data goes to a hidden temp file in the same directory first, so readers
+    // never see a half-written file under the final name.
+    // argu may start with "-resume <offset> <size>": the client continues the
+    // partial upload a resumed session left, and sends the bytes from offset on.
+    // A size message ending in " chunked" announces data of unknown length,
+    // piped into the client, in chunks; such an upload cannot be continued.
+    // One ending in " local" came over a Unix socket with the client's open
+    // file attached, which is copied here instead of any data.
+    // returns the path of the committed file, empty when the upload failed
+    static std::string u(Transport& conn, std::string_view argu, const WorkingDirectory& wd, const ServerConfig& config,
+                  const UdpConfig* udp = nullptr) {
+        unsigned long offset = 0, resumeSize = 0;
+        std::string_view name = argu;
+        bool resuming = !udp && nextFlag(name, "-resume") && nextNumber(name, offset) && nextNumber(name, resumeSize);
+        const std::string nargu = processArgument(resuming ? trimSpaces(name) : argu);
         char buffer[maxn];
         std::string filename = getFileName(nargu);
-        FILE* fp = fopen(filename.c_str(), "wb");
+        std::string tempname = "";
+        FILE* fp = nullptr;
+        TraceSpan open("fopen");
+        if (resuming) {
+            fp = reopenUpload(filename, offset, resumeSize, tempname, filename);
+        }
+        else if (filename != "" && config.durability == durabilityNone) {
+            fp = openStored(filename, O_CREAT | O_TRUNC);
+        }
+        else if (filename != "") {
+            tempname = "." + filename + ".XXXXXX";
+            int tempFd = StorageBackend::get().openTemp(tempname);
+            if (tempFd >= 0) {
+                fp = fdopen(tempFd, "wb");
+                pendingTemp = tempname;
+            }
+        }
+        open.end();
         if (!fp) {
             cleanBuffer(buffer);
             sprintf(buffer, "ERROR_OPEN_FILE");
-            birdWrite(fd, buffer);
-            return;
+            birdWrite(conn, buffer);
+            return "";
+        }
+        int udpFd = -1;
+        if (udp) {
+            int udpPort;
+            udpFd = UdpTransfer::openReceiver(conn.getFd(), udpPort);
+            if (udpFd < 0) {
+                cleanBuffer(buffer);
+                sprintf(buffer, "ERROR_UDP_SETUP");
+                birdWrite(conn, buffer);
+                discardTemp(fp);
+                return "";
+            }
+            cleanBuffer(buffer);
+            sprintf(buffer, "OK udpport = %d", udpPort);
+            birdWrite(conn, buffer);
         }
         else {
             cleanBuffer(buffer);
             sprintf(buffer, "OK");
-            birdWrite(fd, buffer);
+            birdWrite(conn, buffer);
         }
         unsigned long fileSize;
-        birdRead(fd, buffer);
+        conn.expectFd(!udp && !resuming);
+        birdRead(conn, buffer);
         sscanf(buffer, "%*s%*s%lu", &fileSize);
-        birdReadFile(fd, fp, fileSize);
-        fclose(fp);
+        // sparse and UDP uploads do not arrive front to back, they cannot be continued
+        bool chunked = !udp && strstr(buffer, " chunked");
+        bool local = !udp && !resuming && strstr(buffer, " local");
+        int sourceFd = local ? conn.takeFd() : -1;
+        conn.expectFd(false);
+        keepPendingTemp = !udp && !strstr(buffer, " sparse") && !chunked && !local &&
+                          SessionTokens::beginUpload(filename, absolutePath(wd, tempname != "" ? tempname : filename),
+                                                     tempname != "", fileSize);
+        bool received = true;
+        if (resuming) {
+            conn.readFile(fp, fileSize > offset ? fileSize - offset : 0);
+        }
+        else if (udp) {
+            received = UdpTransfer::recvFile(conn.getFd(), udpFd, fileno(fp), fileSize, *udp);
+            close(udpFd);
+            cleanBuffer(buffer);
+            sprintf(buffer, "%s", received ? "UDP_COMPLETE" : "UDP_FAILED");
+            birdWrite(conn, buffer);
+        }
+        else if (strstr(buffer, " sparse")) {
+            conn.readSparseFile(fp, fileSize);
+        }
+        else if (chunked) {
+            conn.readChunkedFile(fp);
+        }
+        else if (local) {
+            received = sourceFd >= 0 && Transport::copyFile(sourceFd, fileno(fp), fileSize);
+            if (sourceFd >= 0) {
+                close(sourceFd);
+            }
+        }
+        else if (isStreaming(fileSize, config)) {
+            conn.streamReadFile(fp, fileSize, config.directIO);
+        }
+        else {
+            conn.readFile(fp, fileSize);
+        }
+        std::string error = "";
+        TraceSpan committing("commit");
+        if (!received) {
+            error = "transfer incomplete";
+        }
+        else if (fflush(fp) != 0) {
+            error = strerror(errno);
+        }
+        else if (!commit(fp, tempname, filename, config)) {
+            error = strerror(errno);
+        }
+        if (error != "") {
+            discardTemp(fp);
+        }
+        else {
+            fclose(fp);
+            SessionTokens::endUpload();
+            keepPendingTemp = false;
+        }
+        committing.end();
+        cleanBuffer(buffer);
+        if (error == "") {
+            sprintf(buffer, "COMMITTED");
+        }
+        else {
+            snprintf(buffer, maxn, "COMMIT_FAILED %s", error.c_str());
+        }
+        birdWrite(conn, buffer);
+        return error == "" ? absolutePath(wd, filename) : "";
     }
-    static void d(const int& fd, const std::string& argu) {
-        const std::string nargu = processArgument(argu);
+    // argu may start with "-if <size> <mtime ns> <hash>" describing the client's
+    // cached copy; when it still matches, NOT_MODIFIED replaces the transfer.
+    // Or with "-from <offset> <mtime ns>": the client holds the first offset
+    // bytes from an interrupted download, and gets the rest when the file is
+    // unchanged ("from = <offset>" in the size message), all of it otherwise.
+    // Or with "-range <offset> <length> <mtime ns>": just those bytes, to
+    // repair blocks a hash comparison found; FILE_CHANGED if the file is not
+    // the one hashed any more.  Or with "-stream": the client writes the data
+    // to a pipe, so it is sent plain, never as a sparse stream.  Over a Unix
+    // socket a whole-file download passes the open file instead of the data,
+    // marked " local" in the size message.
+    static void d(Transport& conn, std::string_view argu, const ServerConfig& config, const UdpConfig* udp = nullptr) {
+        unsigned long ifSize = 0, from = 0, length = 0;
+        unsigned long long ifMtime = 0, ifHash = 0, fromMtime = 0;
+        // every form starts over from the whole argument, a file may be named -if
+        std::string_view name;
+        auto option = [&](std::string_view flag) {
+            name = argu;
+            return nextFlag(name, flag);
+        };
+        bool plain = !udp && option("-stream");
+        bool conditional = !plain && option("-if") && nextNumber(name, ifSize) && nextNumber(name, ifMtime) &&
+                           nextNumber(name, ifHash, 16);
+        bool resuming = !plain && !conditional && !udp && option("-from") && nextNumber(name, from) &&
+                        nextNumber(name, fromMtime);
+        bool ranged = !plain && !conditional && !resuming && !udp && option("-range") && nextNumber(name, from) &&
+                      nextNumber(name, length) && nextNumber(name, fromMtime);
+        const std::string nargu = processArgument(conditional || resuming || ranged || plain ? trimSpaces(name) : argu);
         char buffer[maxn];
+        TraceSpan lookup("lstat");
         int chk = isExist(nargu);
+        lookup.end();
         if (chk == -2) {
             cleanBuffer(buffer);
             sprintf(buffer, "UNEXPECTED_ERROR");
-            birdWrite(fd, buffer);
+            birdWrite(conn, buffer);
             return;
         }
         else if (chk == -1) {
             cleanBuffer(buffer);
             sprintf(buffer, "PERMISSION_DENIED");
-            birdWrite(fd, buffer);
+            birdWrite(conn, buffer);
             return;
         }
         else if (chk == 0) {
             cleanBuffer(buffer);
             sprintf(buffer, "FILE_NOT_EXIST");
-            birdWrite(fd, buffer);
+            birdWrite(conn, buffer);
             return;
         }
         else if (chk == 2) {
             cleanBuffer(buffer);
             sprintf(buffer, "IS_DIR");
-            birdWrite(fd, buffer);
+            birdWrite(conn, buffer);
+            return;
+        }
+        else if (chk == 3) {
+            cleanBuffer(buffer);
+            sprintf(buffer, "NOT_REGULAR_FILE");
+            birdWrite(conn, buffer);
+            return;
+        }
+        TraceSpan open("fopen");
+        FILE* fp = openStored(nargu);
+        struct stat st;
+        bool opened = fp && fstat(fileno(fp), &st) == 0;
+        open.end();
+        if (!opened) {
+            if (fp) {
+                fclose(fp);
+            }
+            cleanBuffer(buffer);
+            sprintf(buffer, "UNEXPECTED_ERROR");
+            birdWrite(conn, buffer);
+            return;
+        }
+        unsigned long long mtime = static_cast<unsigned long long>(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec;
+        if (conditional && static_cast<unsigned long>(st.st_size) == ifSize &&
+            (mtime == ifMtime || (ifHash != 0 && fileHash(fileno(fp)) == ifHash))) {
+            cleanBuffer(buffer);
+            sprintf(buffer, "NOT_MODIFIED mtime = %llu", mtime);
+            birdWrite(conn, buffer);
+            fclose(fp);
+            return;
+        }
+        if (ranged && (mtime != fromMtime || from > static_cast<unsigned long>(st.st_size) ||
+                       length > st.st_size - from)) {
+            cleanBuffer(buffer);
+            sprintf(buffer, "FILE_CHANGED");
+            birdWrite(conn, buffer);
+            fclose(fp);
+            return;
+        }
+        cleanBuffer(buffer);
+        sprintf(buffer, "FILE_EXISTS");
+        birdWrite(conn, buffer);
+        cleanBuffer(buffer);
+        birdRead(conn, buffer);
+        if (std::string(buffer) == "ERROR_OPEN_FILE") {
+            fclose(fp);
+            return;
+        }
+        int udpPort = 0;
+        if (udp && sscanf(buffer, "OK udpport = %d", &udpPort) != 1) {
+            // client could not set up its UDP socket
+            fclose(fp);
+            return;
+        }
+        unsigned long fileSize = st.st_size;
+        if (resuming && (mtime != fromMtime || from > fileSize)) {
+            from = 0;
+        }
+        bool local = !udp && !resuming && !ranged && !plain && conn.isLocal();
+        bool sparse = !udp && !resuming && !ranged && !plain && !local && Transport::isSparse(fileno(fp));
+        cleanBuffer(buffer);
+        if (local) {
+            sprintf(buffer, "filesize = %lu mtime = %llu local", fileSize, mtime);
+            conn.writeMessage(buffer, fileno(fp));
+            fclose(fp);
+            return;
+        }
+        if (ranged) {
+            sprintf(buffer, "filesize = %lu mtime = %llu from = %lu length = %lu", fileSize, mtime, from, length);
+        }
+        else if (resuming) {
+            sprintf(buffer, "filesize = %lu mtime = %llu from = %lu", fileSize, mtime, from);
+        }
+        else {
+            sprintf(buffer, "filesize = %lu mtime = %llu%s", fileSize, mtime, sparse ? " sparse" : "");
+        }
+        birdWrite(conn, buffer);
+        if (resuming || ranged) {
+            fseek(fp, from, SEEK_SET);
+            conn.writeFile(fp, ranged ? length : fileSize - from);
+        }
+        else if (udp) {
+            conn.flush();
+            UdpTransfer::sendFile(conn.getFd(), udpPort, fileno(fp), fileSize, *udp);
+            // verdict from the receiving client, UDP_COMPLETE or UDP_FAILED
+            cleanBuffer(buffer);
+            birdRead(conn, buffer);
+        }
+        else if (sparse) {
+            conn.writeSparseFile(fp, fileSize);
+        }
+        else if (isStreaming(fileSize, config)) {
+            conn.streamWriteFile(fp, fileSize, config.directIO);
+        }
+        else {
+            conn.writeFile(fp, fileSize);
+        }
+        fclose(fp);
+        return;
+    }
+    // hash <file>: build the Merkle tree of the file with config.hashThreads and
+    // keep it for hashnodes.  "MERKLE size = <bytes> mtime = <ns> block =
+    // <bytes> levels = <n> root = <hex>", or "ERROR <message>".
+    static void hash(Transport& conn, std::string_view argu, const ServerConfig& config) {
+        const std::string nargu = processArgument(argu);
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        merkle = MerkleTree();
+        int chk = isExist(nargu);
+        FILE* fp = chk == 1 ? openStored(nargu) : nullptr;
+        struct stat st;
+        if (!fp || fstat(fileno(fp), &st) < 0 ||
+            !merkle.build(fileno(fp), st.st_size, static_cast<unsigned long>(config.hashBlock) << 10, config.hashThreads)) {
+            snprintf(buffer, maxn, "ERROR %s: %s", nargu.c_str(), chk == 0 ? "No such file or directory" :
+                     chk == -1 ? "Permission denied" : chk == 2 ? "Is a directory" :
+                     chk == 3 ? "Not a regular file" : "Unexpected error");
+            merkle = MerkleTree();
+        }
+        else {
+            unsigned long long mtime = static_cast<unsigned long long>(st.st_mtim.tv_sec) * 1000000000ull +
+                                       st.st_mtim.tv_nsec;
+            sprintf(buffer, "MERKLE size = %lu mtime = %llu block = %lu levels = %d root = %s", merkle.getSize(),
+                    mtime, merkle.getBlockSize(), merkle.levels(), MerkleTree::toHex(merkle.root()).c_str());
+        }
+        if (fp) {
+            fclose(fp);
+        }
+        birdWrite(conn, buffer);
+    }
+    // hashnodes <level> <first> <count>: nodes of the tree the last hash
+    // built, "NODES <count>" followed by the digests in hex, hashesPerMessage
+    // to a message; or "ERROR <message>"
+    static void hashnodes(Transport& conn, std::string_view argu) {
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        int level = 0;
+        unsigned long first = 0, count = 0;
+        if (!nextNumber(argu, level) || !nextNumber(argu, first) || !nextNumber(argu, count)) {
+            sprintf(buffer, "ERROR usage: hashnodes <level> <first> <count>");
+        }
+        else if (merkle.empty()) {
+            sprintf(buffer, "ERROR no hash computed in this session");
+        }
+        else if (level < 0 || level >= merkle.levels() || first > merkle.width(level) ||
+                 count > merkle.width(level) - first || count > maxHashNodes) {
+            sprintf(buffer, "ERROR nodes out of range");
+        }
+        if (buffer[0]) {
+            birdWrite(conn, buffer);
+            return;
+        }
+        sprintf(buffer, "NODES %lu", count);
+        birdWrite(conn, buffer);
+        for (unsigned long i = 0; i < count; i += hashesPerMessage) {
+            cleanBuffer(buffer);
+            for (unsigned long j = i; j < count && j < i + hashesPerMessage; ++j) {
+                strcat(buffer, MerkleTree::toHex(merkle.node(level, first + j)).c_str());
+            }
+            birdWrite(conn, buffer);
+        }
+    }
+    // matches stream back as "MATCH\n<path>\n<path>..." messages, then
+    // "END <count>".  Newlines and backslashes in paths are escaped as \n and
+    // \\.  A path too long for a MATCH message goes out as "LONG <length>"
+    // followed by its bytes, maxn - 1 to a message.
+    static void find(Transport& conn, std::string_view argu, const int& threads) {
+        std::string_view rest = argu;
+        const std::string path = processArgument(nextToken(rest));
+        const std::string pattern = rest.empty() ? "" : processArgument(rest);
+        char buffer[maxn];
+        if (path.empty() || pattern.empty()) {
+            cleanBuffer(buffer);
+            sprintf(buffer, "ERROR usage: find <path> <pattern>");
+            birdWrite(conn, buffer);
+            return;
+        }
+        if (isExist(path) != 2) {
+            cleanBuffer(buffer);
+            snprintf(buffer, maxn, "ERROR %s: No such directory", path.c_str());
+            birdWrite(conn, buffer);
+            return;
+        }
+        int walkers = threads > 0 ? threads : std::max(2u, std::thread::hardware_concurrency());
+        unsigned long count = 0;
+        ParallelFind walker(path, pattern, walkers);
+        walker.run([&](const std::vector<std::string>& batch) {
+            cleanBuffer(buffer);
+            int used = sprintf(buffer, "MATCH");
+            for (const auto& found : batch) {
+                const std::string match = escapeMatch(found);
+                if (used + 1 + static_cast<int>(match.length()) >= maxn && used > static_cast<int>(strlen("MATCH"))) {
+                    birdWrite(conn, buffer);
+                    cleanBuffer(buffer);
+                    used = sprintf(buffer, "MATCH");
+                }
+                if (used + 1 + static_cast<int>(match.length()) < maxn) {
+                    used += sprintf(buffer + used, "\n%s", match.c_str());
+                }
+                else {
+                    cleanBuffer(buffer);
+                    sprintf(buffer, "LONG %lu", static_cast<unsigned long>(match.length()));
+                    birdWrite(conn, buffer);
+                    for (unsigned long pos = 0; pos < match.length(); pos += maxn - 1) {
+                        cleanBuffer(buffer);
+                        memcpy(buffer, match.data() + pos, std::min<unsigned long>(maxn - 1, match.length() - pos));
+                        birdWrite(conn, buffer);
+                    }
+                    cleanBuffer(buffer);
+                    used = sprintf(buffer, "MATCH");
+                }
+                ++count;
+            }
+            if (used > static_cast<int>(strlen("MATCH"))) {
+                birdWrite(conn, buffer);
+            }
+            conn.flush();
+        });
+        cleanBuffer(buffer);
+        sprintf(buffer, "END %lu", count);
+        birdWrite(conn, buffer);
+    }
+    // cp / mv <source> <target>, run entirely on the server.  Replies are
+    // "PROGRESS <bytes> <total>" while data is copied, then "DONE <how>" or
+    // "ERROR <message>".
+    static void cp(Transport& conn, std::string_view argu, const ServerConfig& config) {
+        copyOrMove(conn, argu, config, false);
+    }
+    static void mv(Transport& conn, std::string_view argu, const ServerConfig& config) {
+        copyOrMove(conn, argu, config, true);
+    }
+    // the peer is a replicator: uploads of this session are not forwarded again
+    static void replica(Transport& conn) {
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        sprintf(buffer, "OK");
+        birdWrite(conn, buffer);
+    }
+    // trace on|off|dump, for this session only
+    static void trace(Transport& conn, std::string_view argu) {
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        if (argu == "on" || argu == "off") {
+            Trace::enable(argu == "on");
+            sprintf(buffer, "TRACE %s", argu == "on" ? "on" : "off");
+        }
+        else if (argu == "dump") {
+            std::string path;
+            long count = dumpTrace(path);
+            if (count < 0) {
+                snprintf(buffer, maxn, "ERROR %s: %s", path.c_str(), strerror(errno));
+            }
+            else {
+                snprintf(buffer, maxn, "TRACE %s %ld events", path.c_str(), count);
+            }
+        }
+        else {
+            sprintf(buffer, "ERROR usage: trace on|off|dump");
+        }
+        birdWrite(conn, buffer);
+    }
+    // resume <token>: continue a dropped session.  RESUMED, its working
+    // directory, then "UPLOAD <bytes on disk> <size> <name>" for the upload it
+    // was receiving or "UPLOAD none"; RESUME_FAILED <reason> otherwise.
+    static void resume(Transport& conn, std::string_view argu, WorkingDirectory& wd) {
+        char buffer[maxn];
+        std::string cwd;
+        SessionTokens::Upload upload;
+        std::string error = SessionTokens::resume(argu, cwd, upload);
+        cleanBuffer(buffer);
+        if (error != "") {
+            snprintf(buffer, maxn, "RESUME_FAILED %s", error.c_str());
+            birdWrite(conn, buffer);
+            return;
+        }
+        // the directory may be gone by now, the session then stays where it is
+        wd.changeDir(cwd);
+        SessionTokens::setCwd(wd.getPath());
+        sprintf(buffer, "RESUMED");
+        birdWrite(conn, buffer);
+        cleanBuffer(buffer);
+        sprintf(buffer, "%s", wd.getPath().c_str());
+        birdWrite(conn, buffer);
+        cleanBuffer(buffer);
+        if (upload.name != "") {
+            snprintf(buffer, maxn, "UPLOAD %lu %lu %s", upload.received, upload.size, upload.name.c_str());
+        }
+        else {
+            sprintf(buffer, "UPLOAD none");
+        }
+        birdWrite(conn, buffer);
+    }
+    // dump the trace if SIGUSR2 asked for it
+    static void traceCheckpoint() {
+        if (!Trace::takeDumpRequest()) {
             return;
         }
-        else if (chk == 3) {
-            cleanBuffer(buffer);
-            sprintf(buffer, "NOT_REGULAR_FILE");
-            birdWrite(fd, buffer);
-            return;
+        std::string path;
+        long count = dumpTrace(path);
+        if (count < 0) {
+            fprintf(stderr, "Trace dump to %s failed: %s\n", path.c_str(), strerror(errno));
+        }
+        else {
+            fprintf(stdout, "Trace of %ld events written to %s\n", count, path.c_str());
+        }
+    }
+    static void setTraceDir(const std::string& dir) {
+        traceDir = dir;
+    }
+    static void undef(Transport& conn, const std::string& command) {
+        char buffer[maxn];
+        cleanBuffer(buffer);
+        sprintf(buffer, "%s: Command not found", command.c_str());
+        birdWrite(conn, buffer);
+    }
+
+private:
+    // temp file of the upload in progress, removed by discardPendingTemp() if
+    // the session dies, unless keepPendingTemp: a resumed session continues it
+    static std::string pendingTemp;
+    static bool keepPendingTemp;
+    static std::string traceDir;
+    // the tree of the last hash in this session, for hashnodes
+    static MerkleTree merkle;
+    static constexpr unsigned long hashesPerMessage = (maxn - 1) / 64;
+    static constexpr unsigned long maxHashNodes = 4096;
+
+public:
+    static void discardPendingTemp() {
+        if (pendingTemp != "" && !keepPendingTemp) {
+            StorageBackend::get().remove(pendingTemp);
+            pendingTemp = "";
+        }
+    }
+
+private:
+    // make the received data durable as configured and move it under its final name
+    static bool isStreaming(const unsigned long& size, const ServerConfig& config) {
+        return config.streamThreshold > 0 && size >= (static_cast<unsigned long>(config.streamThreshold) << 20);
+    }
+    static bool commit(FILE* fp, const std::string& tempname, const std::string& filename, const ServerConfig& config) {
+        if (config.durability == durabilityNone) {
+            return true;
+        }
+        int fileFd = fileno(fp);
+        if (config.durability == durabilityFsync && fsync(fileFd) < 0) {
+            return false;
+        }
+        if (config.durability == durabilityGroup && !GroupCommit::sync(fileFd, config.groupWindowMs)) {
+            return false;
+        }
+        if (StorageBackend::get().rename(tempname, filename) < 0) {
+            return false;
+        }
+        pendingTemp = "";
+        // a directory outside the local filesystem has nothing to sync
+        if ((config.durability == durabilityFsync || config.durability == durabilityGroup) &&
+            StorageBackend::get().onDisk()) {
+            // the rename itself lives in the directory
+            int dirFd = open(getDirName(filename).c_str(), O_RDONLY | O_DIRECTORY);
+            bool ok = dirFd >= 0 && (config.durability == durabilityFsync ? fsync(dirFd) == 0 :
+                                     GroupCommit::sync(dirFd, config.groupWindowMs));
+            if (dirFd >= 0) {
+                close(dirFd);
+            }
+            return ok;
+        }
+        return true;
+    }
+    static void copyOrMove(Transport& conn, std::string_view argu, const ServerConfig& config, const bool& move) {
+        std::string_view rest = argu;
+        const std::string source = processArgument(nextToken(rest));
+        std::string target = rest.empty() ? "" : processArgument(rest);
+        char buffer[maxn];
+        std::string error = "", how = "";
+        int chk = source.empty() || target.empty() ? -3 : isExist(source);
+        if (isExist(target) == 2) {
+            target += "/" + getFileName(source);
+        }
+        if (chk == -3) {
+            error = std::string("usage: ") + (move ? "mv" : "cp") + " <source> <target>";
+        }
+        else if (chk == -2) {
+            error = source + ": Unexpected error";
+        }
+        else if (chk == -1) {
+            error = source + ": Permission denied";
+        }
+        else if (chk == 0) {
+            error = source + ": No such file or directory";
+        }
+        else if (move && StorageBackend::get().rename(source, target) == 0) {
+            how = "renamed";
+        }
+        else if (move && errno != EXDEV) {
+            error = target + ": " + strerror(errno);
+        }
+        else if (chk != 1) {
+            // directories and special files only move within a filesystem
+            error = source + (chk == 2 ? " is a directory" : " is not a regular file");
+        }
+        else {
+            error = copyFile(conn, source, target, config, how);
+            if (error == "" && move && StorageBackend::get().remove(source) < 0) {
+                error = source + ": copied but not removed: " + strerror(errno);
+            }
+        }
+        cleanBuffer(buffer);
+        if (error == "") {
+            snprintf(buffer, maxn, "DONE %s", how.c_str());
+        }
+        else {
+            snprintf(buffer, maxn, "ERROR %s", error.c_str());
+        }
+        birdWrite(conn, buffer);
+    }
+    // Copy source to target without the data leaving the server: a reflink
+    // when the filesystem shares extents (FICLONE), else copy_file_range so
+    // the kernel moves the pages (or offloads to the storage), else read/write.
+    // The target follows the upload durability mode.
+    static std::string copyFile(Transport& conn, const std::string& source, const std::string& target,
+                                const ServerConfig& config, std::string& how) {
+        int srcFd = StorageBackend::get().openRead(source);
+        struct stat st, targetSt;
+        if (srcFd < 0 || fstat(srcFd, &st) < 0) {
+            std::string error = source + ": " + strerror(errno);
+            if (srcFd >= 0) {
+                close(srcFd);
+            }
+            return error;
+        }
+        if (StorageBackend::get().stat(target, targetSt) == 0 && targetSt.st_dev == st.st_dev && targetSt.st_ino == st.st_ino) {
+            close(srcFd);
+            return source + " and " + target + " are the same file";
+        }
+        std::string tempname = "";
+        int dstFd;
+        if (config.durability == durabilityNone) {
+            dstFd = StorageBackend::get().openWrite(target, O_CREAT | O_TRUNC, st.st_mode & 0777);
+        }
+        else {
+            std::string dir = getDirName(target);
+            tempname = (dir == "." ? "" : dir + "/") + "." + getFileName(target) + ".XXXXXX";
+            dstFd = StorageBackend::get().openTemp(tempname);
+            if (dstFd >= 0) {
+                fchmod(dstFd, st.st_mode & 0777);
+                pendingTemp = tempname;
+            }
+        }
+        FILE* fp = dstFd < 0 ? nullptr : fdopen(dstFd, "wb");
+        if (!fp) {
+            close(srcFd);
+            return target + ": " + strerror(errno);
+        }
+        std::string error = "";
+        unsigned long size = st.st_size, done = 0;
+        bool ranged = true;
+        if (ioctl(dstFd, FICLONE, srcFd) == 0) {
+            how = "cloned";
+            done = size;
+        }
+        std::vector<char> copyBuffer;
+        std::chrono::steady_clock::time_point reported = std::chrono::steady_clock::now();
+        while (done < size) {
+            ssize_t n;
+            if (ranged) {
+                loff_t inOffset = done, outOffset = done;
+                n = copy_file_range(srcFd, &inOffset, dstFd, &outOffset, std::min(size - done, 64ul << 20), 0);
+                if (n < 0 && done == 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    ranged = false;
+                    continue;
+                }
+            }
+            else {
+                copyBuffer.resize(1 << 20);
+                n = pread(srcFd, copyBuffer.data(), std::min<unsigned long>(copyBuffer.size(), size - done), done);
+                if (n > 0 && pwrite(dstFd, copyBuffer.data(), n, done) != n) {
+                    n = -1;
+                }
+            }
+            if (n <= 0) {
+                error = n == 0 ? source + ": file shrank while copying" : std::string(strerror(errno));
+                break;
+            }
+            done += n;
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (done < size && now - reported >= std::chrono::milliseconds(200)) {
+                char buffer[maxn];
+                cleanBuffer(buffer);
+                sprintf(buffer, "PROGRESS %lu %lu", done, size);
+                birdWrite(conn, buffer);
+                conn.flush();
+                reported = now;
+            }
+        }
+        if (how == "") {
+            how = ranged ? "copied" : "copied (read/write)";
         }
-        FILE* fp = fopen(nargu.c_str(), "rb");
-        if (!fp) {
-            cleanBuffer(buffer);
-            sprintf(buffer, "UNEXPECTED_ERROR");
-            birdWrite(fd, buffer);
-            return;
+        close(srcFd);
+        if (error == "" && !commit(fp, tempname, target, config)) {
+            error = strerror(errno);
         }
-        else {
-            cleanBuffer(buffer);
-            sprintf(buffer, "FILE_EXISTS");
-            birdWrite(fd, buffer);
+        if (error != "") {
+            discardTemp(fp);
         }
-        cleanBuffer(buffer);
-        birdRead(fd, buffer);
-        if (std::string(buffer) == "ERROR_OPEN_FILE") {
+        else {
             fclose(fp);
-            return;
         }
-        unsigned long fileSize;
-        struct stat st;
-        stat(nargu.c_str(), &st);
-        fileSize = st.st_size;
-        cleanBuffer(buffer);
-        sprintf(buffer, "filesize = %lu", fileSize);
-        birdWrite(fd, buffer);
-        birdWriteFile(fd, fp, fileSize);
+        return error;
+    }
+    // every dump gets a new file, trace-<pid>-<n>.json
+    static long dumpTrace(std::string& path) {
+        static int dumps = 0;
+        path = traceDir + "/trace-" + std::to_string(getpid()) + "-" + std::to_string(++dumps) + ".json";
+        return Trace::dump(path);
+    }
+    static void discardTemp(FILE* fp) {
         fclose(fp);
-        return;
+        SessionTokens::endUpload();
+        keepPendingTemp = false;
+        discardPendingTemp();
     }
-    static void undef(const int& fd, const std::string& command) {
-        char buffer[maxn];
-        cleanBuffer(buffer);
-        sprintf(buffer, "%s: Command not found", command.c_str());
-        birdWrite(fd, buffer);
+    // the partial upload of a resumed session, truncated to and positioned at
+    // offset; tempname and filename become absolute paths
+    static FILE* reopenUpload(const std::string& name, const unsigned long& offset, const unsigned long& size,
+                              std::string& tempname, std::string& filename) {
+        SessionTokens::Upload upload;
+        if (!SessionTokens::pendingUpload(upload) || upload.name != name || upload.size != size ||
+            offset > upload.received) {
+            return nullptr;
+        }
+        FILE* fp = openStored(upload.path, 0);
+        if (!fp) {
+            return nullptr;
+        }
+        if (ftruncate(fileno(fp), offset) < 0 || fseek(fp, offset, SEEK_SET) < 0) {
+            fclose(fp);
+            return nullptr;
+        }
+        filename = getDirName(upload.path) + "/" + name;
+        if (upload.temporary) {
+            tempname = upload.path;
+            pendingTemp = tempname;
+        }
+        return fp;
+    }
+    // a file of the storage as a stream, for reading or, with flags, for
+    // writing (see StorageBackend::openWrite()); nullptr with errno set
+    static FILE* openStored(const std::string& path, const int& flags = -1) {
+        StorageBackend& storage = StorageBackend::get();
+        int fileFd = flags < 0 ? storage.openRead(path) : storage.openWrite(path, flags);
+        FILE* fp = fileFd < 0 ? nullptr : fdopen(fileFd, flags < 0 ? "rb" : "r+b");
+        if (fileFd >= 0 && !fp) {
+            close(fileFd);
+        }
+        return fp;
+    }
+    static std::string absolutePath(const WorkingDirectory& wd, const std::string& path) {
+        return path[0] == '/' ? path : wd.getPath() + "/" + path;
     }
-
-private:
     // return -2: error, -1: no permission 0: don't exist, 1: regluar file, 2: directory, 3: other
     static int isExist(const std::string& filePath) {
         struct stat st;
-        if (lstat(filePath.c_str(), &st) != 0) {
+        if (StorageBackend::get().stat(filePath, st) != 0) {
             if (errno == ENOENT) {
                 return 0;
             }
@@ -279,6 +2203,20 @@ private:
             return 3;
         }
     }
+    // FNV-1a over the whole file, matches the client's download index
+    static unsigned long long fileHash(const int& fileFd) {
+        unsigned long long hash = 14695981039346656037ull;
+        char buffer[1 << 16];
+        off_t offset = 0;
+        ssize_t n;
+        while ((n = pread(fileFd, buffer, sizeof(buffer), offset)) > 0) {
+            for (ssize_t i = 0; i < n; ++i) {
+                hash = (hash ^ static_cast<unsigned char>(buffer[i])) * 1099511628211ull;
+            }
+            offset += n;
+        }
+        return hash;
+    }
     static std::string getFileName(const std::string& filePath) {
         unsigned long pos = filePath.rfind("/");
         if (pos + 1 >= filePath.length()) {
@@ -291,134 +2229,477 @@ private:
             return filePath.substr(pos + 1);
         }
     }
-    static std::string processArgument(const std::string& base) {
-        std::string basep = base;
+    static std::string getDirName(const std::string& filePath) {
+        unsigned long pos = filePath.rfind("/");
+        if (pos == std::string::npos) {
+            return ".";
+        }
+        return pos == 0 ? "/" : filePath.substr(0, pos);
+    }
+    // split off the first argument as typed: "quoted" or with \ escaped spaces
+    static std::string_view nextToken(std::string_view& rest) {
+        unsigned i = 0;
+        if (!rest.empty() && rest[0] == '\"') {
+            i = 1;
+            while (i < rest.length() && rest[i] != '\"') {
+                ++i;
+            }
+            i = std::min<unsigned>(i + 1, rest.length());
+        }
+        else {
+            while (i < rest.length() && rest[i] != ' ') {
+                i += rest[i] == '\\' ? 2 : 1;
+            }
+            i = std::min<unsigned>(i, rest.length());
+        }
+        std::string_view token = rest.substr(0, i);
+        rest = trimSpaces(rest.substr(i));
+        return token;
+    }
+    static std::string processArgument(std::string_view base) {
+        // a bare command has a null view, which has no front() or back()
+        if (base.empty()) {
+            return "";
+        }
         if (base.front() == '\"' && base.back() == '\"') {
-            basep = base.substr(1, base.length() - 2);
-            return basep;
+            return std::string(base.substr(1, base.length() - 2));
         }
         std::string ret = "";
         bool backSlashFlag = false;
-        for (unsigned i = 0; i < basep.length(); ++i) {
-            if (basep[i] == '\\') {
+        for (unsigned i = 0; i < base.length(); ++i) {
+            if (base[i] == '\\') {
                 backSlashFlag = true;
                 continue;
             }
             if (backSlashFlag) {
                 backSlashFlag = false;
             }
-            ret += basep[i];
+            ret += base[i];
         }
         if (backSlashFlag) {
             ret += " ";
         }
         return ret;
     }
+    static std::string escapeMatch(const std::string& path) {
+        std::string ret;
+        ret.reserve(path.length());
+        for (char c : path) {
+            if (c == '\n') {
+                ret += "\\n";
+            }
+            else if (c == '\\') {
+                ret += "\\\\";
+            }
+            else {
+                ret += c;
+            }
+        }
+        return ret;
+    }
+    // consume "<flag> " from the front of rest
+    static bool nextFlag(std::string_view& rest, std::string_view flag) {
+        if (rest.size() <= flag.size() || rest.compare(0, flag.size(), flag) != 0 || rest[flag.size()] != ' ') {
+            return false;
+        }
+        rest = trimSpaces(rest.substr(flag.size()));
+        return true;
+    }
+    // consume one space separated number from the front of rest
+    template <typename Number>
+    static bool nextNumber(std::string_view& rest, Number& value, const int& base = 10) {
+        rest = trimSpaces(rest);
+        std::from_chars_result parsed = std::from_chars(rest.data(), rest.data() + rest.size(), value, base);
+        if (parsed.ec != std::errc()) {
+            return false;
+        }
+        rest.remove_prefix(parsed.ptr - rest.data());
+        return true;
+    }
     static void cleanBuffer(char *buffer, const int &n = maxn) {
         memset(buffer, 0, sizeof(char) * n);
     }
-    static int birdRead(const int& fd, char* buffer, const int& n = maxn) {
-        int byteRead = read(fd, buffer, n);
-        if (byteRead < 0) {
-            fprintf(stderr, "read() Error\n");
+    // a message the client must send; the session ends if it hangs up instead
+    static void birdRead(Transport& conn, char* buffer) {
+        SessionRecorder::Clock::time_point waitStart = SessionRecorder::Clock::now();
+        if (!conn.readMessage(buffer)) {
+            fprintf(stderr, "Client closed the connection mid-command\n");
             exit(EXIT_FAILURE);
         }
-        return byteRead;
+        SessionRecorder::message(conn, SessionLog::reply, buffer, waitStart);
     }
-    static int birdWrite(const int& fd, const char* buffer, const int& n = maxn) {
-        int byteWrite = write(fd, buffer, sizeof(char) * n);
-        if (byteWrite < 0) {
-            fprintf(stderr, "write() Error\n");
-            exit(EXIT_FAILURE);
+    static void birdWrite(Transport& conn, const char* buffer) {
+        conn.writeMessage(buffer);
+    }
+};
+
+std::string ServerFunc::pendingTemp = "";
+bool ServerFunc::keepPendingTemp = false;
+MerkleTree ServerFunc::merkle;
+std::string ServerFunc::traceDir = ".";
+
+// per-connection state handed to every command handler
+struct Session {
+    Transport& conn;
+    const ServerConfig& config;
+    WorkingDirectory wd;
+    bool quit;
+    bool replica;       // opened by a peer's replicator
+    Session(Transport& conn, const ServerConfig& config)
+        : conn(conn), config(config), wd(StorageBackend::get()), quit(false), replica(false) {}
+};
+
+// argu is the text after the command name with surrounding spaces trimmed,
+// a view into the receive buffer valid for the duration of the call
+typedef void (*CommandHandler)(Session& session, std::string_view argu);
+
+struct Command {
+    std::string_view name;
+    bool hasArgument;
+    CommandHandler handler;
+};
+
+// Commands are looked up in a constant table by their first word, so adding a
+// command is one handler plus one BIRD_COMMANDS row in dispatch.h.  Parsing works on views into the
+// receive buffer and never allocates; handlers copy what they keep.
+class Dispatcher {
+public:
+    // split line into a table entry and its argument, nullptr if no command matches
+    static const Command* parse(std::string_view line, std::string_view& argu);
+    static void dispatch(Session& session, std::string_view line);
+
+private:
+    static const Command table[];
+
+    static void q(Session& session, std::string_view) {
+        session.quit = true;
+    }
+    static void pwd(Session& session, std::string_view) {
+        ServerFunc::pwd(session.conn, session.wd);
+    }
+    static void ls(Session& session, std::string_view) {
+        ServerFunc::ls(session.conn, session.wd);
+    }
+    static void watch(Session& session, std::string_view argu) {
+        ServerFunc::watch(session.conn, argu, session.config.watchCoalesce);
+    }
+    static void unwatch(Session& session, std::string_view) {
+        ServerFunc::unwatch(session.conn);
+    }
+    static void cd(Session& session, std::string_view argu) {
+        ServerFunc::cd(session.conn, argu, session.wd);
+        SessionTokens::setCwd(session.wd.getPath());
+    }
+    static void resume(Session& session, std::string_view argu) {
+        ServerFunc::resume(session.conn, argu, session.wd);
+    }
+    static void u(Session& session, std::string_view argu) {
+        replicate(session, ServerFunc::u(session.conn, argu, session.wd, session.config));
+    }
+    static void d(Session& session, std::string_view argu) {
+        ServerFunc::d(session.conn, argu, session.config);
+    }
+    static void cp(Session& session, std::string_view argu) {
+        ServerFunc::cp(session.conn, argu, session.config);
+    }
+    static void mv(Session& session, std::string_view argu) {
+        ServerFunc::mv(session.conn, argu, session.config);
+    }
+    static void trace(Session& session, std::string_view argu) {
+        ServerFunc::trace(session.conn, argu);
+    }
+    // only from a listed peer, anyone else could keep uploads from replicating
+    static void replica(Session& session, std::string_view) {
+        if (!Replicator::isPeer(session.conn.getFd())) {
+            ServerFunc::undef(session.conn, "replica");
+            return;
         }
-        return byteWrite;
+        session.replica = true;
+        ServerFunc::replica(session.conn);
     }
-    static void birdWriteFile(const int& fd, FILE* fp, const unsigned long& size) {
-        char buffer[maxn];
-        unsigned byteRead = 0u;
-        while (byteRead < size) {
-            int n = read(fileno(fp), buffer, maxn);
-            if (n < 0) {
-                fprintf(stderr, "Error When Reading File\n");
-                exit(EXIT_FAILURE);
-            }
-            byteRead += n;
-            int m = birdWrite(fd, buffer, n);
-            if (m != n) {
-                fprintf(stderr, "Error When Transmitting Data\n");
-                exit(EXIT_FAILURE);
-            }
+    static void replicate(const Session& session, const std::string& path) {
+        if (path != "" && !session.replica) {
+            Replicator::enqueue(path);
         }
     }
-    static void birdReadFile(const int& fd, FILE* fp, const unsigned long& size) {
-        char buffer[maxn];
-        unsigned byteWrite = 0u;
-        while (byteWrite < size) {
-            int n = read(fd, buffer, maxn);
-            if (n < 0) {
-                fprintf(stderr, "Error When Receiving Data\n");
-                exit(EXIT_FAILURE);
-            }
-            byteWrite += n;
-            int m = write(fileno(fp), buffer, n);
-            if (m != n) {
-                fprintf(stderr, "Error When Writing to File\n");
-                exit(EXIT_FAILURE);
-            }
+    static void find(Session& session, std::string_view argu) {
+        ServerFunc::find(session.conn, argu, session.config.findThreads);
+    }
+    static void hash(Session& session, std::string_view argu) {
+        ServerFunc::hash(session.conn, argu, session.config);
+    }
+    static void hashnodes(Session& session, std::string_view argu) {
+        ServerFunc::hashnodes(session.conn, argu);
+    }
+    // udpu / udpd <loss rate> <delay ms> <file>
+    static void udpu(Session& session, std::string_view argu) {
+        UdpConfig udpConfig;
+        if (!parseUdpConfig(argu, udpConfig)) {
+            ServerFunc::undef(session.conn, "udpu");
+            return;
+        }
+        replicate(session, ServerFunc::u(session.conn, argu, session.wd, session.config, &udpConfig));
+    }
+    static void udpd(Session& session, std::string_view argu) {
+        UdpConfig udpConfig;
+        if (!parseUdpConfig(argu, udpConfig)) {
+            ServerFunc::undef(session.conn, "udpd");
+            return;
+        }
+        ServerFunc::d(session.conn, argu, session.config, &udpConfig);
+    }
+    // consume "<loss rate> <delay ms>" from the front of argu; false when
+    // either is malformed or out of range, as the peer chooses them
+    static bool parseUdpConfig(std::string_view& argu, UdpConfig& udpConfig) {
+        const char* end = argu.data() + argu.size();
+        std::from_chars_result loss = std::from_chars(argu.data(), end, udpConfig.lossRate);
+        if (loss.ec != std::errc()) {
+            return false;
+        }
+        argu = trimSpaces(argu.substr(loss.ptr - argu.data()));
+        std::from_chars_result delay = std::from_chars(argu.data(), argu.data() + argu.size(), udpConfig.delayMs);
+        if (delay.ec != std::errc()) {
+            return false;
         }
+        argu = trimSpaces(argu.substr(delay.ptr - argu.data()));
+        return udpConfig.valid();
     }
 };
 
+#define BIRD_COMMAND_ENTRY(name, hasArgument) {#name, hasArgument, &Dispatcher::name},
+constexpr Command Dispatcher::table[] = {
+    BIRD_COMMANDS(BIRD_COMMAND_ENTRY)
+};
+#undef BIRD_COMMAND_ENTRY
+
+const Command* Dispatcher::parse(std::string_view line, std::string_view& argu) {
+    return parseCommand(table, line, argu);
+}
+
+void Dispatcher::dispatch(Session& session, std::string_view line) {
+    std::string_view argu;
+    const Command* command = parse(line, argu);
+    if (!command) {
+        // a known name with unexpected trailing text is reported whole, as before
+        std::string_view name = line.substr(0, line.find(' '));
+        ServerFunc::undef(session.conn, std::string(argu.empty() ? name : line));
+        return;
+    }
+    TraceSpan span(command->name.data());
+    command->handler(session, argu);
+}
+
 bool isValidArguments(int argc, char const *argv[]);
+bool parseOptions(int argc, char const *argv[], ServerConfig& config);
+void printUsage(const char* name);
 int serverInit(const int& port);
+int unixServerInit(const std::string& path);
 void init();
-void TCPServer(const int& fd);
+void reapChildren(std::map<pid_t, in_addr_t>& sessions, std::map<in_addr_t, int>& sessionsPerIp);
+bool admitSession(const int& fd, const in_addr_t& ip, const ServerConfig& config,
+                  const std::map<pid_t, in_addr_t>& sessions, const std::map<in_addr_t, int>& sessionsPerIp,
+                  int& tokenSlot);
+void TCPServer(const int& fd, const ServerConfig& config);
 void trimNewLine(char* str);
 std::string trimSpaceLE(const std::string& str);
 std::string toLowerString(const std::string& src);
+void forwardTraceRequest(const std::map<pid_t, in_addr_t>& sessions);
 void sigChld(int signo);
+void sigUsr2(int signo);
+void sigHup(int signo);
+
+volatile sig_atomic_t childExited = 0;
+volatile sig_atomic_t restartRequested = 0;
 
 int main(int argc, char const *argv[])
 {
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    if (argc < 2) {
+        printUsage(argv[0]);
         exit(EXIT_FAILURE);
     }
-    if (!isValidArguments(argc, argv)) {
+    ServerConfig config;
+    if (!isValidArguments(argc, argv) || !parseOptions(argc, argv, config)) {
         fprintf(stderr, "Invalid Arguments\n");
         exit(EXIT_FAILURE);
     }
+    if (!StorageBackend::select(config.storage)) {
+        fprintf(stderr, "Unknown storage %s\n", config.storage.c_str());
+        exit(EXIT_FAILURE);
+    }
     init();
+    // sessions change directory, so the trace directory is made absolute now
+    std::string startupPath = WorkingDirectory().getPath();
+    if (config.traceDir == "") {
+        ServerFunc::setTraceDir(startupPath);
+    }
+    else {
+        ServerFunc::setTraceDir(config.traceDir[0] == '/' ? config.traceDir : startupPath + "/" + config.traceDir);
+    }
+    if (config.recordDir != "" && config.recordDir[0] != '/') {
+        config.recordDir = startupPath + "/" + config.recordDir;
+    }
+    Trace::enable(config.trace);
     // server initialize
     int port;
     sscanf(argv[1], "%d", &port);
-    int listenId = serverInit(port);
-    // signal
-    // signal(SIGCHLD, sigChld);
+    if (!config.peers.empty()) {
+        Replicator::start(config);
+    }
+    int listenId = config.handoffPath != "" ? HotRestart::takeOver(config.handoffPath) : -1;
+    if (listenId < 0) {
+        listenId = serverInit(port);
+    }
+    int unixId = config.unixPath != "" ? unixServerInit(config.unixPath) : -1;
+    int handoffId = config.handoffPath != "" ? HotRestart::listenAt(config.handoffPath) : -1;
+    if (config.durability == durabilityGroup) {
+        GroupCommit::init();
+    }
+    if (config.resumeTtl > 0) {
+        // room for every live session plus as many dropped ones
+        SessionTokens::init(config.maxSessions > 0 ? 2 * config.maxSessions : 1024, config.resumeTtl);
+    }
+
+    // signal, no SA_RESTART so a blocked poll() wakes up to reap
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigChld;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, nullptr);
+    // SIGUSR2 makes every session dump its trace
+    sa.sa_handler = sigUsr2;
+    sigaction(SIGUSR2, &sa, nullptr);
+    // SIGHUP launches the new binary, which takes over through the handoff socket
+    sa.sa_handler = sigHup;
+    sigaction(SIGHUP, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
     // wait for connection, then fork for per client
+    std::map<pid_t, in_addr_t> sessions;
+    std::map<in_addr_t, int> sessionsPerIp;
     while (true) {
         pid_t childPid;
         socklen_t clientLen = sizeof(sockaddr_in);
         sockaddr_in clientAddr;
-        int clientfd = accept(listenId, reinterpret_cast<sockaddr*>(&clientAddr), &clientLen);
+        reapChildren(sessions, sessionsPerIp);
+        forwardTraceRequest(sessions);
+        if (restartRequested) {
+            restartRequested = 0;
+            if (handoffId >= 0) {
+                HotRestart::launch(argv);
+            }
+            else {
+                fprintf(stderr, "SIGHUP ignored: restart needs -handoff\n");
+            }
+        }
+        // unused entries stay -1, poll() skips them
+        pollfd fds[3];
+        fds[0].fd = listenId;
+        fds[0].events = POLLIN;
+        fds[1].fd = handoffId;
+        fds[1].events = POLLIN;
+        fds[2].fd = unixId;
+        fds[2].events = POLLIN;
+        if (poll(fds, 3, -1) < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "poll() Error: %s\n", strerror(errno));
+            }
+            continue;
+        }
+        if (handoffId >= 0 && (fds[1].revents & POLLIN)) {
+            if (HotRestart::handOver(handoffId, listenId)) {
+                break;
+            }
+            continue;
+        }
+        bool local = unixId >= 0 && (fds[2].revents & POLLIN);
+        if (!local && !(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        // non-blocking: during a handoff the other instance may take the connection first
+        int clientfd;
+        if (local) {
+            // same-host sessions count against the loopback address
+            clientfd = accept(unixId, nullptr, nullptr);
+            memset(&clientAddr, 0, sizeof(clientAddr));
+            clientAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        }
+        else {
+            clientfd = accept(listenId, reinterpret_cast<sockaddr*>(&clientAddr), &clientLen);
+        }
+        if (clientfd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+                fprintf(stderr, "accept() Error: %s\n", strerror(errno));
+            }
+            continue;
+        }
+        reapChildren(sessions, sessionsPerIp);
+        int tokenSlot;
+        if (!admitSession(clientfd, clientAddr.sin_addr.s_addr, config, sessions, sessionsPerIp, tokenSlot)) {
+            close(clientfd);
+            continue;
+        }
+        // the children would print whatever is still buffered a second time
+        fflush(stdout);
         if ((childPid = fork()) == 0) {
             close(listenId);
+            if (handoffId >= 0) {
+                close(handoffId);
+            }
+            if (unixId >= 0) {
+                close(unixId);
+            }
+            atexit(ServerFunc::discardPendingTemp);
+            SessionTokens::own(tokenSlot);
             char clientInfo[1024];
             strcpy(clientInfo, inet_ntoa(clientAddr.sin_addr));
             int clientPort = static_cast<int>(clientAddr.sin_port);
-            fprintf(stdout, "Connection from %s, port %d\n", clientInfo, clientPort);
-            TCPServer(clientfd);
+            if (local) {
+                fprintf(stdout, "Connection on %s\n", config.unixPath.c_str());
+            }
+            else {
+                fprintf(stdout, "Connection from %s, port %d\n", clientInfo, clientPort);
+            }
+            TCPServer(clientfd, config);
             close(clientfd);
-            fprintf(stdout, "Client %s:%d terminated\n", clientInfo, clientPort);
+            if (local) {
+                fprintf(stdout, "Client on %s terminated\n", config.unixPath.c_str());
+            }
+            else {
+                fprintf(stdout, "Client %s:%d terminated\n", clientInfo, clientPort);
+            }
             exit(EXIT_SUCCESS);
         }
+        if (childPid > 0) {
+            sessions[childPid] = clientAddr.sin_addr.s_addr;
+            ++sessionsPerIp[clientAddr.sin_addr.s_addr];
+            SessionTokens::attach(tokenSlot, childPid);
+        }
+        else {
+            fprintf(stderr, "fork() Error: %s\n", strerror(errno));
+            SessionTokens::release(tokenSlot);
+        }
         close(clientfd);
     }
+    // handed over: the new instance accepts from now on, wait for our sessions;
+    // it bound the Unix socket path anew, so the file stays
+    close(listenId);
+    close(handoffId);
+    if (unixId >= 0) {
+        close(unixId);
+    }
+    fprintf(stdout, "Listening socket handed over, draining %d session(s)\n", static_cast<int>(sessions.size()));
+    fflush(stdout);
+    while (!sessions.empty()) {
+        // SIGCHLD cuts the wait short
+        poll(nullptr, 0, 1000);
+        forwardTraceRequest(sessions);
+        reapChildren(sessions, sessionsPerIp);
+    }
+    fprintf(stdout, "All sessions finished, exiting\n");
     return 0;
 }
 
 bool isValidArguments(int argc, char const *argv[]) {
-    if (argc != 2) {
+    if (argc < 2) {
         return false;
     }
     for (const char* ptr = argv[1]; *ptr; ++ptr) {
@@ -430,10 +2711,171 @@ bool isValidArguments(int argc, char const *argv[]) {
     return true;
 }
 
+bool parseOptions(int argc, char const *argv[], ServerConfig& config) {
+    for (int i = 2; i < argc; ++i) {
+        std::string option = argv[i];
+        int* target = nullptr;
+        if (option == "-durability" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "none") {
+                config.durability = durabilityNone;
+            }
+            else if (mode == "rename") {
+                config.durability = durabilityRename;
+            }
+            else if (mode == "fsync") {
+                config.durability = durabilityFsync;
+            }
+            else if (mode == "group") {
+                config.durability = durabilityGroup;
+            }
+            else {
+                fprintf(stderr, "-durability must be none, rename, fsync or group\n");
+                return false;
+            }
+            continue;
+        }
+        else if (option == "-direct") {
+            config.directIO = true;
+            continue;
+        }
+        else if (option == "-trace") {
+            config.trace = true;
+            continue;
+        }
+        else if (option == "-handoff" && i + 1 < argc) {
+            config.handoffPath = argv[++i];
+            continue;
+        }
+        else if (option == "-unix" && i + 1 < argc) {
+            config.unixPath = argv[++i];
+            continue;
+        }
+        else if (option == "-storage" && i + 1 < argc) {
+            config.storage = argv[++i];
+            if (config.storage != "posix" && config.storage != "memory") {
+                fprintf(stderr, "-storage must be posix or memory\n");
+                return false;
+            }
+            continue;
+        }
+        else if (option == "-trace-dir" && i + 1 < argc) {
+            config.traceDir = argv[++i];
+            continue;
+        }
+        else if (option == "-record" && i + 1 < argc) {
+            config.recordDir = argv[++i];
+            continue;
+        }
+        else if (option == "-peer" && i + 1 < argc) {
+            std::string peer = argv[++i];
+            if (peer.rfind(':') == std::string::npos || peer.rfind(':') + 1 == peer.length()) {
+                fprintf(stderr, "-peer needs host:port\n");
+                return false;
+            }
+            config.peers.push_back(peer);
+            continue;
+        }
+        else if (option == "-max-sessions") {
+            target = &config.maxSessions;
+        }
+        else if (option == "-max-per-ip") {
+            target = &config.maxPerIp;
+        }
+        else if (option == "-idle-timeout") {
+            target = &config.idleTimeout;
+        }
+        else if (option == "-io-timeout") {
+            target = &config.ioTimeout;
+        }
+        else if (option == "-find-threads") {
+            target = &config.findThreads;
+        }
+        else if (option == "-hash-threads") {
+            target = &config.hashThreads;
+        }
+        else if (option == "-hash-block") {
+            target = &config.hashBlock;
+        }
+        else if (option == "-watch-coalesce") {
+            target = &config.watchCoalesce;
+        }
+        else if (option == "-group-window") {
+            target = &config.groupWindowMs;
+        }
+        else if (option == "-stream-threshold") {
+            target = &config.streamThreshold;
+        }
+        else if (option == "-replica-queue") {
+            target = &config.replicaQueue;
+        }
+        else if (option == "-resume-ttl") {
+            target = &config.resumeTtl;
+        }
+        else {
+            fprintf(stderr, "Unrecognized Argument %s\n", argv[i]);
+            printUsage(argv[0]);
+            return false;
+        }
+        if (i + 1 >= argc || sscanf(argv[i + 1], "%d", target) != 1 || *target < 0) {
+            fprintf(stderr, "%s needs a non-negative number\n", argv[i]);
+            return false;
+        }
+        ++i;
+    }
+    if (config.hashBlock == 0) {
+        fprintf(stderr, "-hash-block needs a positive number\n");
+        return false;
+    }
+    // the store lives and dies with the instance that started it, a successor
+    // would start an empty one while the old sessions still write to the first
+    if (config.handoffPath != "" && config.storage == "memory") {
+        fprintf(stderr, "-handoff cannot be used with -storage memory\n");
+        return false;
+    }
+    return true;
+}
+
+void printUsage(const char* name) {
+    fprintf(stderr, "usage: %s <port> [options]\n", name);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "    -max-sessions <n>    concurrent sessions, 0 = unlimited (default 256)\n");
+    fprintf(stderr, "    -max-per-ip <n>      concurrent sessions per client address, 0 = unlimited (default 16)\n");
+    fprintf(stderr, "    -idle-timeout <sec>  drop sessions idle between commands, 0 = never (default 300)\n");
+    fprintf(stderr, "    -io-timeout <sec>    drop clients stalling a transfer, 0 = never (default 30)\n");
+    fprintf(stderr, "    -find-threads <n>    directory walkers per find, 0 = one per core (default 0)\n");
+    fprintf(stderr, "    -hash-threads <n>    threads hashing a file for hash, 0 = one per core (default 0)\n");
+    fprintf(stderr, "    -hash-block <KB>     block size of the Merkle trees built by hash (default 1024)\n");
+    fprintf(stderr, "    -watch-coalesce <ms> hold changes to a watched directory this long to merge them (default 100)\n");
+    fprintf(stderr, "    -durability <mode>   upload durability (default none):\n");
+    fprintf(stderr, "                             none    write straight into the final file\n");
+    fprintf(stderr, "                             rename  write a temp file, rename into place when complete\n");
+    fprintf(stderr, "                             fsync   rename, fsync the file and directory\n");
+    fprintf(stderr, "                             group   rename, syncfs batched across concurrent uploads\n");
+    fprintf(stderr, "    -group-window <ms>   time a group commit waits for other uploads to join (default 2)\n");
+    fprintf(stderr, "    -stream-threshold <MB>  stream larger files past the page cache, 0 = never (default 64)\n");
+    fprintf(stderr, "    -direct              stream with O_DIRECT where the filesystem supports it\n");
+    fprintf(stderr, "    -peer <host:port>    replicate every upload to this server and accept its replicas, may be repeated\n");
+    fprintf(stderr, "    -replica-queue <n>   pending replications kept before new ones are dropped (default 1024)\n");
+    fprintf(stderr, "    -resume-ttl <sec>    how long a dropped session can be resumed with its token,\n");
+    fprintf(stderr, "                         0 = no tokens (default 300)\n");
+    fprintf(stderr, "    -handoff <path>      Unix socket for hot restarts: a new server started with the same\n");
+    fprintf(stderr, "                         path takes over the listening socket, SIGHUP launches one\n");
+    fprintf(stderr, "    -unix <path>         also listen on this Unix socket; u and d over it pass the open\n");
+    fprintf(stderr, "                         file instead of its data\n");
+    fprintf(stderr, "    -storage <type>      where files are kept (default posix):\n");
+    fprintf(stderr, "                             posix   the directory the server runs in\n");
+    fprintf(stderr, "                             memory  RAM only, starting empty and gone when the server exits;\n");
+    fprintf(stderr, "                                     watch and -handoff are not available\n");
+    fprintf(stderr, "    -trace               record tracing spans from the start, SIGUSR2 dumps them\n");
+    fprintf(stderr, "    -trace-dir <dir>     where trace dumps are written (default: startup directory)\n");
+    fprintf(stderr, "    -record <dir>        log every session's messages, sizes and timings there, for replay\n");
+}
+
 int serverInit(const int& port) {
     int listenId;
     sockaddr_in serverAddr;
-    if ((listenId = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((listenId = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
         fprintf(stderr, "Socket Error\n");
         exit(EXIT_FAILURE);
     }
@@ -449,68 +2891,110 @@ int serverInit(const int& port) {
     return listenId;
 }
 
+// a stale socket file from an earlier run (or the instance being replaced) is taken over
+int unixServerInit(const std::string& path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.length() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path.c_str());
+    int listenId = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path.c_str());
+    if (listenId < 0 || bind(listenId, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        fprintf(stderr, "Unix socket %s Error: %s\n", path.c_str(), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    listen(listenId, 256);
+    return listenId;
+}
+
 void init() {
-    if (!WorkingDirectory::isDirExist("./Upload")) {
-        if (mkdir("Upload", 0777) < 0) {
+    struct stat st;
+    if (StorageBackend::get().stat("Upload", st) < 0 || !S_ISDIR(st.st_mode)) {
+        if (StorageBackend::get().makeDir("Upload") < 0) {
             fprintf(stderr, "Error: mkdir %s: %s\n", "Upload", strerror(errno));
             exit(EXIT_FAILURE);
         }
     }
 }
 
-void TCPServer(const int& fd) {
-    WorkingDirectory wd;
-    while (true) {
-        std::string command = ServerFunc::nextCommand(fd);
-        if (command == "q") {
-            break;
-        }
-        else if (command == "pwd") {
-            ServerFunc::pwd(fd, wd);
-        }
-        else if (command == "ls") {
-            ServerFunc::ls(fd, wd);
-        }
-        else if (command.find("cd") == 0) {
-            char op[maxn];
-            sscanf(command.c_str(), "%s", op);
-            if (strcmp(op, "cd")) {
-                ServerFunc::undef(fd, op);
-            }
-            else {
-                std::string argu(command.c_str() + 2);
-                argu = trimSpaceLE(argu);
-                ServerFunc::cd(fd, argu, wd);
-            }
-        }
-        else if (command.find("u") == 0) {
-            char op[maxn];
-            sscanf(command.c_str(), "%s", op);
-            if (strcmp(op, "u")) {
-                ServerFunc::undef(fd, op);
-            }
-            else {
-                std::string argu(command.c_str() + 1);
-                argu = trimSpaceLE(argu);
-                ServerFunc::u(fd, argu, wd);
-            }
-        }
-        else if (command.find("d") == 0) {
-            char op[maxn];
-            sscanf(command.c_str(), "%s", op);
-            if (strcmp(op, "d")) {
-                ServerFunc::undef(fd, op);
-            }
-            else {
-                std::string argu(command.c_str() + 1);
-                argu = trimSpaceLE(argu);
-                ServerFunc::d(fd, argu);
-            }
+void reapChildren(std::map<pid_t, in_addr_t>& sessions, std::map<in_addr_t, int>& sessionsPerIp) {
+    if (!childExited) {
+        return;
+    }
+    childExited = 0;
+    pid_t pid;
+    int stat;
+    while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
+        std::map<pid_t, in_addr_t>::iterator it = sessions.find(pid);
+        if (it == sessions.end()) {
+            continue;
         }
-        else {
-            ServerFunc::undef(fd, command);
+        if (--sessionsPerIp[it->second] <= 0) {
+            sessionsPerIp.erase(it->second);
         }
+        sessions.erase(it);
+        SessionTokens::detach(pid);
+        fprintf(stdout, "Child Process %d terminated, %d session(s) active\n",
+                static_cast<int>(pid), static_cast<int>(sessions.size()));
+    }
+}
+
+// greet the client with its session token, or turn it away before forking
+// when over capacity
+bool admitSession(const int& fd, const in_addr_t& ip, const ServerConfig& config,
+                  const std::map<pid_t, in_addr_t>& sessions, const std::map<in_addr_t, int>& sessionsPerIp,
+                  int& tokenSlot) {
+    tokenSlot = -1;
+    char buffer[maxn];
+    memset(buffer, 0, sizeof(buffer));
+    std::map<in_addr_t, int>::const_iterator it = sessionsPerIp.find(ip);
+    if (config.maxSessions > 0 && static_cast<int>(sessions.size()) >= config.maxSessions) {
+        sprintf(buffer, "SERVER_BUSY max sessions reached (%d)", config.maxSessions);
+    }
+    else if (config.maxPerIp > 0 && it != sessionsPerIp.end() && it->second >= config.maxPerIp) {
+        sprintf(buffer, "SERVER_BUSY too many sessions from your address (%d)", config.maxPerIp);
+    }
+    else {
+        std::string token = SessionTokens::issue(tokenSlot);
+        sprintf(buffer, token != "" ? "WELCOME token = %s" : "WELCOME", token.c_str());
+    }
+    bool admitted = !strncmp(buffer, "WELCOME", strlen("WELCOME"));
+    if (!admitted) {
+        in_addr addr;
+        addr.s_addr = ip;
+        fprintf(stdout, "Rejected %s: %s\n", inet_ntoa(addr), buffer + strlen("SERVER_BUSY "));
     }
+    if (write(fd, buffer, maxn) < 0) {
+        SessionTokens::release(tokenSlot);
+        return false;
+    }
+    return admitted;
+}
+
+void TCPServer(const int& fd, const ServerConfig& config) {
+    if (config.ioTimeout > 0) {
+        timeval tv;
+        tv.tv_sec = config.ioTimeout;
+        tv.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    Transport conn(fd);
+    Session session(conn, config);
+    SessionTokens::setCwd(session.wd.getPath());
+    if (config.recordDir != "") {
+        SessionRecorder::start(config.recordDir);
+    }
+    char buffer[maxn];
+    while (!session.quit && ServerFunc::nextCommand(conn, config.idleTimeout, buffer)) {
+        Dispatcher::dispatch(session, buffer);
+    }
+    conn.flush();
+    SessionRecorder::finish(conn);
 }
 
 void trimNewLine(char* str) {
@@ -544,13 +3028,26 @@ std::string toLowerString(const std::string& src) {
     return ret;
 }
 
+// children are reaped by reapChildren() in the accept loop, the handler only
+// has to interrupt accept()
 void sigChld(int signo) {
-    pid_t pid;
-    int stat;
-    while ((pid = waitpid(-1, &stat, WCONTINUED)) != -1) {
-        std::string buffer = "Child Process " + std::to_string(static_cast<int>(pid)) + " terminated.\n";
-        if (write(fileno(stdout), buffer.c_str(), buffer.length()) < 0) {
-            exit(EXIT_FAILURE);
+    childExited = 1;
+}
+
+// the accept loop forwards the request to every session, a session dumps at
+// its next command boundary
+void sigUsr2(int signo) {
+    Trace::requestDump();
+}
+
+void forwardTraceRequest(const std::map<pid_t, in_addr_t>& sessions) {
+    if (Trace::takeDumpRequest()) {
+        for (const auto& session : sessions) {
+            kill(session.first, SIGUSR2);
         }
     }
 }
+
+void sigHup(int signo) {
+    restartRequested = 1;
+}
@@ -0,0 +1,99 @@
+#include "sessionlog.h"
+
+#include <cstring>
+
+namespace {
+
+const char magic[8] = { 'B', 'I', 'R', 'D', 'L', 'O', 'G', '1' };
+
+} // namespace
+
+bool SessionLog::create(const std::string& path, const uint64_t& startUs) {
+    close();
+    fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+    // records are small, let them gather before they hit the disk
+    setvbuf(fp, nullptr, _IOFBF, 64 << 10);
+    fwrite(magic, 1, sizeof(magic), fp);
+    put(startUs);
+    last = 0;
+    return true;
+}
+
+void SessionLog::append(const Record& record) {
+    if (!fp) {
+        return;
+    }
+    fputc(record.kind, fp);
+    put(record.at - last);
+    put(record.idle);
+    put(record.payload);
+    put(record.sent);
+    put(record.text.length());
+    fwrite(record.text.data(), 1, record.text.length(), fp);
+    last = record.at;
+}
+
+void SessionLog::close() {
+    if (fp) {
+        fclose(fp);
+        fp = nullptr;
+    }
+}
+
+bool SessionLog::load(const std::string& path, uint64_t& startUs, std::vector<Record>& records) {
+    FILE* in = fopen(path.c_str(), "rb");
+    if (!in) {
+        return false;
+    }
+    char header[sizeof(magic)];
+    bool ok = fread(header, 1, sizeof(header), in) == sizeof(header) && !memcmp(header, magic, sizeof(magic)) &&
+              get(in, startUs);
+    records.clear();
+    uint64_t at = 0;
+    int kind;
+    while (ok && (kind = fgetc(in)) != EOF) {
+        Record record;
+        uint64_t delta = 0, length = 0;
+        record.kind = static_cast<char>(kind);
+        ok = (kind == command || kind == reply || kind == end) && get(in, delta) && get(in, record.idle) &&
+             get(in, record.payload) && get(in, record.sent) && get(in, length) && length < (1u << 20);
+        if (ok) {
+            record.text.resize(length);
+            ok = fread(&record.text[0], 1, length, in) == length;
+        }
+        at += delta;
+        record.at = at;
+        // a session cut short (the server killed) may end in a torn record
+        if (ok) {
+            records.push_back(record);
+        }
+    }
+    fclose(in);
+    return !records.empty() || ok;
+}
+
+void SessionLog::put(uint64_t value) {
+    while (value >= 0x80) {
+        fputc(static_cast<int>(value & 0x7f) | 0x80, fp);
+        value >>= 7;
+    }
+    fputc(static_cast<int>(value), fp);
+}
+
+bool SessionLog::get(FILE* fp, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(fp);
+        if (byte == EOF) {
+            return false;
+        }
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,58 @@
+#ifndef SESSIONLOG_H
+#define SESSIONLOG_H
+
+// Compact binary capture of one session's protocol exchange, written by the
+// server with -record and re-driven by the replay tool.
+//
+// Every control message the server reads is one record: whether it started a
+// command or answered the server within one, when it arrived, how long the
+// server had been waiting for it, how many payload bytes the server consumed
+// and how many bytes it sent since the previous record, and the message text.
+// File data itself is not kept, only its size, so a log of a 10GB upload is a
+// few bytes.  A final record counts what followed the last message.
+//
+// The file is "BIRDLOG1", the session start (µs since the epoch) and the
+// records, all numbers as LEB128 varints, times in µs relative to the
+// previous record.
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+class SessionLog {
+public:
+    // record kinds
+    static constexpr char command = 'C', reply = 'R', end = 'E';
+    struct Record {
+        char kind;
+        uint64_t at;        // µs since the session started
+        uint64_t idle;      // µs the server spent waiting for this message
+        uint64_t payload;   // data bytes the server consumed since the previous record
+        uint64_t sent;      // bytes the server sent since the previous record
+        std::string text;   // the message up to its padding, empty for end
+    };
+
+public:
+    SessionLog() : fp(nullptr), last(0) {}
+    ~SessionLog() {
+        close();
+    }
+    bool create(const std::string& path, const uint64_t& startUs);
+    void append(const Record& record);
+    void close();
+    // the whole log at path, false when it is not one
+    static bool load(const std::string& path, uint64_t& startUs, std::vector<Record>& records);
+    SessionLog(const SessionLog&) = delete;
+    SessionLog& operator=(const SessionLog&) = delete;
+
+private:
+    FILE* fp;
+    uint64_t last;  // at of the previous record
+
+private:
+    void put(uint64_t value);
+    static bool get(FILE* fp, uint64_t& value);
+};
+
+#endif // SESSIONLOG_H
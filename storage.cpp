@@ -0,0 +1,739 @@
+#include "storage.h"
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <mutex>
+
+namespace {
+
+constexpr size_t maxMessage = 64 << 10;
+constexpr size_t listChunk = 32 << 10;
+
+class PosixStorage : public StorageBackend {
+public:
+    int stat(const std::string& path, struct stat& st) override {
+        return ::lstat(path.c_str(), &st);
+    }
+    int list(const std::string& dir, std::vector<std::string>& names) override {
+        names.clear();
+        DIR* dp = opendir(dir.c_str());
+        if (!dp) {
+            return -1;
+        }
+        dirent* dirst;
+        while ((dirst = readdir(dp))) {
+            if (!strcmp(dirst->d_name, ".") || !strcmp(dirst->d_name, "..")) {
+                continue;
+            }
+            std::string name = dirst->d_name;
+            bool isDir = dirst->d_type == DT_DIR;
+            if (dirst->d_type == DT_UNKNOWN) {
+                struct stat st;
+                std::string path = dir == "/" ? "/" + name : dir + "/" + name;
+                isDir = ::lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+            }
+            names.push_back(isDir ? name + "/" : name);
+        }
+        closedir(dp);
+        return 0;
+    }
+    int openRead(const std::string& path) override {
+        return ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    int openWrite(const std::string& path, const int& flags, const mode_t& mode) override {
+        return ::open(path.c_str(), O_RDWR | O_CLOEXEC | (flags & (O_CREAT | O_EXCL | O_TRUNC)), mode);
+    }
+    int openTemp(std::string& templ) override {
+        int fd = mkostemp(&templ[0], O_CLOEXEC);
+        if (fd >= 0) {
+            // mkstemp() creates 0600, the file should end up as any other upload
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0666 & ~mask);
+        }
+        return fd;
+    }
+    int rename(const std::string& from, const std::string& to) override {
+        return ::rename(from.c_str(), to.c_str());
+    }
+    int remove(const std::string& path) override {
+        return ::unlink(path.c_str());
+    }
+    int makeDir(const std::string& path) override {
+        return ::mkdir(path.c_str(), 0777);
+    }
+    int changeDir(const std::string& path) override {
+        return ::chdir(path.c_str());
+    }
+    std::string currentDir() override {
+        char buffer[PATH_MAX];
+        return getcwd(buffer, sizeof(buffer)) ? buffer : "";
+    }
+    bool onDisk() const override {
+        return true;
+    }
+};
+
+// One message with an optional descriptor, sent whole on a SOCK_SEQPACKET socket.
+bool sendMessage(const int& fd, const std::string& text, const int& passFd = -1) {
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    iovec iov;
+    iov.iov_base = const_cast<char*>(text.data());
+    iov.iov_len = text.length();
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (passFd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+    }
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == static_cast<ssize_t>(text.length());
+}
+
+// false on EOF or an error; passFd, when given, is -1 unless a descriptor came along
+bool receiveMessage(const int& fd, std::string& text, int* passFd = nullptr) {
+    char buffer[maxMessage];
+    char control[CMSG_SPACE(sizeof(int))];
+    iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = sizeof(buffer);
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (passFd) {
+        *passFd = -1;
+    }
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); n >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int received;
+            memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+            if (passFd) {
+                *passFd = received;
+            }
+            else {
+                close(received);
+            }
+        }
+    }
+    if (n <= 0) {
+        return false;
+    }
+    text.assign(buffer, n);
+    return true;
+}
+
+// Requests are the operation and its arguments separated by NULs:
+//   S path              "0 <mode> <size> <sec> <nsec> <dev> <ino>"
+//   L dir               "0 <chunks>", then chunks of names, one per line
+//   R path              "0" with the file
+//   W flags path        "0" with the file
+//   N from to, U path, M path   "0"
+// A failure is the errno value alone.  Paths are absolute and normalized.
+class MemoryStore {
+public:
+    MemoryStore() : nextInode(1) {
+        Node root;
+        root.dir = true;
+        root.fd = -1;
+        root.inode = nextInode++;
+        clock_gettime(CLOCK_REALTIME, &root.mtime);
+        nodes["/"] = root;
+    }
+    // serve until every session and the server are gone
+    void run(const int& hub) {
+        std::vector<pollfd> fds(1);
+        fds[0].fd = hub;
+        fds[0].events = POLLIN;
+        while (true) {
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            for (size_t i = fds.size() - 1; i > 0; --i) {
+                if (!fds[i].revents) {
+                    continue;
+                }
+                std::string request;
+                if (!receiveMessage(fds[i].fd, request) || !handle(fds[i].fd, request)) {
+                    close(fds[i].fd);
+                    fds.erase(fds.begin() + i);
+                }
+            }
+            if (fds[0].revents) {
+                // a new channel, its other end stays with the session
+                std::string hello;
+                int channel;
+                if (!receiveMessage(hub, hello, &channel)) {
+                    break;
+                }
+                if (channel >= 0) {
+                    pollfd pfd;
+                    pfd.fd = channel;
+                    pfd.events = POLLIN;
+                    fds.push_back(pfd);
+                }
+            }
+        }
+    }
+
+private:
+    struct Node {
+        bool dir;
+        int fd;             // memfd of a file
+        ino_t inode;        // of a directory, a file has its memfd's
+        timespec mtime;     // of a directory
+    };
+
+private:
+    std::map<std::string, Node> nodes;
+    ino_t nextInode;
+
+private:
+    bool handle(const int& channel, const std::string& request) {
+        std::vector<std::string> args;
+        size_t start = 1;
+        while (start <= request.length()) {
+            size_t end = request.find('\0', start);
+            end = end == std::string::npos ? request.length() : end;
+            args.push_back(request.substr(start, end - start));
+            start = end + 1;
+        }
+        char op = request.empty() ? '\0' : request[0];
+        int error = EINVAL;
+        if (op == 'S' && args.size() == 1) {
+            return stat(channel, args[0]);
+        }
+        else if (op == 'L' && args.size() == 1) {
+            return list(channel, args[0]);
+        }
+        else if ((op == 'R' && args.size() == 1) || (op == 'W' && args.size() == 2)) {
+            int fd = -1;
+            error = op == 'R' ? openRead(args[0], fd) : openWrite(atoi(args[0].c_str()), args[1], fd);
+            if (!error) {
+                return sendMessage(channel, "0", fd);
+            }
+        }
+        else if (op == 'N' && args.size() == 2) {
+            error = rename(args[0], args[1]);
+        }
+        else if (op == 'U' && args.size() == 1) {
+            error = remove(args[0]);
+        }
+        else if (op == 'M' && args.size() == 1) {
+            error = makeDir(args[0]);
+        }
+        return sendMessage(channel, std::to_string(error));
+    }
+    bool stat(const int& channel, const std::string& path) {
+        std::map<std::string, Node>::iterator it = nodes.find(path);
+        if (it == nodes.end()) {
+            return sendMessage(channel, std::to_string(ENOENT));
+        }
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        if (it->second.dir) {
+            st.st_mode = S_IFDIR | 0755;
+            st.st_ino = it->second.inode;
+            st.st_mtim = it->second.mtime;
+        }
+        else if (fstat(it->second.fd, &st) < 0) {
+            return sendMessage(channel, std::to_string(errno));
+        }
+        char reply[256];
+        snprintf(reply, sizeof(reply), "0 %u %lld %lld %ld %llu %llu", static_cast<unsigned>(st.st_mode),
+                 static_cast<long long>(st.st_size), static_cast<long long>(st.st_mtim.tv_sec), st.st_mtim.tv_nsec,
+                 static_cast<unsigned long long>(st.st_dev), static_cast<unsigned long long>(st.st_ino));
+        return sendMessage(channel, reply);
+    }
+    bool list(const int& channel, const std::string& dir) {
+        std::map<std::string, Node>::iterator it = nodes.find(dir);
+        if (it == nodes.end() || !it->second.dir) {
+            return sendMessage(channel, std::to_string(it == nodes.end() ? ENOENT : ENOTDIR));
+        }
+        // the children are the keys right after dir + "/" without a further "/"
+        const std::string prefix = dir == "/" ? "/" : dir + "/";
+        std::vector<std::string> chunks(1);
+        for (it = nodes.upper_bound(prefix); it != nodes.end() && it->first.compare(0, prefix.length(), prefix) == 0;
+             ++it) {
+            std::string name = it->first.substr(prefix.length());
+            if (name.find('/') != std::string::npos) {
+                continue;
+            }
+            if (chunks.back().length() + name.length() + 2 > listChunk) {
+                chunks.push_back("");
+            }
+            chunks.back() += name + (it->second.dir ? "/\n" : "\n");
+        }
+        if (chunks.back().empty()) {
+            chunks.pop_back();
+        }
+        bool ok = sendMessage(channel, "0 " + std::to_string(chunks.size()));
+        for (size_t i = 0; ok && i < chunks.size(); ++i) {
+            ok = sendMessage(channel, chunks[i]);
+        }
+        return ok;
+    }
+    int openRead(const std::string& path, int& fd) {
+        std::map<std::string, Node>::iterator it = nodes.find(path);
+        if (it == nodes.end()) {
+            return ENOENT;
+        }
+        if (it->second.dir) {
+            return EISDIR;
+        }
+        fd = it->second.fd;
+        return 0;
+    }
+    int openWrite(const int& flags, const std::string& path, int& fd) {
+        std::map<std::string, Node>::iterator it = nodes.find(path);
+        if (it != nodes.end()) {
+            if (it->second.dir) {
+                return EISDIR;
+            }
+            if ((flags & O_CREAT) && (flags & O_EXCL)) {
+                return EEXIST;
+            }
+            if ((flags & O_TRUNC) && ftruncate(it->second.fd, 0) < 0) {
+                return errno;
+            }
+            fd = it->second.fd;
+            return 0;
+        }
+        if (!(flags & O_CREAT)) {
+            return ENOENT;
+        }
+        int error = parentError(path);
+        if (error) {
+            return error;
+        }
+        Node file;
+        file.dir = false;
+        file.fd = memfd_create(path.substr(path.rfind('/') + 1, 200).c_str(), MFD_CLOEXEC);
+        if (file.fd < 0) {
+            return errno;
+        }
+        file.inode = 0;
+        nodes[path] = file;
+        touchParent(path);
+        fd = file.fd;
+        return 0;
+    }
+    int rename(const std::string& from, const std::string& to) {
+        std::map<std::string, Node>::iterator source = nodes.find(from);
+        if (source == nodes.end()) {
+            return ENOENT;
+        }
+        if (from == "/" || to == "/") {
+            return EBUSY;
+        }
+        if (from == to) {
+            return 0;
+        }
+        if (to.compare(0, from.length() + 1, from + "/") == 0) {
+            return EINVAL;
+        }
+        int error = parentError(to);
+        if (error) {
+            return error;
+        }
+        std::map<std::string, Node>::iterator target = nodes.find(to);
+        if (target != nodes.end()) {
+            if (source->second.dir && !target->second.dir) {
+                return ENOTDIR;
+            }
+            if (!source->second.dir && target->second.dir) {
+                return EISDIR;
+            }
+            if (target->second.dir && hasChildren(to)) {
+                return ENOTEMPTY;
+            }
+            if (!target->second.dir) {
+                close(target->second.fd);
+            }
+            nodes.erase(target);
+        }
+        // a directory takes its whole subtree along
+        std::vector<std::pair<std::string, Node>> moved;
+        moved.push_back(std::make_pair(to, source->second));
+        nodes.erase(source);
+        if (moved.front().second.dir) {
+            const std::string prefix = from + "/";
+            std::map<std::string, Node>::iterator it = nodes.lower_bound(prefix);
+            while (it != nodes.end() && it->first.compare(0, prefix.length(), prefix) == 0) {
+                moved.push_back(std::make_pair(to + it->first.substr(from.length()), it->second));
+                it = nodes.erase(it);
+            }
+        }
+        nodes.insert(moved.begin(), moved.end());
+        touchParent(from);
+        touchParent(to);
+        return 0;
+    }
+    int remove(const std::string& path) {
+        std::map<std::string, Node>::iterator it = nodes.find(path);
+        if (it == nodes.end()) {
+            return ENOENT;
+        }
+        if (it->second.dir) {
+            return EISDIR;
+        }
+        // sessions that have it open keep their own descriptors
+        close(it->second.fd);
+        nodes.erase(it);
+        touchParent(path);
+        return 0;
+    }
+    int makeDir(const std::string& path) {
+        if (nodes.count(path)) {
+            return EEXIST;
+        }
+        int error = parentError(path);
+        if (error) {
+            return error;
+        }
+        Node dir;
+        dir.dir = true;
+        dir.fd = -1;
+        dir.inode = nextInode++;
+        clock_gettime(CLOCK_REALTIME, &dir.mtime);
+        nodes[path] = dir;
+        touchParent(path);
+        return 0;
+    }
+    static std::string parentOf(const std::string& path) {
+        size_t pos = path.rfind('/');
+        return pos == 0 ? "/" : path.substr(0, pos);
+    }
+    int parentError(const std::string& path) {
+        std::map<std::string, Node>::iterator parent = nodes.find(parentOf(path));
+        return parent == nodes.end() ? ENOENT : !parent->second.dir ? ENOTDIR : 0;
+    }
+    bool hasChildren(const std::string& dir) {
+        std::map<std::string, Node>::iterator it = nodes.upper_bound(dir + "/");
+        return it != nodes.end() && it->first.compare(0, dir.length() + 1, dir + "/") == 0;
+    }
+    void touchParent(const std::string& path) {
+        std::map<std::string, Node>::iterator parent = nodes.find(parentOf(path));
+        if (parent != nodes.end()) {
+            clock_gettime(CLOCK_REALTIME, &parent->second.mtime);
+        }
+    }
+};
+
+class MemoryStorage : public StorageBackend {
+public:
+    MemoryStorage() : hub(-1), channel(-1), channelPid(0), cwd("/") {}
+    void start() {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+            fprintf(stderr, "socketpair Error: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "fork() Error: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            close(sv[0]);
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            signal(SIGPIPE, SIG_IGN);
+            MemoryStore().run(sv[1]);
+            exit(EXIT_SUCCESS);
+        }
+        close(sv[1]);
+        hub = sv[0];
+    }
+    int stat(const std::string& path, struct stat& st) override {
+        std::string reply;
+        if (request({"S", resolve(path)}, reply) < 0) {
+            return -1;
+        }
+        unsigned mode;
+        long long size, sec;
+        long nsec;
+        unsigned long long dev, ino;
+        if (sscanf(reply.c_str(), "0 %u %lld %lld %ld %llu %llu", &mode, &size, &sec, &nsec, &dev, &ino) != 6) {
+            errno = EIO;
+            return -1;
+        }
+        memset(&st, 0, sizeof(st));
+        st.st_mode = mode;
+        st.st_nlink = 1;
+        st.st_uid = getuid();
+        st.st_gid = getgid();
+        st.st_size = size;
+        st.st_blksize = 4096;
+        st.st_blocks = (size + 511) / 512;
+        st.st_mtim.tv_sec = sec;
+        st.st_mtim.tv_nsec = nsec;
+        st.st_ctim = st.st_mtim;
+        st.st_atim = st.st_mtim;
+        st.st_dev = dev;
+        st.st_ino = ino;
+        return 0;
+    }
+    int list(const std::string& dir, std::vector<std::string>& names) override {
+        names.clear();
+        std::lock_guard<std::mutex> guard(lock);
+        std::string reply;
+        int chunks = 0;
+        if (exchange({"L", resolve(dir)}, reply, nullptr) < 0 || sscanf(reply.c_str(), "0 %d", &chunks) != 1) {
+            return -1;
+        }
+        for (int i = 0; i < chunks; ++i) {
+            if (!receiveMessage(channel, reply)) {
+                errno = EIO;
+                return -1;
+            }
+            size_t start = 0, end;
+            while ((end = reply.find('\n', start)) != std::string::npos) {
+                names.push_back(reply.substr(start, end - start));
+                start = end + 1;
+            }
+        }
+        return 0;
+    }
+    int openRead(const std::string& path) override {
+        std::string reply;
+        int fd;
+        if (request({"R", resolve(path)}, reply, &fd) < 0) {
+            return -1;
+        }
+        return reopen(fd, O_RDONLY);
+    }
+    int openWrite(const std::string& path, const int& flags, const mode_t&) override {
+        std::string reply;
+        int fd;
+        if (request({"W", std::to_string(flags & (O_CREAT | O_EXCL | O_TRUNC)), resolve(path)}, reply, &fd) < 0) {
+            return -1;
+        }
+        return reopen(fd, O_RDWR);
+    }
+    int openTemp(std::string& templ) override {
+        size_t pos = templ.length() < 6 ? std::string::npos : templ.length() - 6;
+        if (pos == std::string::npos || templ.compare(pos, 6, "XXXXXX") != 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+        unsigned long seed = static_cast<unsigned long>(getpid()) * 2654435761ul ^ time(nullptr);
+        for (int attempt = 0; attempt < 100; ++attempt) {
+            seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+            for (int i = 0; i < 6; ++i) {
+                templ[pos + i] = letters[(seed >> (16 + 5 * i)) % (sizeof(letters) - 1)];
+            }
+            int fd = openWrite(templ, O_CREAT | O_EXCL, 0600);
+            if (fd >= 0 || errno != EEXIST) {
+                return fd;
+            }
+        }
+        return -1;
+    }
+    int rename(const std::string& from, const std::string& to) override {
+        std::string reply;
+        return request({"N", resolve(from), resolve(to)}, reply);
+    }
+    int remove(const std::string& path) override {
+        std::string reply;
+        return request({"U", resolve(path)}, reply);
+    }
+    int makeDir(const std::string& path) override {
+        std::string reply;
+        return request({"M", resolve(path)}, reply);
+    }
+    int changeDir(const std::string& path) override {
+        struct stat st;
+        if (stat(path, st) < 0) {
+            return -1;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            errno = ENOTDIR;
+            return -1;
+        }
+        std::string resolved = resolve(path);
+        std::lock_guard<std::mutex> guard(cwdLock);
+        cwd = resolved;
+        return 0;
+    }
+    std::string currentDir() override {
+        std::lock_guard<std::mutex> guard(cwdLock);
+        return cwd;
+    }
+    bool onDisk() const override {
+        return false;
+    }
+
+private:
+    int hub;            // to the store, shared by every process of the server
+    int channel;        // this process's own connection to the store
+    pid_t channelPid;   // channel was opened by this process, not inherited
+    std::string cwd;
+    std::mutex cwdLock;
+    std::mutex lock;    // one request at a time on channel, find walks with several threads
+
+private:
+    // absolute, without ".", ".." and empty components
+    std::string resolve(const std::string& path) {
+        std::string base;
+        if (path.empty() || path[0] != '/') {
+            std::lock_guard<std::mutex> guard(cwdLock);
+            base = cwd;
+        }
+        std::vector<std::string> parts;
+        std::string whole = base + "/" + path;
+        size_t start = 0;
+        while (start < whole.length()) {
+            size_t end = whole.find('/', start);
+            end = end == std::string::npos ? whole.length() : end;
+            std::string part = whole.substr(start, end - start);
+            if (part == "..") {
+                if (!parts.empty()) {
+                    parts.pop_back();
+                }
+            }
+            else if (part != "" && part != ".") {
+                parts.push_back(part);
+            }
+            start = end + 1;
+        }
+        std::string resolved;
+        for (const std::string& part : parts) {
+            resolved += "/" + part;
+        }
+        return resolved.empty() ? "/" : resolved;
+    }
+    int request(const std::vector<std::string>& fields, std::string& reply, int* fd = nullptr) {
+        std::lock_guard<std::mutex> guard(lock);
+        return exchange(fields, reply, fd);
+    }
+    // caller holds lock; -1 with errno set unless the reply starts with "0"
+    int exchange(const std::vector<std::string>& fields, std::string& reply, int* fd) {
+        if (!connect()) {
+            return -1;
+        }
+        std::string message = fields[0];
+        for (size_t i = 1; i < fields.size(); ++i) {
+            message += (i == 1 ? "" : std::string(1, '\0')) + fields[i];
+        }
+        int passed = -1;
+        if (!sendMessage(channel, message) || !receiveMessage(channel, reply, &passed)) {
+            errno = EIO;
+            return -1;
+        }
+        int error = atoi(reply.c_str());
+        if (fd) {
+            *fd = passed;
+        }
+        else if (passed >= 0) {
+            close(passed);
+        }
+        if (error) {
+            errno = error;
+            return -1;
+        }
+        return 0;
+    }
+    // a channel of our own; one inherited from the parent process is its, not ours
+    bool connect() {
+        if (channel >= 0 && channelPid == getpid()) {
+            return true;
+        }
+        if (channel >= 0) {
+            close(channel);
+            channel = -1;
+        }
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+            return false;
+        }
+        bool sent = sendMessage(hub, "C", sv[1]);
+        close(sv[1]);
+        if (!sent) {
+            close(sv[0]);
+            errno = EIO;
+            return false;
+        }
+        channel = sv[0];
+        channelPid = getpid();
+        return true;
+    }
+    // the store's descriptor shares its file offset with every other opener,
+    // a new open of the same memfd has its own
+    static int reopen(const int& passed, const int& flags) {
+        if (passed < 0) {
+            errno = EIO;
+            return -1;
+        }
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", passed);
+        int fd = ::open(path, flags | O_CLOEXEC);
+        int saved = errno;
+        close(passed);
+        errno = saved;
+        return fd;
+    }
+};
+
+StorageBackend* selected = nullptr;
+
+} // namespace
+
+bool StorageBackend::select(const std::string& type) {
+    if (type == "posix") {
+        selected = &local();
+        return true;
+    }
+    if (type == "memory") {
+        static MemoryStorage memory;
+        memory.start();
+        selected = &memory;
+        return true;
+    }
+    return false;
+}
+
+StorageBackend& StorageBackend::get() {
+    return selected ? *selected : local();
+}
+
+StorageBackend& StorageBackend::local() {
+    static PosixStorage posix;
+    return posix;
+}
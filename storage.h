@@ -0,0 +1,59 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+// Where the server keeps its files.  Everything a session does by path goes
+// through the selected backend: stat, list, open for reading or writing,
+// rename, remove, and the session's working directory.  Opened files are
+// ordinary descriptors, so the transfer paths (sendfile, copy_file_range,
+// passing files over a Unix socket) are the same for every backend.
+//
+// posix is the local filesystem.  memory keeps the tree in RAM, to measure
+// the protocol and the network without the disk: a store process forked by
+// select() holds the namespace and one memfd per file, and sessions send it
+// requests over their own SOCK_SEQPACKET channel.  The store hands out the
+// memfd of a file with SCM_RIGHTS and the session reopens it through
+// /proc/self/fd, so every opener has its own file offset while the data is
+// written and read in place.  The tree lives as long as the server.
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+class StorageBackend {
+public:
+    // "posix" or "memory"; memory starts its store process, so this comes
+    // before the first session is forked.  false for an unknown type.
+    static bool select(const std::string& type);
+    // the selected backend, posix unless select() chose another
+    static StorageBackend& get();
+    // the local filesystem, whatever was selected
+    static StorageBackend& local();
+
+public:
+    virtual ~StorageBackend() {}
+    // the calls below return -1 with errno set on failure, like the POSIX
+    // calls they stand for; relative paths start at currentDir()
+    // lstat() of path
+    virtual int stat(const std::string& path, struct stat& st) = 0;
+    // names in dir without "." and "..", directories end in "/"
+    virtual int list(const std::string& dir, std::vector<std::string>& names) = 0;
+    // a new descriptor for reading
+    virtual int openRead(const std::string& path) = 0;
+    // a new descriptor for reading and writing, flags from O_CREAT, O_EXCL, O_TRUNC
+    virtual int openWrite(const std::string& path, const int& flags, const mode_t& mode = 0666) = 0;
+    // like mkstemp(): the trailing XXXXXX of templ become a name not taken yet
+    virtual int openTemp(std::string& templ) = 0;
+    virtual int rename(const std::string& from, const std::string& to) = 0;
+    // a file, not a directory
+    virtual int remove(const std::string& path) = 0;
+    virtual int makeDir(const std::string& path) = 0;
+    virtual int changeDir(const std::string& path) = 0;
+    // absolute, empty when it cannot be determined
+    virtual std::string currentDir() = 0;
+    // paths name files of the local filesystem, which inotify and the
+    // directory fsync of a commit rely on
+    virtual bool onDisk() const = 0;
+};
+
+#endif // STORAGE_H
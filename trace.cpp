@@ -0,0 +1,194 @@
+#include "trace.h"
+
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+constexpr size_t ringCapacity = 1 << 15;   // events per thread, power of two
+
+struct TraceEvent {
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+    uint64_t arg;
+    int tid;
+};
+
+struct TraceRing {
+    TraceEvent events[ringCapacity];
+    std::atomic<size_t> head;   // advanced by dump() only
+    std::atomic<size_t> tail;   // advanced by the owning thread only
+    std::atomic<bool> owned;
+    std::atomic<unsigned long> dropped;
+    TraceRing() : head(0), tail(0), owned(true), dropped(0) {}
+};
+
+// Rings outlive their threads: an exiting thread hands its ring back, events
+// and all, and the next new thread that traces takes it over.
+std::mutex ringsLock;
+std::vector<TraceRing*> rings;
+
+struct RingOwner {
+    TraceRing* ring = nullptr;
+    int tid = 0;
+    ~RingOwner() {
+        if (ring) {
+            ring->owned.store(false, std::memory_order_release);
+        }
+    }
+};
+
+thread_local RingOwner owner;
+
+// tick to microsecond conversion, measured once when tracing is first enabled
+bool calibrated = false;
+uint64_t baseTicks = 0;
+double baseUs = 0.0;
+double ticksPerUs = 1000.0;
+
+uint64_t monotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+void calibrate() {
+    if (calibrated) {
+        return;
+    }
+    uint64_t ticks = Trace::now(), ns = monotonicNs();
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t endNs = ns;
+    while ((endNs = monotonicNs()) < ns + 2000000) {
+        continue;
+    }
+    ticksPerUs = (Trace::now() - ticks) / ((endNs - ns) / 1000.0);
+#endif
+    baseTicks = ticks;
+    baseUs = ns / 1000.0;
+    calibrated = true;
+}
+
+// a forked child keeps only the calling thread: its cached tid is stale and
+// the rings of the other threads have no owner any more
+void prepareFork() {
+    ringsLock.lock();
+}
+
+void parentForked() {
+    ringsLock.unlock();
+}
+
+void childForked() {
+    for (TraceRing* ring : rings) {
+        if (ring != owner.ring) {
+            ring->owned.store(false, std::memory_order_relaxed);
+        }
+    }
+    owner.tid = 0;
+    ringsLock.unlock();
+}
+
+TraceRing* threadRing() {
+    if (owner.ring) {
+        return owner.ring;
+    }
+    std::lock_guard<std::mutex> lock(ringsLock);
+    if (rings.empty()) {
+        pthread_atfork(prepareFork, parentForked, childForked);
+    }
+    for (TraceRing* ring : rings) {
+        bool expected = false;
+        if (ring->owned.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            owner.ring = ring;
+            return ring;
+        }
+    }
+    owner.ring = new TraceRing();
+    rings.push_back(owner.ring);
+    return owner.ring;
+}
+
+double toUs(const uint64_t& ticks) {
+    return baseUs + (static_cast<double>(ticks) - static_cast<double>(baseTicks)) / ticksPerUs;
+}
+
+} // namespace
+
+std::atomic<bool> Trace::enabled(false);
+volatile sig_atomic_t Trace::dumpRequested = 0;
+
+void Trace::enable(const bool& on) {
+    if (on) {
+        calibrate();
+    }
+    enabled.store(on, std::memory_order_relaxed);
+}
+
+uint64_t Trace::now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return monotonicNs();
+#endif
+}
+
+void Trace::record(const char* name, const uint64_t& start, const uint64_t& end, const uint64_t& arg) {
+    TraceRing* ring = threadRing();
+    if (owner.tid == 0) {
+        owner.tid = static_cast<int>(syscall(SYS_gettid));
+    }
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->head.load(std::memory_order_acquire) >= ringCapacity) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    TraceEvent& event = ring->events[tail & (ringCapacity - 1)];
+    event.name = name;
+    event.start = start;
+    event.end = end;
+    event.arg = arg;
+    event.tid = owner.tid;
+    ring->tail.store(tail + 1, std::memory_order_release);
+}
+
+long Trace::dump(const std::string& path) {
+    FILE* fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        return -1;
+    }
+    calibrate();
+    int pid = static_cast<int>(getpid());
+    long count = 0;
+    unsigned long dropped = 0;
+    fprintf(fp, "{\"traceEvents\":[\n");
+    std::lock_guard<std::mutex> lock(ringsLock);
+    for (TraceRing* ring : rings) {
+        size_t head = ring->head.load(std::memory_order_relaxed);
+        size_t tail = ring->tail.load(std::memory_order_acquire);
+        for (size_t i = head; i < tail; ++i) {
+            const TraceEvent& event = ring->events[i & (ringCapacity - 1)];
+            fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"bird\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"bytes\":%llu}}",
+                    count ? ",\n" : "", event.name, pid, event.tid, toUs(event.start),
+                    (event.end - event.start) / ticksPerUs, static_cast<unsigned long long>(event.arg));
+            ++count;
+        }
+        ring->head.store(tail, std::memory_order_release);
+        dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%lu}}\n", dropped);
+    if (fclose(fp) != 0) {
+        return -1;
+    }
+    return count;
+}
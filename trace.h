@@ -0,0 +1,79 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Hot-path tracing spans, exported as Chrome trace JSON (chrome://tracing,
+// Perfetto).
+//
+// A TraceSpan on the stack records one "complete" event, name plus start and
+// duration in TSC ticks, when its scope ends.  Every thread records into its
+// own fixed-size ring with a single producer (the thread) and a single
+// consumer (dump()), so recording takes no locks; a full ring drops new
+// events and counts them.  While tracing is disabled a span costs one
+// relaxed atomic load.
+
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <string>
+
+class Trace {
+public:
+    static bool isEnabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+    static void enable(const bool& on);
+    static uint64_t now();
+    static void record(const char* name, const uint64_t& start, const uint64_t& end, const uint64_t& arg);
+    // move everything recorded so far into a new JSON file at path; returns
+    // the number of events written, -1 when the file cannot be written
+    static long dump(const std::string& path);
+    // async-signal-safe, the owner of the session polls takeDumpRequest()
+    static void requestDump() {
+        dumpRequested = 1;
+    }
+    static bool takeDumpRequest() {
+        if (!dumpRequested) {
+            return false;
+        }
+        dumpRequested = 0;
+        return true;
+    }
+
+private:
+    static std::atomic<bool> enabled;
+    static volatile sig_atomic_t dumpRequested;
+};
+
+class TraceSpan {
+public:
+    // name must outlive the trace, a string literal in practice; arg shows up
+    // as "bytes" in the exported event
+    explicit TraceSpan(const char* name, const uint64_t& arg = 0) : name(nullptr), start(0), arg(arg) {
+        if (Trace::isEnabled()) {
+            this->name = name;
+            start = Trace::now();
+        }
+    }
+    ~TraceSpan() {
+        end();
+    }
+    // close the span before the end of its scope
+    void end() {
+        if (name) {
+            Trace::record(name, start, Trace::now(), arg);
+            name = nullptr;
+        }
+    }
+    void setArg(const uint64_t& value) {
+        arg = value;
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    const char* name;
+    uint64_t start;
+    uint64_t arg;
+};
+
+#endif // TRACE_H
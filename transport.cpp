@@ -0,0 +1,885 @@
+#include "transport.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "trace.h"
+
+namespace {
+
+constexpr unsigned long long fnvOffset = 14695981039346656037ull;
+constexpr unsigned long long fnvPrime = 1099511628211ull;
+constexpr unsigned long streamChunk = 1ul << 20;
+constexpr unsigned long streamWindow = 8ul << 20;
+constexpr unsigned long directAlign = 4096;
+constexpr size_t pipelineChunk = 1ul << 20;
+constexpr size_t pipelineDepth = 4;
+// below this a thread handoff costs more than the overlap wins
+constexpr unsigned long pipelineMin = 2ul << 20;
+// largest chunk of a chunked stream, kept under pipelineMin
+constexpr unsigned long maxChunk = 256ul << 10;
+
+void hashBytes(unsigned long long& hash, const char* buffer, const size_t& n) {
+    for (size_t i = 0; i < n; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(buffer[i])) * fnvPrime;
+    }
+}
+
+// false on a write error; the caller reports it, from the session's thread
+bool writeToFile(const int& fileFd, const char* buffer, const size_t& n) {
+    // a pipe may take less than all of it
+    for (size_t done = 0; done < n;) {
+        ssize_t written = ::write(fileFd, buffer + done, n - done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        done += written;
+    }
+    return true;
+}
+
+// n bytes from in to out of the same offsets, the kernel copies unless the
+// filesystems cannot do it between them
+bool copyRange(const int& fromFd, const int& toFd, off_t offset, size_t n) {
+    loff_t in = offset, out = offset;
+    while (n > 0) {
+        ssize_t copied = copy_file_range(fromFd, &in, toFd, &out, n, 0);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            break;
+        }
+        if (copied <= 0) {
+            return false;
+        }
+        n -= copied;
+    }
+    std::vector<char> buffer(n > 0 ? streamChunk : 0);
+    while (n > 0) {
+        ssize_t got = pread(fromFd, buffer.data(), std::min(n, buffer.size()), in);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        for (ssize_t done = 0; done < got;) {
+            ssize_t written = pwrite(toFd, buffer.data() + done, got - done, out + done);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            done += written;
+        }
+        in += got;
+        out += got;
+        n -= got;
+    }
+    return true;
+}
+
+char* alignedBuffer(const unsigned long& size) {
+    void* buffer = nullptr;
+    if (posix_memalign(&buffer, directAlign, size) != 0) {
+        fprintf(stderr, "Out of Memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return static_cast<char*>(buffer);
+}
+
+// Bounded hand-off between the disk thread and the network thread of a
+// pipelined transfer.  depth buffers circulate: the producer takes an empty
+// one, fills it and pushes it, the consumer pops it, drains it and releases
+// it, so the producer never runs more than depth buffers ahead.
+class BufferPipe {
+public:
+    struct Chunk {
+        std::vector<char> data;
+        size_t length;
+    };
+
+public:
+    BufferPipe(const size_t& depth, const size_t& size) : chunks(depth) {
+        for (Chunk& chunk : chunks) {
+            chunk.data.resize(size);
+            chunk.length = 0;
+            empty.push_back(&chunk);
+        }
+    }
+    Chunk* acquire() {
+        return take(empty);
+    }
+    void push(Chunk* chunk) {
+        give(full, chunk);
+    }
+    Chunk* pop() {
+        return take(full);
+    }
+    void release(Chunk* chunk) {
+        give(empty, chunk);
+    }
+    // either side gave up: acquire() and pop() return nullptr from now on
+    void close() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            closed = true;
+        }
+        changed.notify_all();
+    }
+
+private:
+    std::vector<Chunk> chunks;
+    std::deque<Chunk*> empty;
+    std::deque<Chunk*> full;
+    bool closed = false;
+    std::mutex lock;
+    std::condition_variable changed;
+
+private:
+    Chunk* take(std::deque<Chunk*>& from) {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [this, &from] { return !from.empty() || closed; });
+        if (closed) {
+            return nullptr;
+        }
+        Chunk* chunk = from.front();
+        from.pop_front();
+        return chunk;
+    }
+    void give(std::deque<Chunk*>& to, Chunk* chunk) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            to.push_back(chunk);
+        }
+        changed.notify_all();
+    }
+};
+
+// with a single CPU the two stages only take turns, and the hand-offs cost
+// more than the page cache reads they would hide
+bool usePipeline(const unsigned long& size) {
+    static const bool multiCore = std::thread::hardware_concurrency() > 1;
+    return multiCore && size >= pipelineMin;
+}
+
+size_t roundUpPower(const size_t& n) {
+    size_t ret = 1;
+    while (ret < n) {
+        ret <<= 1;
+    }
+    return ret;
+}
+
+} // namespace
+
+RingBuffer::RingBuffer(const size_t& capacity) : data(roundUpPower(capacity)), head(0), tail(0) {
+
+}
+
+int RingBuffer::spans(const size_t& from, const size_t& n, iovec* spans) const {
+    if (n == 0) {
+        return 0;
+    }
+    size_t mask = data.size() - 1;
+    size_t start = from & mask;
+    size_t first = std::min(n, data.size() - start);
+    spans[0].iov_base = const_cast<char*>(data.data()) + start;
+    spans[0].iov_len = first;
+    if (first == n) {
+        return 1;
+    }
+    spans[1].iov_base = const_cast<char*>(data.data());
+    spans[1].iov_len = n - first;
+    return 2;
+}
+
+int RingBuffer::dataSpans(iovec* spans) const {
+    return this->spans(head, size(), spans);
+}
+
+int RingBuffer::spaceSpans(iovec* spans) {
+    return this->spans(tail, space(), spans);
+}
+
+size_t RingBuffer::read(char* buffer, const size_t& n) {
+    iovec span[2];
+    int count = spans(head, std::min(n, size()), span);
+    size_t done = 0;
+    for (int i = 0; i < count; ++i) {
+        memcpy(buffer + done, span[i].iov_base, span[i].iov_len);
+        done += span[i].iov_len;
+    }
+    consume(done);
+    return done;
+}
+
+size_t RingBuffer::write(const char* buffer, const size_t& n) {
+    iovec span[2];
+    int count = spans(tail, std::min(n, space()), span);
+    size_t done = 0;
+    for (int i = 0; i < count; ++i) {
+        memcpy(span[i].iov_base, buffer + done, span[i].iov_len);
+        done += span[i].iov_len;
+    }
+    produce(done);
+    return done;
+}
+
+Transport::Transport(const int& fd, const size_t& bufferSize)
+    : fd(fd), input(std::max<size_t>(bufferSize, maxn)), output(std::max<size_t>(bufferSize, maxn)),
+      recoverable(false), received(0), sent(0), fdExpected(false), passed(-1) {
+
+}
+
+void Transport::reset(const int& newFd) {
+    fd = newFd;
+    input.clear();
+    output.clear();
+    progress = nullptr;
+    expectFd(false);
+}
+
+void Transport::lost(const std::string& what) {
+    if (recoverable) {
+        throw ConnectionLost(what);
+    }
+    fprintf(stderr, "%s\n", what.c_str());
+    exit(EXIT_FAILURE);
+}
+
+bool Transport::readMessage(char* buffer) {
+    flush();
+    while (input.size() < static_cast<size_t>(maxn)) {
+        if (fill() == 0) {
+            return false;
+        }
+    }
+    input.read(buffer, maxn);
+    return true;
+}
+
+void Transport::writeMessage(const char* buffer) {
+    write(buffer, maxn);
+}
+
+bool Transport::isLocal() const {
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    return getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0 && addr.ss_family == AF_UNIX;
+}
+
+void Transport::writeMessage(const char* buffer, const int& passFd) {
+    // the descriptor rides on the message's first byte, which must not be queued behind others
+    flush();
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    iovec iov;
+    iov.iov_base = const_cast<char*>(buffer);
+    iov.iov_len = maxn;
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        fail("sendmsg()");
+    }
+    sent += n;
+    if (n < maxn) {
+        writeAll(buffer + n, maxn - n);
+    }
+}
+
+void Transport::expectFd(const bool& expect) {
+    fdExpected = expect;
+    if (!expect && passed >= 0) {
+        close(passed);
+        passed = -1;
+    }
+}
+
+int Transport::takeFd() {
+    int passedFd = passed;
+    passed = -1;
+    return passedFd;
+}
+
+void Transport::flush() {
+    if (output.size() == 0) {
+        return;
+    }
+    TraceSpan span("socket writev", output.size());
+    while (output.size() > 0) {
+        iovec spans[2];
+        int count = output.dataSpans(spans);
+        ssize_t n = writev(fd, spans, count);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fail("write()");
+        }
+        output.consume(n);
+        sent += n;
+    }
+}
+
+void Transport::readExact(char* buffer, const size_t& n) {
+    size_t done = 0;
+    while (done < n) {
+        if (input.size() == 0 && fill() == 0) {
+            lost("Error When Receiving Data");
+        }
+        done += input.read(buffer + done, n - done);
+    }
+}
+
+void Transport::write(const char* buffer, const size_t& n) {
+    if (n > output.space()) {
+        flush();
+    }
+    if (n > output.space()) {
+        writeAll(buffer, n);
+        return;
+    }
+    output.write(buffer, n);
+}
+
+void Transport::writeFile(FILE* fp, const unsigned long& size) {
+    if (usePipeline(size)) {
+        pipelinedWriteFile(fp, size);
+        return;
+    }
+    int fileFd = fileno(fp);
+    unsigned long byteRead = 0u;
+    while (byteRead < size) {
+        if (output.space() == 0) {
+            flush();
+        }
+        // read straight into the free space of the output ring
+        iovec spans[2];
+        output.spaceSpans(spans);
+        TraceSpan span("file read");
+        ssize_t n = ::read(fileFd, spans[0].iov_base, std::min<unsigned long>(spans[0].iov_len, size - byteRead));
+        span.setArg(std::max<ssize_t>(n, 0));
+        if (n <= 0) {
+            fprintf(stderr, "Error When Reading File\n");
+            exit(EXIT_FAILURE);
+        }
+        output.produce(n);
+        byteRead += n;
+        advance(n);
+    }
+}
+
+void Transport::readFile(FILE* fp, const unsigned long& size, unsigned long long* hash) {
+    if (usePipeline(size)) {
+        pipelinedReadFile(fp, size, hash);
+        return;
+    }
+    int fileFd = fileno(fp);
+    unsigned long byteWrite = 0u;
+    unsigned long long h = fnvOffset;
+    while (byteWrite < size) {
+        if (input.size() == 0 && fill() == 0) {
+            lost("Error When Receiving Data");
+        }
+        iovec spans[2];
+        int count = input.dataSpans(spans);
+        for (int i = 0; i < count && byteWrite < size; ++i) {
+            size_t n = std::min<unsigned long>(spans[i].iov_len, size - byteWrite);
+            if (hash) {
+                hashBytes(h, static_cast<char*>(spans[i].iov_base), n);
+            }
+            TraceSpan span("file write", n);
+            if (!writeToFile(fileFd, static_cast<char*>(spans[i].iov_base), n)) {
+                fprintf(stderr, "Error When Writing to File\n");
+                exit(EXIT_FAILURE);
+            }
+            input.consume(n);
+            byteWrite += n;
+            advance(n);
+        }
+    }
+    if (hash) {
+        *hash = h;
+    }
+}
+
+void Transport::pipelinedWriteFile(FILE* fp, const unsigned long& size) {
+    // queued control messages go out ahead of the data
+    flush();
+    int fileFd = fileno(fp);
+    BufferPipe pipe(pipelineDepth, pipelineChunk);
+    // the reader only closes the pipe on a file error, exit() from it would
+    // tear the process down under the session thread
+    bool fileError = false;
+    std::thread reader([&pipe, &fileError, fileFd, size] {
+        unsigned long pos = 0;
+        while (pos < size) {
+            BufferPipe::Chunk* chunk = pipe.acquire();
+            if (!chunk) {
+                return;
+            }
+            size_t want = std::min<unsigned long>(chunk->data.size(), size - pos);
+            TraceSpan span("file read", want);
+            size_t got = 0;
+            while (got < want) {
+                ssize_t n = ::read(fileFd, chunk->data.data() + got, want - got);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    fileError = true;
+                    pipe.close();
+                    return;
+                }
+                got += n;
+            }
+            span.end();
+            chunk->length = got;
+            pos += got;
+            pipe.push(chunk);
+        }
+    });
+    unsigned long sent = 0;
+    try {
+        while (sent < size) {
+            BufferPipe::Chunk* chunk = pipe.pop();
+            if (!chunk) {
+                break;
+            }
+            writeAll(chunk->data.data(), chunk->length);
+            advance(chunk->length);
+            sent += chunk->length;
+            pipe.release(chunk);
+        }
+    }
+    catch (const ConnectionLost&) {
+        pipe.close();
+        reader.join();
+        throw;
+    }
+    reader.join();
+    if (fileError) {
+        fprintf(stderr, "Error When Reading File\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void Transport::pipelinedReadFile(FILE* fp, const unsigned long& size, unsigned long long* hash) {
+    int fileFd = fileno(fp);
+    BufferPipe pipe(pipelineDepth, pipelineChunk);
+    // as in pipelinedWriteFile, a file error closes the pipe and is reported here
+    bool fileError = false;
+    std::thread writer([&pipe, &fileError, fileFd, size, hash] {
+        unsigned long long h = fnvOffset;
+        unsigned long written = 0;
+        while (written < size) {
+            BufferPipe::Chunk* chunk = pipe.pop();
+            if (!chunk) {
+                return;
+            }
+            if (hash) {
+                hashBytes(h, chunk->data.data(), chunk->length);
+            }
+            TraceSpan span("file write", chunk->length);
+            if (!writeToFile(fileFd, chunk->data.data(), chunk->length)) {
+                fileError = true;
+                pipe.close();
+                return;
+            }
+            span.end();
+            written += chunk->length;
+            pipe.release(chunk);
+        }
+        if (hash) {
+            *hash = h;
+        }
+    });
+    unsigned long received = 0;
+    try {
+        while (received < size) {
+            BufferPipe::Chunk* chunk = pipe.acquire();
+            if (!chunk) {
+                break;
+            }
+            size_t want = std::min<unsigned long>(chunk->data.size(), size - received);
+            // whatever already sits in the input ring first, then straight from the socket
+            size_t got = input.read(chunk->data.data(), want);
+            TraceSpan span("socket read", want - got);
+            while (got < want) {
+                ssize_t n = ::read(fd, chunk->data.data() + got, want - got);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    fail("read()");
+                }
+                if (n == 0) {
+                    lost("Error When Receiving Data");
+                }
+                got += n;
+                this->received += n;
+            }
+            span.end();
+            chunk->length = got;
+            received += got;
+            advance(got);
+            pipe.push(chunk);
+        }
+    }
+    catch (const ConnectionLost&) {
+        // chunks still queued are dropped, the file ends at what the writer got to
+        pipe.close();
+        writer.join();
+        throw;
+    }
+    writer.join();
+    if (fileError) {
+        fprintf(stderr, "Error When Writing to File\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+bool Transport::isSparse(const int& fileFd) {
+    struct stat st;
+    return fstat(fileFd, &st) == 0 && static_cast<off_t>(st.st_blocks) * 512 < st.st_size;
+}
+
+bool Transport::copyFile(const int& fromFd, const int& toFd, const unsigned long& size) {
+    TraceSpan span("local copy", size);
+    struct stat st;
+    if (fstat(fromFd, &st) < 0 || static_cast<unsigned long>(st.st_size) < size) {
+        return false;
+    }
+    off_t pos = 0;
+    while (pos < static_cast<off_t>(size)) {
+        off_t data = lseek(fromFd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                break;  // only a hole up to the end
+            }
+            data = pos; // SEEK_DATA unsupported, treat the rest as data
+        }
+        off_t hole = lseek(fromFd, data, SEEK_HOLE);
+        if (hole < 0 || hole > static_cast<off_t>(size)) {
+            hole = size;
+        }
+        if (data >= hole) {
+            break;
+        }
+        if (!copyRange(fromFd, toFd, data, hole - data)) {
+            return false;
+        }
+        pos = hole;
+    }
+    // a hole at the end only exists once the size says so
+    return ftruncate(toFd, size) == 0;
+}
+
+void Transport::writeSparseFile(FILE* fp, const unsigned long& size) {
+    int fileFd = fileno(fp);
+    off_t pos = 0;
+    while (pos < static_cast<off_t>(size)) {
+        off_t data = lseek(fileFd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                break;  // only a hole up to the end
+            }
+            data = pos; // SEEK_DATA unsupported, treat the rest as data
+        }
+        off_t hole = lseek(fileFd, data, SEEK_HOLE);
+        if (hole < 0 || hole > static_cast<off_t>(size)) {
+            hole = size;
+        }
+        if (data >= hole) {
+            break;
+        }
+        writeExtentHeader(data, hole - data);
+        if (lseek(fileFd, data, SEEK_SET) < 0) {
+            fprintf(stderr, "Error When Reading File\n");
+            exit(EXIT_FAILURE);
+        }
+        writeFile(fp, hole - data);
+        pos = hole;
+    }
+    writeExtentHeader(size, 0);
+}
+
+void Transport::readSparseFile(FILE* fp, const unsigned long& size) {
+    int fileFd = fileno(fp);
+    if (ftruncate(fileFd, size) < 0) {
+        fprintf(stderr, "Error When Writing to File\n");
+        exit(EXIT_FAILURE);
+    }
+    while (true) {
+        char header[16];
+        readExact(header, 16);
+        uint64_t offset, length;
+        memcpy(&offset, header, 8);
+        memcpy(&length, header + 8, 8);
+        offset = be64toh(offset);
+        length = be64toh(length);
+        if (length == 0) {
+            break;
+        }
+        // the extent comes from the peer, offset + length may wrap
+        if (length > size || offset > size - length) {
+            fprintf(stderr, "Error When Receiving Data\n");
+            exit(EXIT_FAILURE);
+        }
+        if (lseek(fileFd, offset, SEEK_SET) < 0) {
+            fprintf(stderr, "Error When Writing to File\n");
+            exit(EXIT_FAILURE);
+        }
+        readFile(fp, length);
+    }
+}
+
+void Transport::streamWriteFile(FILE* fp, const unsigned long& size, const bool& direct) {
+    flush();
+    int fileFd = fileno(fp);
+    int flags = fcntl(fileFd, F_GETFL);
+    bool isDirect = direct && fcntl(fileFd, F_SETFL, flags | O_DIRECT) == 0;
+    char* buffer = alignedBuffer(streamChunk);
+    posix_fadvise(fileFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    unsigned long pos = 0, readahead = 0;
+    while (pos < size) {
+        if (!isDirect && readahead < size && readahead < pos + streamWindow) {
+            posix_fadvise(fileFd, readahead, streamWindow, POSIX_FADV_WILLNEED);
+            readahead += streamWindow;
+        }
+        unsigned long want = std::min(streamChunk, size - pos);
+        // O_DIRECT wants aligned lengths, a short read at EOF is fine
+        TraceSpan span("file pread");
+        ssize_t n = pread(fileFd, buffer, isDirect ? streamChunk : want, pos);
+        span.setArg(std::max<ssize_t>(n, 0));
+        if (n <= 0) {
+            fprintf(stderr, "Error When Reading File\n");
+            exit(EXIT_FAILURE);
+        }
+        n = std::min<unsigned long>(n, want);
+        writeAll(buffer, n);
+        advance(n);
+        if (!isDirect) {
+            posix_fadvise(fileFd, pos, n, POSIX_FADV_DONTNEED);
+        }
+        pos += n;
+    }
+    fcntl(fileFd, F_SETFL, flags);
+    free(buffer);
+}
+
+void Transport::streamReadFile(FILE* fp, const unsigned long& size, const bool& direct,
+                               unsigned long long* hash) {
+    int fileFd = fileno(fp);
+    int flags = fcntl(fileFd, F_GETFL);
+    bool isDirect = direct && fcntl(fileFd, F_SETFL, flags | O_DIRECT) == 0;
+    char* buffer = alignedBuffer(streamChunk);
+    unsigned long long h = fnvOffset;
+    unsigned long pos = 0;
+    while (pos < size) {
+        unsigned long want = std::min(streamChunk, size - pos);
+        // whatever already sits in the input ring first, then straight from the socket
+        unsigned long fill = input.read(buffer, want);
+        TraceSpan receive("socket read", want - fill);
+        while (fill < want) {
+            ssize_t n = ::read(fd, buffer + fill, want - fill);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                fail("read()");
+            }
+            if (n == 0) {
+                lost("Error When Receiving Data");
+            }
+            fill += n;
+            received += n;
+        }
+        receive.end();
+        if (hash) {
+            hashBytes(h, buffer, fill);
+        }
+        if (isDirect && fill % directAlign != 0) {
+            // unaligned tail, finish with a buffered write
+            fcntl(fileFd, F_SETFL, flags);
+            isDirect = false;
+        }
+        TraceSpan span("file pwrite", fill);
+        if (pwrite(fileFd, buffer, fill, pos) != static_cast<ssize_t>(fill)) {
+            fprintf(stderr, "Error When Writing to File\n");
+            exit(EXIT_FAILURE);
+        }
+        advance(fill);
+        if (!isDirect) {
+            // start writeback now, wait for the previous chunk and drop it from the cache
+            sync_file_range(fileFd, pos, fill, SYNC_FILE_RANGE_WRITE);
+            if (pos >= streamChunk) {
+                sync_file_range(fileFd, pos - streamChunk, streamChunk,
+                                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+                posix_fadvise(fileFd, pos - streamChunk, streamChunk, POSIX_FADV_DONTNEED);
+            }
+        }
+        pos += fill;
+    }
+    fcntl(fileFd, F_SETFL, flags);
+    free(buffer);
+    if (hash) {
+        *hash = h;
+    }
+}
+
+size_t Transport::fill() {
+    TraceSpan span("socket readv");
+    while (true) {
+        iovec spans[2];
+        int count = input.spaceSpans(spans);
+        // recvmsg rather than readv: descriptors passed along with a message
+        // would be dropped otherwise
+        char control[CMSG_SPACE(4 * sizeof(int))];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = spans;
+        msg.msg_iovlen = count;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            fail("read()");
+        }
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            for (size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); ++i) {
+                int passedFd;
+                memcpy(&passedFd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                // one descriptor per expected message, the rest are not ours to keep
+                if (fdExpected && passed < 0) {
+                    passed = passedFd;
+                }
+                else {
+                    close(passedFd);
+                }
+            }
+        }
+        input.produce(n);
+        received += n;
+        span.setArg(n);
+        return n;
+    }
+}
+
+void Transport::writeAll(const char* buffer, const size_t& n) {
+    TraceSpan span("socket write", n);
+    size_t sent = 0;
+    while (sent < n) {
+        ssize_t m = ::write(fd, buffer + sent, n - sent);
+        if (m < 0 && errno == EINTR) {
+            continue;
+        }
+        if (m <= 0) {
+            fail("write()");
+        }
+        sent += m;
+        this->sent += m;
+    }
+}
+
+unsigned long Transport::writeChunkedFile(FILE* fp) {
+    int fileFd = fileno(fp);
+    std::vector<char> chunk(maxChunk);
+    unsigned long total = 0;
+    while (true) {
+        pollfd pfd;
+        pfd.fd = fileFd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) == 0) {
+            flush();
+        }
+        TraceSpan span("file read");
+        ssize_t n = ::read(fileFd, chunk.data(), chunk.size());
+        span.setArg(std::max<ssize_t>(n, 0));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            fprintf(stderr, "Error When Reading File\n");
+            exit(EXIT_FAILURE);
+        }
+        uint64_t length = htobe64(n);
+        write(reinterpret_cast<char*>(&length), 8);
+        if (n == 0) {
+            return total;
+        }
+        write(chunk.data(), n);
+        total += n;
+        advance(n);
+    }
+}
+
+unsigned long Transport::readChunkedFile(FILE* fp) {
+    unsigned long total = 0;
+    while (true) {
+        uint64_t length;
+        readExact(reinterpret_cast<char*>(&length), 8);
+        length = be64toh(length);
+        if (length == 0) {
+            return total;
+        }
+        if (length > maxChunk) {
+            lost("Error When Receiving Data");
+        }
+        readFile(fp, length);
+        total += length;
+    }
+}
+
+void Transport::writeExtentHeader(const unsigned long long& offset, const unsigned long long& length) {
+    char header[16];
+    uint64_t o = htobe64(offset), l = htobe64(length);
+    memcpy(header, &o, 8);
+    memcpy(header + 8, &l, 8);
+    write(header, 16);
+}
+
+void Transport::fail(const char* operation) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        lost(std::string(operation) + " Error: peer too slow, session dropped");
+    }
+    lost(std::string(operation) + " Error: " + strerror(errno));
+}
@@ -0,0 +1,180 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+// Buffered TCP connection shared by client and server.
+//
+// Control messages are fixed maxn-byte frames.  Outgoing messages are queued
+// in an output ring and leave in one writev when the connection is about to
+// block on a read (or the ring fills), so a command's replies share segments
+// instead of trickling out one write() each.  Incoming bytes are read in bulk
+// into an input ring and handed out exactly: a short read never yields half a
+// message, and bytes that arrive behind a message (file data) stay buffered
+// for the next call.  Errors on the connection are fatal, as in the rest of
+// the programs: a message on stderr and exit.  A client that reconnects on
+// its own makes them recoverable instead, they throw ConnectionLost.
+
+#include <sys/uio.h>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+constexpr int maxn = 2048;
+
+// the connection broke, what() says how
+class ConnectionLost : public std::runtime_error {
+public:
+    explicit ConnectionLost(const std::string& what) : std::runtime_error(what) {}
+};
+
+// told the number of file bytes that just went over the connection
+typedef std::function<void(const unsigned long& bytes)> ProgressCallback;
+
+// byte ring of power-of-two capacity; spans() hands out the at most two
+// contiguous pieces of the data or of the free space for readv / writev
+class RingBuffer {
+public:
+    explicit RingBuffer(const size_t& capacity);
+    size_t size() const {
+        return tail - head;
+    }
+    size_t space() const {
+        return data.size() - size();
+    }
+    int dataSpans(iovec* spans) const;
+    int spaceSpans(iovec* spans);
+    void produce(const size_t& n) {
+        tail += n;
+    }
+    void consume(const size_t& n) {
+        head += n;
+    }
+    void clear() {
+        head = tail = 0;
+    }
+    size_t read(char* buffer, const size_t& n);
+    size_t write(const char* buffer, const size_t& n);
+
+private:
+    std::vector<char> data;
+    size_t head;    // read position, masked on access
+    size_t tail;    // write position, masked on access
+
+private:
+    int spans(const size_t& from, const size_t& n, iovec* spans) const;
+};
+
+class Transport {
+public:
+    explicit Transport(const int& fd, const size_t& bufferSize = 64 << 10);
+    int getFd() const {
+        return fd;
+    }
+    // carry on over a new connection, whatever was buffered for the old one is dropped
+    void reset(const int& newFd);
+    // throw ConnectionLost on connection errors instead of exiting
+    void setRecoverable(const bool& flag) {
+        recoverable = flag;
+    }
+    bool isRecoverable() const {
+        return recoverable;
+    }
+    // give up on the connection: exit with what on stderr, or throw
+    [[noreturn]] void lost(const std::string& what);
+    // bytes received but not handed out yet
+    size_t buffered() const {
+        return input.size();
+    }
+    // bytes that went through the socket so far, either way
+    unsigned long long bytesReceived() const {
+        return received;
+    }
+    unsigned long long bytesSent() const {
+        return sent;
+    }
+    // one maxn-byte frame into buffer, false when the peer closed the connection
+    bool readMessage(char* buffer);
+    void writeMessage(const char* buffer);
+    // Same-host connections (Unix sockets) can carry an open file in place of
+    // its data: the message leaves with passFd attached (SCM_RIGHTS).  The
+    // receiver calls expectFd(true) before reading the message that may carry
+    // one, picks it up with takeFd() once it read the message, and calls
+    // expectFd(false) after, which closes one it did not take.  Descriptors
+    // arriving at any other time are closed at once, so a peer cannot pile
+    // them up in the process.
+    bool isLocal() const;
+    void writeMessage(const char* buffer, const int& passFd);
+    void expectFd(const bool& expect);
+    // the descriptor that arrived while expected, -1 when none did
+    int takeFd();
+    // send everything queued, done implicitly before any blocking read
+    void flush();
+    void readExact(char* buffer, const size_t& n);
+    void write(const char* buffer, const size_t& n);
+    // called from the file transfers below after every chunk, empty = none
+    void setProgress(const ProgressCallback& callback) {
+        progress = callback;
+    }
+
+    // File payloads of exactly size bytes from/to the current offset of fp.
+    // hash, when given, receives the FNV-1a of the data.  From 2MB on, on
+    // multi-core machines, the disk side runs in a helper thread, up to 4MB
+    // ahead of (or behind) the socket.
+    void writeFile(FILE* fp, const unsigned long& size);
+    void readFile(FILE* fp, const unsigned long& size, unsigned long long* hash = nullptr);
+    // Sparse stream: for every data extent a 16-byte header (offset, length,
+    // big endian) followed by the data, then a header with length 0.  Holes
+    // are never read or sent; the receiver recreates them with ftruncate.
+    static bool isSparse(const int& fileFd);
+    // The first size bytes of fromFd to the same offsets of toFd, in the
+    // kernel with copy_file_range where the filesystems allow it, holes left
+    // as holes.  For files passed over a local connection; false on errors or
+    // when fromFd is shorter than size.
+    static bool copyFile(const int& fromFd, const int& toFd, const unsigned long& size);
+    void writeSparseFile(FILE* fp, const unsigned long& size);
+    void readSparseFile(FILE* fp, const unsigned long& size);
+    // Chunked stream of unknown length, from or to a pipe: every chunk is an
+    // 8-byte big-endian length followed by the data, a length of 0 ends it.
+    // The sender forwards whatever fp has ready, flushing before it waits on
+    // fp for more.  Both return the number of data bytes.
+    unsigned long writeChunkedFile(FILE* fp);
+    unsigned long readChunkedFile(FILE* fp);
+    // Streaming mode for huge files: 1MB reads with readahead requested a
+    // window ahead of the cursor and pages dropped right behind it, so the
+    // transfer does not evict the rest of the page cache.  With direct,
+    // O_DIRECT bypasses the cache where the filesystem allows it.
+    void streamWriteFile(FILE* fp, const unsigned long& size, const bool& direct);
+    void streamReadFile(FILE* fp, const unsigned long& size, const bool& direct,
+                        unsigned long long* hash = nullptr);
+
+private:
+    int fd;
+    RingBuffer input;
+    RingBuffer output;
+    ProgressCallback progress;
+    bool recoverable;
+    unsigned long long received;
+    unsigned long long sent;
+    bool fdExpected;
+    int passed;                 // descriptor received while expected, not taken yet
+
+private:
+    // one readv into the input ring, 0 on end of stream
+    size_t fill();
+    void writeAll(const char* buffer, const size_t& n);
+    // large payloads: a second thread does the disk side through a bounded
+    // queue of buffers, so disk and socket I/O overlap instead of alternating
+    void pipelinedWriteFile(FILE* fp, const unsigned long& size);
+    void pipelinedReadFile(FILE* fp, const unsigned long& size, unsigned long long* hash);
+    void advance(const unsigned long& n) {
+        if (progress) {
+            progress(n);
+        }
+    }
+    void writeExtentHeader(const unsigned long long& offset, const unsigned long long& length);
+    void fail(const char* operation);
+};
+
+#endif // TRANSPORT_H
@@ -0,0 +1,660 @@
+#include "udptransfer.h"
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace {
+
+constexpr uint32_t typeData = 0x42440001u;
+constexpr uint32_t typeAck = 0x42440002u;
+constexpr int chunkSize = 1400;             // payload per datagram, fits a 1500 byte MTU
+constexpr int headerSize = 16;              // type, seq, send timestamp
+constexpr int packetSize = chunkSize + headerSize;
+constexpr int batchSize = 32;               // datagrams per sendmmsg / recvmmsg / GSO send
+constexpr int ackHeaderSize = 28;
+constexpr int maxRanges = 128;              // SACK ranges carried by one ACK
+constexpr int ackEvery = 16;                // data packets per ACK
+constexpr uint64_t ackIntervalUs = 5000;
+constexpr uint64_t minRoundUs = 5000;
+constexpr uint64_t idleTimeoutUs = 15000000;
+constexpr int socketBufferSize = 8 << 20;
+constexpr double initialRate = 4e6;         // bytes per second
+constexpr double minRate = 256e3;
+constexpr double probeGain[] = { 1.25, 0.75, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0 };
+
+enum ChunkState : uint8_t {
+    chunkUnsent = 0,
+    chunkInFlight = 1,
+    chunkLost = 2,
+    chunkAcked = 3
+};
+
+uint64_t nowUs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000u + ts.tv_nsec / 1000;
+}
+
+void put32(char* p, const uint32_t& v) {
+    uint32_t n = htonl(v);
+    memcpy(p, &n, sizeof(n));
+}
+
+void put64(char* p, const uint64_t& v) {
+    put32(p, static_cast<uint32_t>(v >> 32));
+    put32(p + 4, static_cast<uint32_t>(v));
+}
+
+uint32_t get32(const char* p) {
+    uint32_t n;
+    memcpy(&n, p, sizeof(n));
+    return ntohl(n);
+}
+
+uint64_t get64(const char* p) {
+    return (static_cast<uint64_t>(get32(p)) << 32) | get32(p + 4);
+}
+
+void setupSocket(const int& fd) {
+    int size = socketBufferSize;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// wait for fds until deadline (absolute, microseconds); returns poll() result
+int waitUntil(pollfd* fds, const int& n, const uint64_t& deadline) {
+    uint64_t now = nowUs();
+    uint64_t wait = deadline > now ? deadline - now : 0;
+    timespec ts;
+    ts.tv_sec = wait / 1000000u;
+    ts.tv_nsec = (wait % 1000000u) * 1000;
+    return ppoll(fds, n, &ts, nullptr);
+}
+
+// Outgoing datagram path shared by both ends.  Loss and delay are injected
+// here, before the kernel sees the packet, so a loopback run behaves like a
+// lossy long-haul link.  GSO is only used when nothing is injected, since the
+// kernel would otherwise segment packets we meant to drop individually.
+class UdpLink {
+public:
+    UdpLink(const int& fd, const UdpConfig& config)
+        : fd(fd), config(config), rng(std::random_device{}()), coin(0.0, 1.0),
+          gso(config.lossRate <= 0.0 && config.delayMs <= 0) {
+
+    }
+    // packets are laid out back to back in buffer, lens[i] bytes each
+    void sendBatch(const char* buffer, const int* lens, const int& count, const uint64_t& now) {
+        if (config.lossRate <= 0.0 && config.delayMs <= 0) {
+            if (gso && count > 1 && sendGso(buffer, lens, count)) {
+                return;
+            }
+            sendNow(buffer, lens, count);
+            return;
+        }
+        const char* p = buffer;
+        for (int i = 0; i < count; p += lens[i], ++i) {
+            if (config.lossRate > 0.0 && coin(rng) < config.lossRate) {
+                continue;
+            }
+            if (config.delayMs > 0) {
+                delayed.push_back(Delayed{ now + static_cast<uint64_t>(config.delayMs) * 1000u, std::string(p, lens[i]) });
+            }
+            else {
+                sendNow(p, &lens[i], 1);
+            }
+        }
+    }
+    // release delayed datagrams that are due
+    void flush(const uint64_t& now) {
+        while (!delayed.empty() && delayed.front().due <= now) {
+            int len = static_cast<int>(delayed.front().data.size());
+            sendNow(delayed.front().data.data(), &len, 1);
+            delayed.pop_front();
+        }
+    }
+    // absolute time of the next delayed datagram, 0 if none
+    uint64_t nextDue() const {
+        return delayed.empty() ? 0 : delayed.front().due;
+    }
+
+private:
+    struct Delayed {
+        uint64_t due;
+        std::string data;
+    };
+
+private:
+    int fd;
+    UdpConfig config;
+    std::mt19937 rng;
+    std::uniform_real_distribution<double> coin;
+    bool gso;
+    std::deque<Delayed> delayed;
+
+private:
+    void sendNow(const char* buffer, const int* lens, const int& count) {
+        mmsghdr msgs[batchSize];
+        iovec iovs[batchSize];
+        int sent = 0;
+        while (sent < count) {
+            int n = std::min(count - sent, batchSize);
+            const char* p = buffer;
+            for (int i = 0; i < sent; ++i) {
+                p += lens[i];
+            }
+            for (int i = 0; i < n; ++i) {
+                iovs[i].iov_base = const_cast<char*>(p);
+                iovs[i].iov_len = lens[sent + i];
+                p += lens[sent + i];
+                memset(&msgs[i], 0, sizeof(mmsghdr));
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            int m = sendmmsg(fd, msgs, n, 0);
+            if (m <= 0) {
+                // EAGAIN / ECONNREFUSED: the datagrams are lost, retransmission covers it
+                return;
+            }
+            sent += m;
+        }
+    }
+    // one sendmsg carrying every packet, cut into packetSize segments by the kernel
+    bool sendGso(const char* buffer, const int* lens, const int& count) {
+#ifdef UDP_SEGMENT
+        int total = 0;
+        for (int i = 0; i < count; ++i) {
+            if (i + 1 < count && lens[i] != packetSize) {
+                return false;
+            }
+            total += lens[i];
+        }
+        iovec iov;
+        iov.iov_base = const_cast<char*>(buffer);
+        iov.iov_len = total;
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        memset(control, 0, sizeof(control));
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t segment = packetSize;
+        memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+        if (sendmsg(fd, &msg, 0) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED) {
+                return true;
+            }
+            // no GSO support on this path, fall back to sendmmsg for good
+            gso = false;
+            return false;
+        }
+        return true;
+#else
+        (void)buffer;
+        (void)lens;
+        (void)count;
+        gso = false;
+        return false;
+#endif
+    }
+};
+
+} // namespace
+
+int UdpTransfer::openReceiver(const int& controlFd, int& port) {
+    sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(controlFd, reinterpret_cast<sockaddr*>(&addr), &len) < 0) {
+        fprintf(stderr, "getsockname Error\n");
+        return -1;
+    }
+    // a Unix socket session has no address to bind next to
+    if (addr.sin_family != AF_INET) {
+        fprintf(stderr, "UDP Needs an IPv4 Control Connection\n");
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Socket Error\n");
+        return -1;
+    }
+    addr.sin_port = htons(0);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        fprintf(stderr, "Bind Error\n");
+        close(fd);
+        return -1;
+    }
+    len = sizeof(addr);
+    getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+    port = ntohs(addr.sin_port);
+    setupSocket(fd);
+    return fd;
+}
+
+// Sender: paced by a delivery-rate estimate rather than a loss-driven window,
+// so random loss on the link does not collapse throughput the way it does for
+// TCP.  The rate doubles per round until the measured delivery rate stops
+// growing, then cycles gently above and below it to probe for more bandwidth.
+// Only heavy loss (a quarter of a round) is read as congestion.  Losses are
+// detected by time (a chunk sent before the newest acknowledged one) and by a
+// retransmission timeout for the tail.
+bool UdpTransfer::sendFile(const int& controlFd, const int& udpPort, const int& fileFd,
+                           const unsigned long& size, const UdpConfig& config) {
+    sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    if (getpeername(controlFd, reinterpret_cast<sockaddr*>(&peer), &len) < 0) {
+        fprintf(stderr, "getpeername Error\n");
+        return false;
+    }
+    if (peer.sin_family != AF_INET) {
+        fprintf(stderr, "UDP Needs an IPv4 Control Connection\n");
+        return false;
+    }
+    peer.sin_port = htons(udpPort);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Socket Error\n");
+        return false;
+    }
+    if (connect(fd, reinterpret_cast<sockaddr*>(&peer), sizeof(peer)) < 0) {
+        fprintf(stderr, "Connect Error\n");
+        close(fd);
+        return false;
+    }
+    setupSocket(fd);
+    UdpLink link(fd, config);
+
+    const uint32_t total = static_cast<uint32_t>((size + chunkSize - 1) / chunkSize);
+    std::vector<uint8_t> state(total, chunkUnsent);
+    std::vector<uint64_t> sentAt(total, 0);
+    std::deque<std::pair<uint32_t, uint64_t> > sentOrder;
+    std::deque<uint32_t> lostQueue;
+    uint32_t nextNew = 0, cumAck = 0, acked = 0;
+    uint64_t inFlight = 0;
+    unsigned long reported = 0;
+
+    uint64_t now = nowUs();
+    double rate = initialRate;
+    double tokens = packetSize * batchSize;
+    uint64_t lastRefill = now;
+    double srtt = 0.0;
+    uint64_t sampleTime = now, sampleDelivered = 0, delivered = 0;
+    double maxDelivery = 0.0, lastRoundDelivery = 0.0;
+    bool startup = true;
+    int flatRounds = 0, gainIndex = 0;
+    uint64_t roundStart = now;
+    uint32_t sentInRound = 0, lostInRound = 0;
+
+    std::vector<char> batch(batchSize * packetSize);
+    int lens[batchSize];
+    char ackBuffers[batchSize][packetSize];
+    mmsghdr ackMsgs[batchSize];
+    iovec ackIovs[batchSize];
+
+    bool ok = true;
+    while (true) {
+        now = nowUs();
+        link.flush(now);
+        tokens = std::min(tokens + rate * (now - lastRefill) / 1e6,
+                          std::max<double>(2.0 * batchSize * packetSize, rate * 0.002));
+        lastRefill = now;
+        double roundUs = std::max<double>(srtt, minRoundUs);
+        double cap = std::max(64.0, 2.0 * rate * std::max(roundUs, 10000.0) / 1e6 / packetSize);
+        // send as many batches as tokens and the in-flight cap allow
+        while (acked < total) {
+            int count = 0;
+            char* p = batch.data();
+            while (count < batchSize && tokens >= packetSize && inFlight < cap) {
+                uint32_t seq;
+                if (!lostQueue.empty()) {
+                    seq = lostQueue.front();
+                    lostQueue.pop_front();
+                    if (state[seq] != chunkLost) {
+                        continue;
+                    }
+                }
+                else if (nextNew < total) {
+                    seq = nextNew++;
+                }
+                else {
+                    break;
+                }
+                uint64_t offset = static_cast<uint64_t>(seq) * chunkSize;
+                int n = static_cast<int>(std::min<uint64_t>(chunkSize, size - offset));
+                ssize_t r = pread(fileFd, p + headerSize, n, offset);
+                if (r != n) {
+                    fprintf(stderr, "Error When Reading File\n");
+                    ok = false;
+                    break;
+                }
+                put32(p, typeData);
+                put32(p + 4, seq);
+                put64(p + 8, now);
+                state[seq] = chunkInFlight;
+                sentAt[seq] = now;
+                sentOrder.push_back(std::make_pair(seq, now));
+                ++inFlight;
+                ++sentInRound;
+                lens[count++] = n + headerSize;
+                p += n + headerSize;
+                tokens -= n + headerSize;
+            }
+            if (count == 0) {
+                break;
+            }
+            link.sendBatch(batch.data(), lens, count, now);
+        }
+        if (!ok) {
+            break;
+        }
+        // wait for ACKs, the verdict on the control connection, or the next send slot
+        uint64_t deadline = now + 5000;
+        if (acked < total && tokens < packetSize && rate > 0.0) {
+            deadline = std::min<uint64_t>(deadline, now + static_cast<uint64_t>((packetSize - tokens) * 1e6 / rate) + 1);
+        }
+        if (link.nextDue() != 0) {
+            deadline = std::min(deadline, link.nextDue());
+        }
+        pollfd fds[2];
+        fds[0].fd = fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = controlFd;
+        fds[1].events = POLLIN;
+        if (waitUntil(fds, 2, deadline) < 0 && errno != EINTR) {
+            fprintf(stderr, "poll() Error\n");
+            ok = false;
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        now = nowUs();
+        uint64_t echo = 0;
+        while (true) {
+            for (int i = 0; i < batchSize; ++i) {
+                ackIovs[i].iov_base = ackBuffers[i];
+                ackIovs[i].iov_len = packetSize;
+                memset(&ackMsgs[i], 0, sizeof(mmsghdr));
+                ackMsgs[i].msg_hdr.msg_iov = &ackIovs[i];
+                ackMsgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            int m = recvmmsg(fd, ackMsgs, batchSize, MSG_DONTWAIT, nullptr);
+            if (m <= 0) {
+                break;
+            }
+            for (int i = 0; i < m; ++i) {
+                const char* a = ackBuffers[i];
+                int alen = static_cast<int>(ackMsgs[i].msg_len);
+                if (alen < ackHeaderSize || get32(a) != typeAck) {
+                    continue;
+                }
+                uint32_t newCum = std::min(get32(a + 4), total);
+                uint64_t ackEcho = get64(a + 8);
+                delivered = std::max(delivered, get64(a + 16));
+                uint32_t ranges = std::min<uint32_t>(get32(a + 24), (alen - ackHeaderSize) / 8);
+                if (ackEcho > echo && ackEcho <= now) {
+                    echo = ackEcho;
+                }
+                for (; cumAck < newCum; ++cumAck) {
+                    if (state[cumAck] != chunkAcked) {
+                        if (state[cumAck] == chunkInFlight) {
+                            --inFlight;
+                        }
+                        state[cumAck] = chunkAcked;
+                        ++acked;
+                    }
+                }
+                for (uint32_t r = 0; r < ranges; ++r) {
+                    uint32_t s = get32(a + ackHeaderSize + r * 8);
+                    uint32_t e = std::min(get32(a + ackHeaderSize + r * 8 + 4), total);
+                    for (uint32_t k = s; k < e; ++k) {
+                        if (state[k] != chunkAcked) {
+                            if (state[k] == chunkInFlight) {
+                                --inFlight;
+                            }
+                            state[k] = chunkAcked;
+                            ++acked;
+                        }
+                    }
+                }
+            }
+        }
+        // acknowledged bytes so far, the last chunk may be short
+        unsigned long ackedBytes = std::min<unsigned long>(static_cast<unsigned long>(acked) * chunkSize, size);
+        if (config.progress && ackedBytes > reported) {
+            config.progress(ackedBytes - reported);
+            reported = ackedBytes;
+        }
+        if (echo != 0) {
+            double sample = static_cast<double>(now - echo);
+            srtt = srtt == 0.0 ? sample : srtt * 0.875 + sample * 0.125;
+        }
+        // time-based loss detection over the send log, oldest first
+        double reorder = std::max(srtt / 8.0, 1000.0);
+        double rto = srtt == 0.0 ? 200000.0 : std::max(2.0 * srtt + 10000.0, 20000.0);
+        while (!sentOrder.empty()) {
+            uint32_t seq = sentOrder.front().first;
+            uint64_t when = sentOrder.front().second;
+            if (state[seq] != chunkInFlight || sentAt[seq] != when) {
+                sentOrder.pop_front();
+                continue;
+            }
+            bool overtaken = echo != 0 && when + reorder < echo;
+            bool expired = now > when && now - when > rto;
+            if (!overtaken && !expired) {
+                break;
+            }
+            state[seq] = chunkLost;
+            lostQueue.push_back(seq);
+            --inFlight;
+            ++lostInRound;
+            sentOrder.pop_front();
+        }
+        // rate control, once per round trip
+        if (now - roundStart >= roundUs && now > sampleTime) {
+            double sample = (delivered - sampleDelivered) * 1e6 / (now - sampleTime);
+            maxDelivery = std::max(sample, maxDelivery * 0.98);
+            if (sentInRound > 20 && lostInRound * 4 > sentInRound) {
+                rate = std::max(sample, rate * 0.7);
+                maxDelivery = rate;
+                startup = false;
+            }
+            else if (startup) {
+                flatRounds = sample >= lastRoundDelivery * 1.25 ? 0 : flatRounds + 1;
+                lastRoundDelivery = std::max(lastRoundDelivery, sample);
+                if (flatRounds >= 3) {
+                    startup = false;
+                    rate = maxDelivery;
+                }
+                else {
+                    rate *= 2.0;
+                }
+            }
+            else {
+                rate = maxDelivery * probeGain[gainIndex++ % 8];
+            }
+            rate = std::max(rate, minRate);
+            roundStart = now;
+            sampleTime = now;
+            sampleDelivered = delivered;
+            sentInRound = 0;
+            lostInRound = 0;
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+// Receiver: chunks land at their final offset with pwrite, so no reorder
+// buffer is needed; a byte per chunk tracks what has arrived.
+bool UdpTransfer::recvFile(const int& controlFd, const int& udpFd, const int& fileFd,
+                           const unsigned long& size, const UdpConfig& config) {
+    if (size == 0) {
+        return true;
+    }
+    // anyone can reach the port, the data has to come from the other end of the session
+    sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    if (getpeername(controlFd, reinterpret_cast<sockaddr*>(&peer), &len) < 0 || peer.sin_family != AF_INET) {
+        fprintf(stderr, "getpeername Error\n");
+        return false;
+    }
+    if (ftruncate(fileFd, size) < 0) {
+        fprintf(stderr, "Error When Writing to File\n");
+        return false;
+    }
+    UdpLink link(udpFd, config);
+    const uint32_t total = static_cast<uint32_t>((size + chunkSize - 1) / chunkSize);
+    std::vector<uint8_t> got(total, 0);
+    uint32_t cumAck = 0, received = 0, highest = 0;
+    uint64_t delivered = 0, echo = 0, reported = 0;
+    bool connected = false;
+    int sinceAck = 0;
+    uint64_t now = nowUs();
+    uint64_t lastAck = now, lastData = now;
+
+    char buffers[batchSize][packetSize];
+    mmsghdr msgs[batchSize];
+    iovec iovs[batchSize];
+    sockaddr_in from[batchSize];
+    char ack[ackHeaderSize + maxRanges * 8];
+
+    while (received < total) {
+        uint64_t deadline = lastData + idleTimeoutUs;
+        if (sinceAck > 0) {
+            deadline = std::min(deadline, lastAck + ackIntervalUs);
+        }
+        if (link.nextDue() != 0) {
+            deadline = std::min(deadline, link.nextDue());
+        }
+        pollfd pfd;
+        pfd.fd = udpFd;
+        pfd.events = POLLIN;
+        if (waitUntil(&pfd, 1, deadline) < 0 && errno != EINTR) {
+            fprintf(stderr, "poll() Error\n");
+            return false;
+        }
+        while (true) {
+            for (int i = 0; i < batchSize; ++i) {
+                iovs[i].iov_base = buffers[i];
+                iovs[i].iov_len = packetSize;
+                memset(&msgs[i], 0, sizeof(mmsghdr));
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                msgs[i].msg_hdr.msg_name = &from[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            }
+            int m = recvmmsg(udpFd, msgs, batchSize, MSG_DONTWAIT, nullptr);
+            if (m <= 0) {
+                break;
+            }
+            // only datagrams that pass the checks below keep the transfer alive
+            bool accepted = false;
+            for (int i = 0; i < m; ++i) {
+                int plen = static_cast<int>(msgs[i].msg_len) - headerSize;
+                if (plen < 0 || get32(buffers[i]) != typeData) {
+                    continue;
+                }
+                // connect() filters new datagrams, not those queued before it
+                if (msgs[i].msg_hdr.msg_namelen < sizeof(sockaddr_in) || from[i].sin_family != AF_INET ||
+                    from[i].sin_addr.s_addr != peer.sin_addr.s_addr ||
+                    (connected && from[i].sin_port != peer.sin_port)) {
+                    continue;
+                }
+                if (!connected) {
+                    // lock onto the sender so ACKs can use the connected send path
+                    peer.sin_port = from[i].sin_port;
+                    if (connect(udpFd, reinterpret_cast<sockaddr*>(&peer), sizeof(sockaddr_in)) < 0) {
+                        fprintf(stderr, "Connect Error\n");
+                        return false;
+                    }
+                    connected = true;
+                }
+                uint32_t seq = get32(buffers[i] + 4);
+                uint64_t offset = static_cast<uint64_t>(seq) * chunkSize;
+                if (seq >= total || plen != static_cast<int>(std::min<uint64_t>(chunkSize, size - offset))) {
+                    continue;
+                }
+                accepted = true;
+                echo = std::max(echo, get64(buffers[i] + 8));
+                ++sinceAck;
+                if (got[seq]) {
+                    continue;
+                }
+                if (pwrite(fileFd, buffers[i] + headerSize, plen, offset) != plen) {
+                    fprintf(stderr, "Error When Writing to File\n");
+                    return false;
+                }
+                got[seq] = 1;
+                ++received;
+                delivered += plen;
+                highest = std::max(highest, seq + 1);
+            }
+            if (accepted) {
+                lastData = nowUs();
+            }
+        }
+        if (config.progress && delivered > reported) {
+            config.progress(delivered - reported);
+            reported = delivered;
+        }
+        while (cumAck < total && got[cumAck]) {
+            ++cumAck;
+        }
+        now = nowUs();
+        if (sinceAck > 0 && (sinceAck >= ackEvery || now - lastAck >= ackIntervalUs || received == total)) {
+            // SACK ranges of received chunks above the cumulative point
+            uint32_t ranges = 0;
+            std::vector<uint8_t>::const_iterator it = got.begin() + cumAck;
+            std::vector<uint8_t>::const_iterator end = got.begin() + highest;
+            while (ranges < static_cast<uint32_t>(maxRanges) && it < end) {
+                it = std::find(it, end, 1);
+                if (it == end) {
+                    break;
+                }
+                std::vector<uint8_t>::const_iterator stop = std::find(it, end, 0);
+                put32(ack + ackHeaderSize + ranges * 8, static_cast<uint32_t>(it - got.begin()));
+                put32(ack + ackHeaderSize + ranges * 8 + 4, static_cast<uint32_t>(stop - got.begin()));
+                ++ranges;
+                it = stop;
+            }
+            put32(ack, typeAck);
+            put32(ack + 4, cumAck);
+            put64(ack + 8, echo);
+            put64(ack + 16, delivered);
+            put32(ack + 24, ranges);
+            int alen = ackHeaderSize + ranges * 8;
+            link.sendBatch(ack, &alen, 1, now);
+            sinceAck = 0;
+            lastAck = now;
+        }
+        link.flush(now);
+        if (now - lastData > idleTimeoutUs) {
+            fprintf(stderr, "UDP transfer timed out\n");
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,44 @@
+#ifndef UDPTRANSFER_H
+#define UDPTRANSFER_H
+
+// UDP bulk data channel, negotiated over the TCP control session.
+//
+// The receiver binds an ephemeral port (openReceiver) and announces it over
+// TCP, the sender streams fixed-size chunks to it at a paced rate, and the
+// receiver answers with cumulative + selective acknowledgements.  The final
+// verdict (UDP_COMPLETE / UDP_FAILED) always travels over the TCP control
+// connection, so both ends agree on the result even if the last ACKs are lost.
+
+#include <functional>
+
+struct UdpConfig {
+    // delayed datagrams are held in memory, so the delay is bounded
+    static const int maxDelayMs = 10000;
+    double lossRate;    // fraction of outgoing datagrams dropped on purpose, 0.0 up to but not 1.0
+    int delayMs;        // artificial delay added to every outgoing datagram, 0 - maxDelayMs
+    // told the bytes newly acknowledged (sender) or received (receiver), may be empty
+    std::function<void(const unsigned long& bytes)> progress;
+    UdpConfig() : lossRate(0.0), delayMs(0) {}
+    // loss and delay within the ranges above; written so NaN fails
+    bool valid() const {
+        return lossRate >= 0.0 && lossRate < 1.0 && delayMs >= 0 && delayMs <= maxDelayMs;
+    }
+};
+
+class UdpTransfer {
+public:
+    // bind a UDP socket on the local address used by controlFd, return fd (-1 on error)
+    static int openReceiver(const int& controlFd, int& port);
+    // stream size bytes of fileFd to the control peer's address at udpPort.
+    // Returns once the control connection becomes readable (verdict pending)
+    // or false on a local error; the caller reads the verdict.
+    static bool sendFile(const int& controlFd, const int& udpPort, const int& fileFd,
+                         const unsigned long& size, const UdpConfig& config);
+    // receive size bytes into fileFd, return true when every chunk arrived;
+    // only datagrams from the control peer's address count, and once the
+    // first arrived only those from its port
+    static bool recvFile(const int& controlFd, const int& udpFd, const int& fileFd,
+                         const unsigned long& size, const UdpConfig& config);
+};
+
+#endif // UDPTRANSFER_H
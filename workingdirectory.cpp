@@ -0,0 +1,86 @@
+#include "workingdirectory.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+
+bool WorkingDirectory::isDirExist(const std::string& path) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) {
+        if (errno == ENOENT) {
+            return false;
+        }
+        else if (errno == EACCES) {
+            return false;
+        }
+        else {
+            return false;
+        }
+    }
+    if (S_ISREG(st.st_mode)) {
+        return false;
+    }
+    else if (S_ISDIR(st.st_mode)) {
+        return true;
+    }
+    else {
+        return false;
+    }
+}
+
+WorkingDirectory::WorkingDirectory() : storage(&StorageBackend::local()) {
+    updatePath();
+    startupPath = path;
+}
+
+WorkingDirectory::WorkingDirectory(StorageBackend& storage) : storage(&storage) {
+    updatePath();
+    startupPath = path;
+}
+
+WorkingDirectory::~WorkingDirectory() {
+
+}
+
+void WorkingDirectory::init(const std::string& initPath) {
+    path = convertPath(initPath);
+    startupPath = convertPath(initPath);
+}
+
+std::string WorkingDirectory::changeDir(const std::string& newPath) {
+    if (storage->changeDir(newPath) < 0) {
+        if (errno == ENOENT) {
+            return newPath + ": No such file or directory";
+        }
+        else if (errno == ENOTDIR) {
+            return newPath + " is not a directory";
+        }
+        else if (errno == EACCES) {
+            return newPath + ": Permission denied";
+        }
+        else {
+            return newPath + ": Unexpected error";
+        }
+    }
+    updatePath();
+    return "";
+}
+
+void WorkingDirectory::updatePath() {
+    path = storage->currentDir();
+    if (path == "") {
+        fprintf(stderr, "getcwd Error\nProgram Terminated!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+std::string WorkingDirectory::convertPath(const std::string& base) {
+    std::string ret = base;
+    if (ret != "/" && ret.back() == '/') {
+        ret.pop_back();
+    }
+    return ret;
+}
@@ -0,0 +1,37 @@
+#ifndef WORKINGDIRECTORY_H
+#define WORKINGDIRECTORY_H
+
+#include <string>
+#include "storage.h"
+
+// working directory of a storage backend, the process one for the local
+// filesystem, as seen by the commands of a session
+class WorkingDirectory {
+public:
+    static bool isDirExist(const std::string& path);
+
+public:
+    WorkingDirectory();
+    explicit WorkingDirectory(StorageBackend& storage);
+    virtual ~WorkingDirectory();
+    void init(const std::string& initPath);
+    std::string getPath() const {
+        return path;
+    }
+    std::string getStartupPath() const {
+        return startupPath;
+    }
+    // returns an error message, empty on success
+    std::string changeDir(const std::string& newPath);
+
+private:
+    StorageBackend* storage;
+    std::string path;
+    std::string startupPath;
+
+private:
+    void updatePath();
+    std::string convertPath(const std::string& base);
+};
+
+#endif // WORKINGDIRECTORY_H